@@ -0,0 +1,578 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binaryLog.h"
+#include "util.h"
+
+#define MAX_NAME_LENGTH 255
+#define MAX_VARINT_LENGTH 10
+// the difference between two unsigned shorts needs 17 bits once zigzag encoded plus the run bit from version 2
+#define MAX_VALUE_LENGTH 3
+
+#define FLAG_KEYFRAME 0x01
+// bit (FLAG_BITMAP_SHIFT + signal) is set if the bitmap for the signal is included in the row
+#define FLAG_BITMAP_SHIFT 1
+
+struct columns_t {
+	long timestamp;
+	long soc[BINARY_LOG_SOC_COUNT];
+	// last valid value of each cell, the previous rows' bitmaps
+	unsigned short *values[BINARY_LOG_SIGNAL_COUNT];
+	unsigned char *valid[BINARY_LOG_SIGNAL_COUNT];
+};
+
+struct binaryLog_writer_t {
+	FILE *out;
+	unsigned short cellCount;
+	unsigned short rowsSinceKeyframe;
+	unsigned char forceKeyframe;
+	unsigned char wasKeyframe;
+	// the row length is padded to this many bytes so rows can be encoded in place
+	unsigned char lengthBytes;
+	struct columns_t previous;
+	unsigned char *buf;
+	unsigned int bufLength;
+};
+
+struct binaryLog_reader_t {
+	FILE *in;
+	char name[MAX_NAME_LENGTH + 1];
+	unsigned short cellCount;
+	unsigned char version;
+	unsigned char isKeyframe;
+	unsigned char isNewSession;
+	unsigned char hasHeader;
+	// set after seeking, the next row has to be a keyframe as there is nothing to apply deltas to
+	unsigned char needsKeyframe;
+	struct columns_t previous;
+	struct binaryLog_row_t row;
+	unsigned char *buf;
+	unsigned int bufLength;
+};
+
+static unsigned short bitmapLength(unsigned short cellCount) {
+	return (cellCount + 7) / 8;
+}
+
+static int allocColumns(struct columns_t *columns, unsigned short cellCount) {
+	memset(columns, 0, sizeof(struct columns_t));
+	for (int i = 0; i < BINARY_LOG_SIGNAL_COUNT; i++) {
+		columns->values[i] = calloc(cellCount ? cellCount : 1, sizeof(unsigned short));
+		columns->valid[i] = calloc(bitmapLength(cellCount) ? bitmapLength(cellCount) : 1, 1);
+		if (!columns->values[i] || !columns->valid[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void freeColumns(struct columns_t *columns) {
+	for (int i = 0; i < BINARY_LOG_SIGNAL_COUNT; i++) {
+		free(columns->values[i]);
+		free(columns->valid[i]);
+		columns->values[i] = NULL;
+		columns->valid[i] = NULL;
+	}
+}
+
+static void resetColumns(struct columns_t *columns, unsigned short cellCount) {
+	columns->timestamp = 0;
+	memset(columns->soc, 0, sizeof(columns->soc));
+	for (int i = 0; i < BINARY_LOG_SIGNAL_COUNT; i++) {
+		memset(columns->values[i], 0, cellCount * sizeof(unsigned short));
+		memset(columns->valid[i], 0, bitmapLength(cellCount));
+	}
+}
+
+int binaryLog_allocRow(struct binaryLog_row_t *row, unsigned short cellCount) {
+	memset(row, 0, sizeof(struct binaryLog_row_t));
+	for (int i = 0; i < BINARY_LOG_SIGNAL_COUNT; i++) {
+		row->values[i] = calloc(cellCount ? cellCount : 1, sizeof(unsigned short));
+		row->valid[i] = calloc(bitmapLength(cellCount) ? bitmapLength(cellCount) : 1, 1);
+		if (!row->values[i] || !row->valid[i]) {
+			binaryLog_freeRow(row);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void binaryLog_freeRow(struct binaryLog_row_t *row) {
+	for (int i = 0; i < BINARY_LOG_SIGNAL_COUNT; i++) {
+		free(row->values[i]);
+		free(row->valid[i]);
+		row->values[i] = NULL;
+		row->valid[i] = NULL;
+	}
+}
+
+void binaryLog_setValid(struct binaryLog_row_t *row, binaryLog_signal_t signal, unsigned short cell, unsigned char isValid) {
+	if (isValid) {
+		row->valid[signal][cell / 8] |= 1 << (cell % 8);
+	} else {
+		row->valid[signal][cell / 8] &= ~(1 << (cell % 8));
+	}
+}
+
+static unsigned int putVarint(unsigned char *buf, unsigned long long value) {
+	unsigned int i = 0;
+	while (value >= 0x80) {
+		buf[i++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	buf[i++] = (unsigned char) value;
+	return i;
+}
+
+static unsigned int putSigned(unsigned char *buf, long long value) {
+	return putVarint(buf, ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63));
+}
+
+/** @return the number of bytes read or 0 if the varint runs past the end of the buffer */
+static unsigned int getVarint(const unsigned char *buf, unsigned int length, unsigned long long *value) {
+	*value = 0;
+	for (unsigned int i = 0; i < length && i < MAX_VARINT_LENGTH; i++) {
+		*value |= ((unsigned long long) (buf[i] & 0x7f)) << (7 * i);
+		if (!(buf[i] & 0x80)) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static long long unzigzag(unsigned long long raw) {
+	return (long long) (raw >> 1) ^ -(long long) (raw & 1);
+}
+
+static unsigned int getSigned(const unsigned char *buf, unsigned int length, long long *value) {
+	unsigned long long raw;
+	unsigned int result = getVarint(buf, length, &raw);
+	*value = unzigzag(raw);
+	return result;
+}
+
+/** A varint padded with continuation bytes to length bytes, value must fit */
+static void putPaddedVarint(unsigned char *buf, unsigned long long value, unsigned char length) {
+	for (unsigned char i = 0; i + 1 < length; i++) {
+		buf[i] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	buf[length - 1] = (unsigned char) value;
+}
+
+/** A run of count unchanged values from version 2, the low bit is set and count - 1 follows */
+static unsigned int putRun(unsigned char *buf, unsigned int count) {
+	return count ? putVarint(buf, ((unsigned long long) (count - 1) << 1) | 1) : 0;
+}
+
+struct binaryLog_writer_t *binaryLog_openWriter(FILE *out, const char *name, unsigned short cellCount) {
+	struct binaryLog_writer_t *writer = calloc(1, sizeof(struct binaryLog_writer_t));
+	if (!writer) {
+		return NULL;
+	}
+	writer->out = out;
+	writer->cellCount = cellCount;
+	writer->forceKeyframe = 1;
+	writer->bufLength = binaryLog_maxRowLength(writer);
+	unsigned char lengthBuf[MAX_VARINT_LENGTH];
+	writer->lengthBytes = putVarint(lengthBuf, writer->bufLength);
+	writer->buf = malloc(writer->bufLength);
+	if (!writer->buf || allocColumns(&writer->previous, cellCount)) {
+		binaryLog_closeWriter(writer);
+		return NULL;
+	}
+
+	if (out && !binaryLog_writeHeader(out, name, cellCount)) {
+		binaryLog_closeWriter(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+unsigned int binaryLog_headerLength(const char *name) {
+	size_t nameLength = strlen(name);
+	return 7 + (nameLength > MAX_NAME_LENGTH ? MAX_NAME_LENGTH : nameLength);
+}
+
+unsigned int binaryLog_writeHeader(FILE *out, const char *name, unsigned short cellCount) {
+	size_t nameLength = strlen(name);
+	if (nameLength > MAX_NAME_LENGTH) {
+		nameLength = MAX_NAME_LENGTH;
+	}
+	unsigned char header[7];
+	header[0] = BINARY_LOG_RECORD_HEADER;
+	header[1] = BINARY_LOG_VERSION;
+	header[2] = (unsigned char) (cellCount & 0xff);
+	header[3] = (unsigned char) (cellCount >> 8);
+	header[4] = BINARY_LOG_SOC_COUNT;
+	header[5] = BINARY_LOG_SIGNAL_COUNT;
+	header[6] = (unsigned char) nameLength;
+	if (fwrite(header, sizeof(header), 1, out) != 1 || fwrite(name, 1, nameLength, out) != nameLength) {
+		return 0;
+	}
+	return sizeof(header) + nameLength;
+}
+
+unsigned int binaryLog_maxRowLength(struct binaryLog_writer_t *writer) {
+	return 1 + MAX_VARINT_LENGTH + 1 + MAX_VARINT_LENGTH + BINARY_LOG_SOC_COUNT * MAX_VARINT_LENGTH
+			+ BINARY_LOG_SIGNAL_COUNT * (bitmapLength(writer->cellCount) + writer->cellCount * MAX_VALUE_LENGTH);
+}
+
+void binaryLog_forceKeyframe(struct binaryLog_writer_t *writer) {
+	writer->forceKeyframe = 1;
+}
+
+unsigned char binaryLog_wasKeyframe(struct binaryLog_writer_t *writer) {
+	return writer->wasKeyframe;
+}
+
+unsigned int binaryLog_encodeRow(struct binaryLog_writer_t *writer, const struct binaryLog_row_t *row,
+		unsigned char *buf, unsigned int length) {
+	if (length < binaryLog_maxRowLength(writer)) {
+		return 0;
+	}
+	struct columns_t *previous = &writer->previous;
+	unsigned short cellCount = writer->cellCount;
+	unsigned short bitmapBytes = bitmapLength(cellCount);
+	unsigned char isKeyframe = writer->forceKeyframe || writer->rowsSinceKeyframe >= BINARY_LOG_KEYFRAME_INTERVAL;
+	if (isKeyframe) {
+		resetColumns(previous, cellCount);
+		writer->rowsSinceKeyframe = 0;
+		writer->forceKeyframe = 0;
+	}
+	writer->rowsSinceKeyframe++;
+	writer->wasKeyframe = isKeyframe;
+
+	// the length is filled in once it is known
+	unsigned char *payload = buf + 1 + writer->lengthBytes;
+	unsigned int p = 0;
+	unsigned char flags = isKeyframe ? FLAG_KEYFRAME : 0;
+	for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+		if (isKeyframe || memcmp(row->valid[signal], previous->valid[signal], bitmapBytes)) {
+			flags |= 1 << (FLAG_BITMAP_SHIFT + signal);
+		}
+	}
+	payload[p++] = flags;
+	p += putSigned(payload + p, row->timestamp - previous->timestamp);
+	previous->timestamp = row->timestamp;
+	for (int i = 0; i < BINARY_LOG_SOC_COUNT; i++) {
+		p += putSigned(payload + p, row->soc[i] - previous->soc[i]);
+		previous->soc[i] = row->soc[i];
+	}
+	for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+		if (flags & (1 << (FLAG_BITMAP_SHIFT + signal))) {
+			memcpy(payload + p, row->valid[signal], bitmapBytes);
+			memcpy(previous->valid[signal], row->valid[signal], bitmapBytes);
+			p += bitmapBytes;
+		}
+		const unsigned char *valid = row->valid[signal];
+		const unsigned short *values = row->values[signal];
+		unsigned short *previousValues = previous->values[signal];
+		// most shunt currents and temperatures don't change from one row to the next, skip them a bitmap byte at a time
+		unsigned int unchanged = 0;
+		for (unsigned short first = 0; first < cellCount; first += 8) {
+			unsigned short count = cellCount - first < 8 ? cellCount - first : 8;
+			unsigned char bits = valid[first / 8] & ((1 << count) - 1);
+			if (!bits) {
+				continue;
+			}
+			if (!memcmp(values + first, previousValues + first, count * sizeof(unsigned short))) {
+				unchanged += __builtin_popcount(bits);
+				continue;
+			}
+			for (unsigned short cell = first; cell < first + count; cell++) {
+				if (!(bits & (1 << (cell - first)))) {
+					continue;
+				}
+				int delta = (int) values[cell] - (int) previousValues[cell];
+				if (delta == 0) {
+					unchanged++;
+					continue;
+				}
+				if (unchanged) {
+					p += putRun(payload + p, unchanged);
+					unchanged = 0;
+				}
+				// zigzag encoded with the low bit clear as it isn't a run
+				unsigned int token = (delta < 0 ? ((unsigned int) -delta << 1) - 1 : (unsigned int) delta << 1) << 1;
+				if (token < 0x80) {
+					payload[p++] = (unsigned char) token;
+				} else {
+					p += putVarint(payload + p, token);
+				}
+				previousValues[cell] = values[cell];
+			}
+		}
+		p += putRun(payload + p, unchanged);
+	}
+
+	buf[0] = BINARY_LOG_RECORD_ROW;
+	putPaddedVarint(buf + 1, p, writer->lengthBytes);
+	return 1 + writer->lengthBytes + p;
+}
+
+int binaryLog_writeRow(struct binaryLog_writer_t *writer, const struct binaryLog_row_t *row) {
+	unsigned int length = binaryLog_encodeRow(writer, row, writer->buf, writer->bufLength);
+	if (length == 0 || fwrite(writer->buf, 1, length, writer->out) != length) {
+		// the reader can't follow the deltas past a partial row
+		writer->forceKeyframe = 1;
+		return 1;
+	}
+	return 0;
+}
+
+void binaryLog_closeWriter(struct binaryLog_writer_t *writer) {
+	if (!writer) {
+		return;
+	}
+	freeColumns(&writer->previous);
+	free(writer->buf);
+	free(writer);
+}
+
+struct binaryLog_reader_t *binaryLog_openReader(FILE *in) {
+	struct binaryLog_reader_t *reader = calloc(1, sizeof(struct binaryLog_reader_t));
+	if (!reader) {
+		return NULL;
+	}
+	reader->in = in;
+	return reader;
+}
+
+static int readHeader(struct binaryLog_reader_t *reader) {
+	unsigned char header[6];
+	if (fread(header, sizeof(header), 1, reader->in) != 1) {
+		return 1;
+	}
+	if (header[0] < 1 || header[0] > BINARY_LOG_VERSION || header[3] != BINARY_LOG_SOC_COUNT
+			|| header[4] != BINARY_LOG_SIGNAL_COUNT) {
+		fprintf(stderr, "unsupported binary log version %d\n", header[0]);
+		return 1;
+	}
+	unsigned short cellCount = header[1] | (header[2] << 8);
+	unsigned char nameLength = header[5];
+	if (fread(reader->name, 1, nameLength, reader->in) != nameLength) {
+		return 1;
+	}
+	reader->name[nameLength] = 0;
+	reader->version = header[0];
+
+	if (!reader->hasHeader || cellCount != reader->cellCount) {
+		freeColumns(&reader->previous);
+		binaryLog_freeRow(&reader->row);
+		free(reader->buf);
+		reader->cellCount = cellCount;
+		reader->bufLength = 1 + MAX_VARINT_LENGTH + BINARY_LOG_SOC_COUNT * MAX_VARINT_LENGTH
+				+ BINARY_LOG_SIGNAL_COUNT * (bitmapLength(cellCount) + cellCount * MAX_VALUE_LENGTH);
+		reader->buf = malloc(reader->bufLength);
+		if (!reader->buf || allocColumns(&reader->previous, cellCount) || binaryLog_allocRow(&reader->row, cellCount)) {
+			reader->hasHeader = 0;
+			return 1;
+		}
+	}
+	resetColumns(&reader->previous, cellCount);
+	reader->hasHeader = 1;
+	reader->isNewSession = 1;
+	return 0;
+}
+
+static int readVarint(FILE *in, unsigned long long *value) {
+	*value = 0;
+	for (int i = 0; i < MAX_VARINT_LENGTH; i++) {
+		int c = getc(in);
+		if (c == EOF) {
+			return 1;
+		}
+		*value |= ((unsigned long long) (c & 0x7f)) << (7 * i);
+		if (!(c & 0x80)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int decodeRow(struct binaryLog_reader_t *reader, unsigned int length) {
+	const unsigned char *buf = reader->buf;
+	struct columns_t *previous = &reader->previous;
+	struct binaryLog_row_t *row = &reader->row;
+	unsigned short cellCount = reader->cellCount;
+	unsigned short bitmapBytes = bitmapLength(cellCount);
+	unsigned int p = 0;
+	long long value;
+	unsigned int n;
+
+	if (length < 1) {
+		return 1;
+	}
+	unsigned char flags = buf[p++];
+	reader->isKeyframe = flags & FLAG_KEYFRAME;
+	if (reader->isKeyframe) {
+		resetColumns(previous, cellCount);
+	}
+	if (!(n = getSigned(buf + p, length - p, &value))) {
+		return 1;
+	}
+	p += n;
+	row->timestamp = previous->timestamp = previous->timestamp + value;
+	for (int i = 0; i < BINARY_LOG_SOC_COUNT; i++) {
+		if (!(n = getSigned(buf + p, length - p, &value))) {
+			return 1;
+		}
+		p += n;
+		row->soc[i] = previous->soc[i] = previous->soc[i] + value;
+	}
+	for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+		if (flags & (1 << (FLAG_BITMAP_SHIFT + signal))) {
+			if (length - p < bitmapBytes) {
+				return 1;
+			}
+			memcpy(previous->valid[signal], buf + p, bitmapBytes);
+			p += bitmapBytes;
+		}
+		memcpy(row->valid[signal], previous->valid[signal], bitmapBytes);
+		unsigned short *values = row->values[signal];
+		unsigned short *previousValues = previous->values[signal];
+		unsigned long long unchanged = 0;
+		for (unsigned short cell = 0; cell < cellCount; cell++) {
+			if (BINARY_LOG_IS_VALID(row, signal, cell)) {
+				if (unchanged) {
+					unchanged--;
+				} else if (reader->version == 1) {
+					if (!(n = getSigned(buf + p, length - p, &value))) {
+						return 1;
+					}
+					p += n;
+					previousValues[cell] = (unsigned short) (previousValues[cell] + value);
+				} else {
+					unsigned long long token;
+					if (!(n = getVarint(buf + p, length - p, &token))) {
+						return 1;
+					}
+					p += n;
+					if (token & 1) {
+						// this cell is the first of the run
+						unchanged = token >> 1;
+					} else {
+						previousValues[cell] = (unsigned short) (previousValues[cell] + unzigzag(token >> 1));
+					}
+				}
+			}
+			values[cell] = previousValues[cell];
+		}
+		if (unchanged) {
+			// a run past the last valid cell
+			return 1;
+		}
+	}
+	return p != length;
+}
+
+const struct binaryLog_row_t *binaryLog_readRow(struct binaryLog_reader_t *reader) {
+	reader->isNewSession = 0;
+	int recordType;
+	while ((recordType = getc(reader->in)) == BINARY_LOG_RECORD_HEADER) {
+		if (readHeader(reader)) {
+			return NULL;
+		}
+	}
+	if (recordType != BINARY_LOG_RECORD_ROW || !reader->hasHeader) {
+		return NULL;
+	}
+	unsigned long long length;
+	if (readVarint(reader->in, &length) || length > reader->bufLength) {
+		return NULL;
+	}
+	if (fread(reader->buf, 1, length, reader->in) != length || decodeRow(reader, length)) {
+		return NULL;
+	}
+	if (reader->needsKeyframe && !reader->isKeyframe) {
+		return NULL;
+	}
+	reader->needsKeyframe = 0;
+	return &reader->row;
+}
+
+int binaryLog_seek(struct binaryLog_reader_t *reader, long offset) {
+	if (!reader->hasHeader && (getc(reader->in) != BINARY_LOG_RECORD_HEADER || readHeader(reader))) {
+		return 1;
+	}
+	if (fseek(reader->in, offset, SEEK_SET)) {
+		return 1;
+	}
+	reader->needsKeyframe = 1;
+	return 0;
+}
+
+const char *binaryLog_getName(struct binaryLog_reader_t *reader) {
+	return reader->name;
+}
+
+unsigned short binaryLog_getCellCount(struct binaryLog_reader_t *reader) {
+	return reader->cellCount;
+}
+
+unsigned char binaryLog_isKeyframe(struct binaryLog_reader_t *reader) {
+	return reader->isKeyframe;
+}
+
+unsigned char binaryLog_isNewSession(struct binaryLog_reader_t *reader) {
+	return reader->isNewSession;
+}
+
+void binaryLog_closeReader(struct binaryLog_reader_t *reader) {
+	if (!reader) {
+		return;
+	}
+	freeColumns(&reader->previous);
+	binaryLog_freeRow(&reader->row);
+	free(reader->buf);
+	free(reader);
+}
+
+/** @return the length of " -", " %.1f" for temperatures or " %.3f" for the others written to buf */
+static int formatValue(char *buf, const struct binaryLog_row_t *row, int signal, unsigned short cell) {
+	buf[0] = ' ';
+	if (!BINARY_LOG_IS_VALID(row, signal, cell)) {
+		buf[1] = '-';
+		return 2;
+	} else if (signal == BINARY_LOG_SIGNAL_TEMPERATURE) {
+		return 1 + formatFixed(buf + 1, row->values[signal][cell], 2, 1, 0);
+	} else {
+		return 1 + formatFixed(buf + 1, row->values[signal][cell], 3, 3, 0);
+	}
+}
+
+void binaryLog_printText(FILE *out, const struct binaryLog_row_t *row, unsigned short cellCount) {
+	const long *soc = row->soc;
+	fprintf(out, "%ld %.1f %.2f %.2f %.2f %.2f %.1f %.1f %.1f", row->timestamp, soc[0] / 100.0, soc[1] / 100.0,
+			soc[2] / 100.0, soc[3] / 100.0, soc[4] / 100.0, soc[5] / 100.0, soc[6] / 100.0, soc[7] / 100.0);
+	char buf[BINARY_LOG_SIGNAL_COUNT * 8];
+	for (unsigned short cell = 0; cell < cellCount; cell++) {
+		int length = 0;
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			length += formatValue(buf + length, row, signal, cell);
+		}
+		fwrite(buf, 1, length, out);
+	}
+	fputc('\n', out);
+}
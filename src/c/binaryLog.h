@@ -0,0 +1,162 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * Binary cell log, one file per battery.
+ *
+ * A file is a sequence of records, each starting with a record type byte. A header record gives the battery name,
+ * cell count and the number of SOC values and cell signals in each row. Every time the logger starts it writes a new
+ * header so files can be appended to.
+ *
+ * Row records start with the length of the rest of the row as a varint, which the writer pads with continuation bytes
+ * to a fixed width so it can encode rows in place. They hold the time, the SOC values in hundredths and for each cell
+ * signal a validity bitmap followed by the valid values. Each value is stored as a zigzag varint of the difference from the same column in the previous row,
+ * bitmaps are omitted if they have not changed. From version 2 the low bit of each cell value varint says whether the
+ * rest is a delta or the length of a run of unchanged cells, version 1 files can still be read. Every
+ * BINARY_LOG_KEYFRAME_INTERVAL rows (and the first row after a header) is a keyframe which is relative to zero so a
+ * reader can start decoding there.
+ */
+
+#define BINARY_LOG_VERSION 2
+#define BINARY_LOG_KEYFRAME_INTERVAL 64
+
+#define BINARY_LOG_RECORD_HEADER 'H'
+#define BINARY_LOG_RECORD_ROW 'R'
+
+#define BINARY_LOG_EXTENSION ".bin"
+#define BINARY_LOG_INDEX_EXTENSION ".idx"
+
+typedef enum {
+	BINARY_LOG_SOC_CURRENT,
+	BINARY_LOG_SOC_AH,
+	BINARY_LOG_SOC_VOLTAGE,
+	BINARY_LOG_SOC_HALF_VOLTAGE,
+	BINARY_LOG_SOC_WH,
+	BINARY_LOG_SOC_T1,
+	BINARY_LOG_SOC_T2,
+	BINARY_LOG_SOC_SPEED,
+	BINARY_LOG_SOC_COUNT
+} binaryLog_soc_t;
+
+typedef enum {
+	// mV
+	BINARY_LOG_SIGNAL_VOLTAGE,
+	// mA
+	BINARY_LOG_SIGNAL_SHUNT_CURRENT,
+	// hundredths of a degree
+	BINARY_LOG_SIGNAL_TEMPERATURE,
+	BINARY_LOG_SIGNAL_COUNT
+} binaryLog_signal_t;
+
+struct binaryLog_row_t {
+	long timestamp;
+	// hundredths of an amp, amp hour, volt etc.
+	long soc[BINARY_LOG_SOC_COUNT];
+	unsigned short *values[BINARY_LOG_SIGNAL_COUNT];
+	// bit (i % 8) of byte (i / 8) is set if values[signal][i] is valid
+	unsigned char *valid[BINARY_LOG_SIGNAL_COUNT];
+};
+
+/**
+ * The logger writes rotating segments, <battery>-<first timestamp>.bin, each with a sparse index in
+ * <battery>-<first timestamp>.idx. The index is an array of these in native byte order, one for each run of rows
+ * starting at a keyframe. The last run in a segment may not be indexed if the logger stopped while writing it.
+ */
+struct binaryLog_indexEntry_t {
+	int64_t firstTimestamp;
+	int64_t lastTimestamp;
+	// of the keyframe in the segment
+	uint64_t offset;
+	uint32_t rowCount;
+	// pack voltage and current, hundredths
+	int32_t minVoltage;
+	int32_t maxVoltage;
+	int32_t minCurrent;
+	int32_t maxCurrent;
+	uint32_t reserved;
+};
+
+struct binaryLog_writer_t;
+struct binaryLog_reader_t;
+
+#define BINARY_LOG_IS_VALID(row, signal, cell) ((row)->valid[signal][(cell) / 8] & (1 << ((cell) % 8)))
+
+/** Allocate the value and validity arrays of a row, @return 0 if successful */
+int binaryLog_allocRow(struct binaryLog_row_t *row, unsigned short cellCount);
+void binaryLog_freeRow(struct binaryLog_row_t *row);
+void binaryLog_setValid(struct binaryLog_row_t *row, binaryLog_signal_t signal, unsigned short cell, unsigned char isValid);
+
+/**
+ * Start a new session in out, writing a header record. If out is NULL rows can only be encoded with
+ * binaryLog_encodeRow() and the caller writes the header with binaryLog_writeHeader().
+ *
+ * @return NULL if unsuccessful
+ */
+struct binaryLog_writer_t *binaryLog_openWriter(FILE *out, const char *name, unsigned short cellCount);
+/** @return the number of bytes written, 0 if unsuccessful */
+unsigned int binaryLog_writeHeader(FILE *out, const char *name, unsigned short cellCount);
+unsigned int binaryLog_headerLength(const char *name);
+/** Append a row, @return 0 if successful */
+int binaryLog_writeRow(struct binaryLog_writer_t *writer, const struct binaryLog_row_t *row);
+/** Encode a row into the passed buffer without writing it, @return the encoded length or 0 if it does not fit */
+unsigned int binaryLog_encodeRow(struct binaryLog_writer_t *writer, const struct binaryLog_row_t *row,
+		unsigned char *buf, unsigned int length);
+/** The largest possible encoded row for the writer's cell count */
+unsigned int binaryLog_maxRowLength(struct binaryLog_writer_t *writer);
+/** The next row written will be a keyframe */
+void binaryLog_forceKeyframe(struct binaryLog_writer_t *writer);
+/** true if the last row encoded was a keyframe */
+unsigned char binaryLog_wasKeyframe(struct binaryLog_writer_t *writer);
+void binaryLog_closeWriter(struct binaryLog_writer_t *writer);
+
+/** @return NULL if the file could not be opened */
+struct binaryLog_reader_t *binaryLog_openReader(FILE *in);
+/**
+ * Read the next row, the row is owned by the reader and is only valid until the next call.
+ *
+ * @return NULL at the end of the file or if the file is corrupt
+ */
+const struct binaryLog_row_t *binaryLog_readRow(struct binaryLog_reader_t *reader);
+/**
+ * Read the header at the current position if we haven't seen one yet, then move to the keyframe at offset, usually
+ * from an index entry.
+ *
+ * @return 0 if successful
+ */
+int binaryLog_seek(struct binaryLog_reader_t *reader, long offset);
+/** The battery name and cell count from the header of the session the last row was read from */
+const char *binaryLog_getName(struct binaryLog_reader_t *reader);
+unsigned short binaryLog_getCellCount(struct binaryLog_reader_t *reader);
+/** true if the last row read was a keyframe */
+unsigned char binaryLog_isKeyframe(struct binaryLog_reader_t *reader);
+/** true if the last row read was the first row after a header */
+unsigned char binaryLog_isNewSession(struct binaryLog_reader_t *reader);
+void binaryLog_closeReader(struct binaryLog_reader_t *reader);
+
+/** Write a row in the text log format */
+void binaryLog_printText(FILE *out, const struct binaryLog_row_t *row, unsigned short cellCount);
+
+#endif
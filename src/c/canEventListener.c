@@ -19,6 +19,7 @@
  */
 
 /** Listen to CAN Bus and dispatch events */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,6 +42,7 @@
 #include <linux/can/raw.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include "util.h"
 #include "config.h"
@@ -49,153 +51,184 @@
 static pthread_t thread;
 static struct config_t *config;
 
-static void (*voltageListeners[10])(unsigned char, unsigned short, unsigned char, unsigned short);
-static void (*shuntCurrentListeners[10])(unsigned char, unsigned short, unsigned short);
-static void (*minCurrentListeners[10])(unsigned char, unsigned short, unsigned short);
-static void (*temperatureListeners[10])(unsigned char, unsigned short, unsigned short);
-static void (*cellConfigListeners[10])(unsigned char, unsigned short, unsigned short, unsigned char);
-static void (*errorListeners[10])(unsigned char, unsigned short, unsigned short);
-static void (*latencyListeners[10])(unsigned char, unsigned short, unsigned char);
-static void (*chargerStateListeners[10])(unsigned char, unsigned char, unsigned char, __u16);
-static void (*monitorStateListeners[10])(monitor_state_t, __u16, __u8);
-static void (*rawCanListeners[10])(struct can_frame *frame);
+struct registration_t {
+	canid_t canId;
+	canid_t mask;
+	canEventListener_frameListener_t listener;
+	void *context;
+};
+
+struct listener_t {
+	canEventListener_frameListener_t listener;
+	void *context;
+};
+
+/** the listeners for a single standard CAN id */
+struct slot_t {
+	unsigned short count;
+	struct listener_t listeners[];
+};
+
+/**
+ * Never modified once published, a new table is built and swapped in whenever a listener is registered
+ */
+struct dispatchTable_t {
+	// indexed by standard CAN id, NULL if nothing is listening
+	struct slot_t *standard[CAN_SFF_MASK + 1];
+	// extended frames are rare, these are matched one by one
+	unsigned short extendedCount;
+	struct registration_t *extended;
+};
+
+/** holds a typed listener so it can be passed to a decoder as context */
+union typedListener_t {
+	void (*voltage)(unsigned char, unsigned short, unsigned char, unsigned short);
+	void (*batteryCellShort)(unsigned char, unsigned short, unsigned short);
+	void (*cellConfig)(unsigned char, unsigned short, unsigned short, unsigned char);
+	void (*latency)(unsigned char, unsigned short, unsigned char);
+	void (*chargerState)(unsigned char, unsigned char, unsigned char, __u16);
+	void (*monitorState)(monitor_state_t, __u16, __u8);
+	void (*sweepComplete)(unsigned char, unsigned short, unsigned short, unsigned short);
+};
+
+static pthread_mutex_t registrationMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct registration_t *registrations;
+static unsigned short registrationCount;
+
+static struct dispatchTable_t *dispatchTable;
+// incremented before and after each frame is dispatched, odd while the background thread is using a table
+static unsigned long dispatchEpoch;
 
 volatile char canEventListener_error = 1;
 
-static void decodeVoltage(struct can_frame *frame) {
-	unsigned char batteryIndex = bufToChar(frame->data);
-	if (batteryIndex > config->batteryCount) {
-		return;
+static unsigned char isCellInRange(unsigned char batteryIndex, unsigned short cellIndex) {
+	if (batteryIndex >= config->batteryCount) {
+		return 0;
 	}
-	struct config_battery_t *battery = config->batteries + batteryIndex;
+	return cellIndex < config->batteries[batteryIndex].cellCount;
+}
+
+static void decodeVoltage(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
+	unsigned char batteryIndex = bufToChar(frame->data);
 	unsigned short cellIndex = bufToShort(frame->data + 1);
-	if (cellIndex > battery->cellCount) {
+	if (!isCellInRange(batteryIndex, cellIndex)) {
 		return;
 	}
 	unsigned char isValid = bufToChar(frame->data + 3);
 	unsigned short voltage = bufToShort(frame->data + 4);
 
-
-	for (int i = 0; voltageListeners[i]; i++) {
-		voltageListeners[i](batteryIndex, cellIndex, isValid, voltage);
-	}
+	((union typedListener_t *) context)->voltage(batteryIndex, cellIndex, isValid, voltage);
 }
 
-static void decodeBatteryCellShort(struct can_frame *frame, void (*listeners[])(unsigned char, unsigned short, unsigned short)) {
+static void decodeBatteryCellShort(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
 	unsigned char batteryIndex = bufToChar(frame->data);
-	if (batteryIndex > config->batteryCount) {
-		return;
-	}
-	struct config_battery_t *battery = config->batteries + batteryIndex;
 	unsigned short cellIndex = bufToShort(frame->data + 1);
-	if (cellIndex > battery->cellCount) {
+	if (!isCellInRange(batteryIndex, cellIndex)) {
 		return;
 	}
 	unsigned short value = bufToShort(frame->data + 3);
 
-	for (int i = 0; listeners[i]; i++) {
-		listeners[i](batteryIndex, cellIndex, value);
-	}
+	((union typedListener_t *) context)->batteryCellShort(batteryIndex, cellIndex, value);
 }
 
-static void decodeCellConfig(struct can_frame *frame) {
+static void decodeCellConfig(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
 	unsigned char batteryIndex = bufToChar(frame->data);
-	if (batteryIndex > config->batteryCount) {
-		return;
-	}
-	struct config_battery_t *battery = config->batteries + batteryIndex;
 	unsigned short cellIndex = bufToShort(frame->data + 1);
-	if (cellIndex > battery->cellCount) {
+	if (!isCellInRange(batteryIndex, cellIndex)) {
 		return;
 	}
 	unsigned short revision = bufToShort(frame->data + 3);
 	unsigned short cellConfig = bufToChar(frame->data + 5);
 
-	for (int i = 0; cellConfigListeners[i]; i++) {
-		cellConfigListeners[i](batteryIndex, cellIndex, revision, cellConfig);
-	}
+	((union typedListener_t *) context)->cellConfig(batteryIndex, cellIndex, revision, cellConfig);
 }
 
-static void decodeLatency(struct can_frame *frame) {
+static void decodeLatency(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
 	unsigned char batteryIndex = bufToChar(frame->data);
-	if (batteryIndex > config->batteryCount) {
-		return;
-	}
-	struct config_battery_t *battery = config->batteries + batteryIndex;
 	unsigned short cellIndex = bufToShort(frame->data + 1);
-	if (cellIndex > battery->cellCount) {
+	if (!isCellInRange(batteryIndex, cellIndex)) {
 		return;
 	}
 	unsigned char latency = bufToChar(frame->data + 3);
 
-	for (int i = 0; latencyListeners[i]; i++) {
-		latencyListeners[i](batteryIndex, cellIndex, latency);
-	}
+	((union typedListener_t *) context)->latency(batteryIndex, cellIndex, latency);
 }
 
-static void decodeChargerState(struct can_frame *frame) {
+static void decodeChargerState(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
 	unsigned char shutdown = bufToChar(frame->data);
 	unsigned char state = bufToChar(frame->data + 1);
 	unsigned char reason = bufToChar(frame->data + 2);
 	__u16 shuntDelay = bufToShort(frame->data + 3);
 
-	for (int i = 0; chargerStateListeners[i]; i++) {
-		chargerStateListeners[i](shutdown, state, reason, shuntDelay);
-	}
+	((union typedListener_t *) context)->chargerState(shutdown, state, reason, shuntDelay);
 }
 
-static void decodeMonitorState(struct can_frame *frame) {
+static void decodeMonitorState(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
 	unsigned char state = bufToChar(frame->data);
-	unsigned char delay = bufToShort(frame->data + 1);
+	__u16 delay = bufToShort(frame->data + 1);
 	unsigned char loopsBeforeVoltage = bufToChar(frame->data + 3);
 
-	for (int i = 0; monitorStateListeners[i]; i++) {
-		monitorStateListeners[i](state, delay, loopsBeforeVoltage);
+	((union typedListener_t *) context)->monitorState(state, delay, loopsBeforeVoltage);
+}
+
+static void decodeSweepComplete(struct can_frame *frame, const struct timeval *received __attribute__ ((unused)),
+		void *context) {
+	unsigned char batteryIndex = bufToChar(frame->data);
+	if (batteryIndex >= config->batteryCount) {
+		return;
 	}
+	unsigned short failedCount = bufToShort(frame->data + 1);
+	unsigned short sentCount = bufToShort(frame->data + 3);
+	unsigned short suppressedCount = bufToShort(frame->data + 5);
+
+	((union typedListener_t *) context)->sweepComplete(batteryIndex, failedCount, sentCount, suppressedCount);
 }
 
-static void decodeFrame(struct can_frame *frame) {
-	switch (frame->can_id) {
-	case 0x3f0:
-		decodeVoltage(frame);
-		break;
-	case 0x3f1:
-		// shunt current frame
-		decodeBatteryCellShort(frame, shuntCurrentListeners);
-		break;
-	case 0x3f2:
-		// min current frame
-		decodeBatteryCellShort(frame, minCurrentListeners);
-		break;
-	case 0x3f3:
-		// temperature frame
-		decodeBatteryCellShort(frame, temperatureListeners);
-		break;
-	case 0x3f4:
-		decodeCellConfig(frame);
-		break;
-	case 0x3f5:
-		decodeBatteryCellShort(frame, errorListeners);
-		break;
-	case 0x3f6:
-		decodeLatency(frame);
-		break;
-	case 0x3f8:
-		decodeChargerState(frame);
-		break;
-	case 0x3f9:
-		decodeMonitorState(frame);
-		break;
-	default:
-		for (int i = 0; rawCanListeners[i]; i++) {
-			rawCanListeners[i](frame);
+static void dispatchFrame(struct can_frame *frame, const struct timeval *received) {
+	__atomic_add_fetch(&dispatchEpoch, 1, __ATOMIC_SEQ_CST);
+	struct dispatchTable_t *table = __atomic_load_n(&dispatchTable, __ATOMIC_SEQ_CST);
+	if (!table) {
+		// nobody is listening yet
+	} else if (frame->can_id & CAN_EFF_FLAG) {
+		canid_t canId = frame->can_id & CAN_EFF_MASK;
+		for (unsigned short i = 0; i < table->extendedCount; i++) {
+			struct registration_t *registration = table->extended + i;
+			if ((canId & registration->mask) == (registration->canId & registration->mask)) {
+				registration->listener(frame, received, registration->context);
+			}
+		}
+	} else {
+		struct slot_t *slot = table->standard[frame->can_id & CAN_SFF_MASK];
+		if (slot) {
+			for (unsigned short i = 0; i < slot->count; i++) {
+				slot->listeners[i].listener(frame, received, slot->listeners[i].context);
+			}
 		}
-		break;
 	}
+	__atomic_add_fetch(&dispatchEpoch, 1, __ATOMIC_SEQ_CST);
 }
 
-int readFrame(int s, struct can_frame *frame) {
-	ssize_t nbytes = read(s, frame, sizeof(struct can_frame));
+/**
+ * Read a frame and the time the kernel received it, falling back to the current time if the socket did not
+ * provide a timestamp.
+ */
+int readFrame(int s, struct can_frame *frame, struct timeval *received) {
+	struct iovec iov = { .iov_base = frame, .iov_len = sizeof(struct can_frame) };
+	char control[CMSG_SPACE(sizeof(struct timeval))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t nbytes = recvmsg(s, &msg, 0);
 
 	if (nbytes < 0) {
 		perror("can raw socket read");
@@ -207,17 +240,28 @@ int readFrame(int s, struct can_frame *frame) {
 		fprintf(stderr, "read: incomplete CAN frame\n");
 		return 1;
 	}
+
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+			memcpy(received, CMSG_DATA(cmsg), sizeof(struct timeval));
+			return 0;
+		}
+	}
+	gettimeofday(received, NULL);
 	return 0;
 }
 
 void *backgroundThread(void *unused __attribute__ ((unused))) {
 	while (1) {
 		struct can_frame frame;
+		struct timeval received;
 
 		int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
 
 		struct ifreq ifr;
-		strcpy(ifr.ifr_name, "slcan0");
+		memset(&ifr, 0, sizeof(struct ifreq));
+		strncpy(ifr.ifr_name, config->canInterface, IFNAMSIZ - 1);
 		ioctl(s, SIOCGIFINDEX, &ifr);
 
 		struct sockaddr_can addr;
@@ -226,16 +270,23 @@ void *backgroundThread(void *unused __attribute__ ((unused))) {
 
 		bind(s, (struct sockaddr *) &addr, sizeof(addr));
 
+		// ask the kernel to tell us when each frame arrived, so listeners don't see our scheduling delays
+		int timestamp = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &timestamp, sizeof(timestamp))) {
+			perror("SO_TIMESTAMP");
+		}
+
 		while (1) {
-			if (readFrame(s, &frame)) {
+			if (readFrame(s, &frame, &received)) {
 				canEventListener_error = 1;
 				break;
 			}
 			canEventListener_error = 0;
-			decodeFrame(&frame);
+			dispatchFrame(&frame, &received);
 		}
 		// there was an error, wait for CAN bus to settle
 		canEventListener_error = 1;
+		close(s);
 		sleep(1);
 	}
 	return NULL;
@@ -247,77 +298,188 @@ void canEventListener_init(struct config_t *_config) {
 	pthread_create(&thread, NULL, backgroundThread, "unused");
 }
 
-void registerListener(void (*listener)(unsigned char, unsigned short, unsigned short),
-		void (*listeners[])(unsigned char, unsigned short, unsigned short)) {
-	int i = 0;
-	while (listeners[i] != NULL) {
-		i++;
+static void freeDispatchTable(struct dispatchTable_t *table) {
+	for (unsigned int i = 0; i <= CAN_SFF_MASK; i++) {
+		free(table->standard[i]);
 	}
-	listeners[i] = listener;
+	free(table->extended);
+	free(table);
 }
 
-void canEventListener_registerVoltageListener(void (*voltageListener)(unsigned char, unsigned short, unsigned char, unsigned short)) {
-	int i = 0;
-	while (voltageListeners[i] != NULL) {
-		i++;
+/** Build a dispatch table from the current registrations, must be called holding registrationMutex */
+static struct dispatchTable_t *buildDispatchTable() {
+	struct dispatchTable_t *table = calloc(1, sizeof(struct dispatchTable_t));
+	if (!table) {
+		return NULL;
+	}
+	for (canid_t canId = 0; canId <= CAN_SFF_MASK; canId++) {
+		unsigned short count = 0;
+		for (unsigned short i = 0; i < registrationCount; i++) {
+			struct registration_t *registration = registrations + i;
+			if (!(registration->canId & CAN_EFF_FLAG)
+					&& (canId & registration->mask) == (registration->canId & registration->mask)) {
+				count++;
+			}
+		}
+		if (count == 0) {
+			continue;
+		}
+		struct slot_t *slot = malloc(sizeof(struct slot_t) + count * sizeof(struct listener_t));
+		if (!slot) {
+			freeDispatchTable(table);
+			return NULL;
+		}
+		slot->count = 0;
+		for (unsigned short i = 0; i < registrationCount; i++) {
+			struct registration_t *registration = registrations + i;
+			if (!(registration->canId & CAN_EFF_FLAG)
+					&& (canId & registration->mask) == (registration->canId & registration->mask)) {
+				slot->listeners[slot->count].listener = registration->listener;
+				slot->listeners[slot->count].context = registration->context;
+				slot->count++;
+			}
+		}
+		table->standard[canId] = slot;
+	}
+	for (unsigned short i = 0; i < registrationCount; i++) {
+		if (registrations[i].canId & CAN_EFF_FLAG) {
+			table->extendedCount++;
+		}
+	}
+	if (table->extendedCount) {
+		table->extended = malloc(table->extendedCount * sizeof(struct registration_t));
+		if (!table->extended) {
+			freeDispatchTable(table);
+			return NULL;
+		}
+		unsigned short j = 0;
+		for (unsigned short i = 0; i < registrationCount; i++) {
+			if (registrations[i].canId & CAN_EFF_FLAG) {
+				table->extended[j] = registrations[i];
+				table->extended[j].canId &= CAN_EFF_MASK;
+				j++;
+			}
+		}
+	}
+	return table;
+}
+
+/**
+ * Wait until the background thread can no longer be using the passed table, then free it. The new
+ * table has already been published so any frame dispatched after an even epoch is observed uses it.
+ */
+static void retireDispatchTable(struct dispatchTable_t *table) {
+	if (!table) {
+		return;
+	}
+	unsigned long epoch = __atomic_load_n(&dispatchEpoch, __ATOMIC_SEQ_CST);
+	if (epoch & 1) {
+		while (__atomic_load_n(&dispatchEpoch, __ATOMIC_SEQ_CST) == epoch) {
+			sched_yield();
+		}
+	}
+	freeDispatchTable(table);
+}
+
+int canEventListener_registerFrameListener(canid_t canId, canid_t mask, canEventListener_frameListener_t listener,
+		void *context) {
+	pthread_mutex_lock(&registrationMutex);
+	struct registration_t *grown = realloc(registrations, (registrationCount + 1) * sizeof(struct registration_t));
+	if (!grown) {
+		pthread_mutex_unlock(&registrationMutex);
+		return 1;
 	}
-	voltageListeners[i] = voltageListener;
+	registrations = grown;
+	struct registration_t *registration = registrations + registrationCount;
+	if (canId & CAN_EFF_FLAG) {
+		registration->canId = canId & (CAN_EFF_MASK | CAN_EFF_FLAG);
+		registration->mask = mask & CAN_EFF_MASK;
+	} else {
+		registration->canId = canId & CAN_SFF_MASK;
+		registration->mask = mask & CAN_SFF_MASK;
+	}
+	registration->listener = listener;
+	registration->context = context;
+	registrationCount++;
+
+	struct dispatchTable_t *table = buildDispatchTable();
+	if (!table) {
+		registrationCount--;
+		pthread_mutex_unlock(&registrationMutex);
+		return 1;
+	}
+	struct dispatchTable_t *old = __atomic_exchange_n(&dispatchTable, table, __ATOMIC_SEQ_CST);
+	retireDispatchTable(old);
+	pthread_mutex_unlock(&registrationMutex);
+	return 0;
+}
+
+static void registerTypedListener(canid_t canId, canEventListener_frameListener_t decoder,
+		union typedListener_t listener) {
+	union typedListener_t *context = malloc(sizeof(union typedListener_t));
+	if (context) {
+		*context = listener;
+		if (!canEventListener_registerFrameListener(canId, CAN_SFF_MASK, decoder, context)) {
+			return;
+		}
+		free(context);
+	}
+	fprintf(stderr, "error registering listener for 0x%x\n", canId);
+}
+
+void canEventListener_registerVoltageListener(void (*voltageListener)(unsigned char, unsigned short, unsigned char, unsigned short)) {
+	union typedListener_t listener = { .voltage = voltageListener };
+	registerTypedListener(0x3f0, decodeVoltage, listener);
 }
 
 void canEventListener_registerShuntCurrentListener(void (*shuntCurrentListener)(unsigned char, unsigned short, unsigned short)) {
-	registerListener(shuntCurrentListener, shuntCurrentListeners);
+	union typedListener_t listener = { .batteryCellShort = shuntCurrentListener };
+	registerTypedListener(0x3f1, decodeBatteryCellShort, listener);
 }
 
 void canEventListener_registerMinCurrentListener(void (*minCurrentListener)(unsigned char, unsigned short, unsigned short)) {
-	registerListener(minCurrentListener, minCurrentListeners);
+	union typedListener_t listener = { .batteryCellShort = minCurrentListener };
+	registerTypedListener(0x3f2, decodeBatteryCellShort, listener);
 }
 
 void canEventListener_registerTemperatureListener(void (*temperatureListener)(unsigned char, unsigned short, unsigned short)) {
-	registerListener(temperatureListener, temperatureListeners);
+	union typedListener_t listener = { .batteryCellShort = temperatureListener };
+	registerTypedListener(0x3f3, decodeBatteryCellShort, listener);
+}
+
+void canEventListener_registerResistanceListener(void (*resistanceListener)(unsigned char, unsigned short, unsigned short)) {
+	union typedListener_t listener = { .batteryCellShort = resistanceListener };
+	registerTypedListener(0x3fb, decodeBatteryCellShort, listener);
 }
 
 void canEventListener_registerCellConfigListener(void (*cellConfigListener)(unsigned char, unsigned short, unsigned short, unsigned char)) {
-	int i = 0;
-	while (cellConfigListeners[i] != NULL) {
-		i++;
-	}
-	cellConfigListeners[i] = cellConfigListener;
+	union typedListener_t listener = { .cellConfig = cellConfigListener };
+	registerTypedListener(0x3f4, decodeCellConfig, listener);
 }
 
 void canEventListener_registerErrorListener(void (*errorListener)(unsigned char, unsigned short, unsigned short)) {
-	registerListener(errorListener, errorListeners);
+	union typedListener_t listener = { .batteryCellShort = errorListener };
+	registerTypedListener(0x3f5, decodeBatteryCellShort, listener);
 }
 
 void canEventListener_registerLatencyListener(void (*latencyListener)(unsigned char, unsigned short, unsigned char)) {
-	int i = 0;
-	while (latencyListeners[i] != NULL) {
-		i++;
-	}
-	latencyListeners[i] = latencyListener;
+	union typedListener_t listener = { .latency = latencyListener };
+	registerTypedListener(0x3f6, decodeLatency, listener);
 }
 
 void canEventListener_registerChargerStateListener(void (*chargerStateListener)(unsigned char, unsigned char,
 		unsigned char, __u16)) {
-	int i = 0;
-	while (chargerStateListeners[i] != NULL) {
-		i++;
-	}
-	chargerStateListeners[i] = chargerStateListener;
+	union typedListener_t listener = { .chargerState = chargerStateListener };
+	registerTypedListener(0x3f8, decodeChargerState, listener);
 }
 
 void canEventListener_registerMonitorStateListener(void (*monitorStateListener)(monitor_state_t, __u16, __u8)) {
-	int i = 0;
-	while (monitorStateListeners[i] != NULL) {
-		i++;
-	}
-	monitorStateListeners[i] = monitorStateListener;
+	union typedListener_t listener = { .monitorState = monitorStateListener };
+	registerTypedListener(0x3f9, decodeMonitorState, listener);
 }
 
-
-void canEventListener_registerRawCanListener(void (*rawCanListener)(struct can_frame *frame)) {
-	int i = 0;
-	while (rawCanListeners[i] != NULL) {
-		i++;
-	}
-	rawCanListeners[i] = rawCanListener;
+void canEventListener_registerSweepCompleteListener(void (*sweepCompleteListener)(unsigned char, unsigned short,
+		unsigned short, unsigned short)) {
+	union typedListener_t listener = { .sweepComplete = sweepCompleteListener };
+	registerTypedListener(0x3fa, decodeSweepComplete, listener);
 }
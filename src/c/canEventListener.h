@@ -21,23 +21,43 @@
 #ifndef CAN_EVENT_LISTENER_H
 #define CAN_EVENT_LISTENER_H
 
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <linux/can.h>
 
 #include "config.h"
 #include "monitor.h"
 
+/**
+ * Called for each frame matching a registration with the time the kernel received the frame and the context passed
+ * when it was registered.
+ */
+typedef void (*canEventListener_frameListener_t)(struct can_frame *frame, const struct timeval *received,
+		void *context);
+
 extern void canEventListener_init(struct config_t *_config);
+
+/**
+ * Register a listener for frames where (can_id & mask) == (canId & mask). Set CAN_EFF_FLAG in canId to
+ * match extended frames. Must not be called from within a listener.
+ *
+ * @return 0 if successful
+ */
+extern int canEventListener_registerFrameListener(canid_t canId, canid_t mask, canEventListener_frameListener_t listener,
+		void *context);
 extern void canEventListener_registerVoltageListener(void (*voltageListener)(unsigned char, unsigned short, unsigned char, unsigned short));
 extern void canEventListener_registerShuntCurrentListener(void (*shuntCurrentListener)(unsigned char, unsigned short, unsigned short));
 extern void canEventListener_registerMinCurrentListener(void (*minCurrentListener)(unsigned char, unsigned short, unsigned short));
 extern void canEventListener_registerTemperatureListener(void (*temperatureListener)(unsigned char, unsigned short, unsigned short));
+/** Called with each cell's internal resistance in micro ohms */
+extern void canEventListener_registerResistanceListener(void (*resistanceListener)(unsigned char, unsigned short, unsigned short));
 extern void canEventListener_registerCellConfigListener(void (*cellConfigListener)(unsigned char, unsigned short, unsigned short, unsigned char));
 extern void canEventListener_registerErrorListener(void (*cellConfigListener)(unsigned char, unsigned short, unsigned short));
 extern void canEventListener_registerLatencyListener(void (*cellConfigListener)(unsigned char, unsigned short, unsigned char));
 extern void canEventListener_registerChargerStateListener(void (*chargerStateListener)(unsigned char, unsigned char, unsigned char, __u16));
 extern void canEventListener_registerMonitorStateListener(void (*monitorStateListener)(monitor_state_t, __u16, __u8));
-extern void canEventListener_registerRawCanListener(void (*rawCanListener)(struct can_frame *frame));
+/** Called after each pass over a battery with the number of cells not read and the cell frames sent and suppressed */
+extern void canEventListener_registerSweepCompleteListener(void (*sweepCompleteListener)(unsigned char, unsigned short, unsigned short, unsigned short));
 
 extern volatile char canEventListener_error;
 
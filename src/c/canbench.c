@@ -0,0 +1,398 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Exercise monitor_can.c, canEventListener.c and soc_evision.c against a virtual CAN interface, e.g.
+ *
+ *   sudo ip link add dev vcan0 type vcan && sudo ip link set vcan0 up
+ *   ./canbench -i vcan0 -f drive.log -s 10
+ *
+ * BMS voltage frames are injected through monitor_can.c at increasing rates until frames are lost, reporting the
+ * latency from sending to the listener being called at each rate. EVision traffic is then replayed either from a
+ * candump -l log or generated, reporting the delay between the kernel receiving each frame and the listener.
+ *
+ * With -h hiResLogger records the replayed traffic to hiRes.txt and the replay is repeated at double the speed until
+ * instantaneous voltage frames are lost or the hiResLogger ring overruns.
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <net/if.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "config.h"
+#include "canEventListener.h"
+#include "monitor_can.h"
+#include "soc.h"
+#include "socSource.h"
+#include "hiResLogger.h"
+
+#define SEQUENCE_COUNT 0x10000
+#define DRAIN_MICROSECONDS 200000
+
+static struct config_t config;
+static struct config_battery_t battery;
+
+// when each sequence number was sent, the sequence number is carried as the cell voltage
+static struct timespec sendTimes[SEQUENCE_COUNT];
+static unsigned long receivedCount;
+static unsigned long socEventCount;
+// microseconds, written by the listener thread, replaced and read by the main thread, all under latencyMutex
+static pthread_mutex_t latencyMutex = PTHREAD_MUTEX_INITIALIZER;
+static long *latencies;
+static unsigned long latencyCount;
+static unsigned long latencyCapacity;
+
+static long microsecondsBetween(const struct timespec *start, const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void recordLatency(long latency) {
+	pthread_mutex_lock(&latencyMutex);
+	if (latencyCount < latencyCapacity) {
+		latencies[latencyCount++] = latency;
+	}
+	pthread_mutex_unlock(&latencyMutex);
+	__atomic_add_fetch(&receivedCount, 1, __ATOMIC_RELEASE);
+}
+
+static void voltageListener(unsigned char batteryIndex __attribute__ ((unused)),
+		unsigned short cellIndex __attribute__ ((unused)), unsigned char isValid __attribute__ ((unused)),
+		unsigned short voltage) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	recordLatency(microsecondsBetween(sendTimes + voltage, &now));
+}
+
+static void instVoltageListener(const struct timeval *received) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	recordLatency((now.tv_sec - received->tv_sec) * 1000000 + (now.tv_usec - received->tv_usec));
+}
+
+static void socEventListener() {
+	__atomic_add_fetch(&socEventCount, 1, __ATOMIC_RELAXED);
+}
+
+static void resetCounters(unsigned long expected) {
+	// frames from the last run can still be arriving
+	pthread_mutex_lock(&latencyMutex);
+	free(latencies);
+	latencies = malloc(expected * sizeof(long));
+	latencyCapacity = latencies ? expected : 0;
+	latencyCount = 0;
+	pthread_mutex_unlock(&latencyMutex);
+	__atomic_store_n(&receivedCount, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&socEventCount, 0, __ATOMIC_RELEASE);
+}
+
+static int compareLong(const void *a, const void *b) {
+	long x = *(const long *) a;
+	long y = *(const long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void printLatencies(const char *label, double rate, unsigned long sent) {
+	usleep(DRAIN_MICROSECONDS);
+	unsigned long received = __atomic_load_n(&receivedCount, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&latencyMutex);
+	qsort(latencies, latencyCount, sizeof(long), compareLong);
+	double mean = 0;
+	for (unsigned long i = 0; i < latencyCount; i++) {
+		mean += latencies[i];
+	}
+	if (latencyCount) {
+		mean /= latencyCount;
+		printf("%-8s %9.0f/s sent %7lu received %7lu lost %6lu latency us min %5ld mean %7.1f p50 %5ld p99 %6ld max %6ld\n",
+				label, rate, sent, received, sent - received, latencies[0], mean, latencies[latencyCount / 2],
+				latencies[latencyCount * 99 / 100], latencies[latencyCount - 1]);
+	} else {
+		printf("%-8s %9.0f/s sent %7lu received %7lu lost %6lu\n", label, rate, sent, received, sent - received);
+	}
+	pthread_mutex_unlock(&latencyMutex);
+}
+
+/** Sleep until frame number i is due when sending at rate frames per second */
+static void waitUntilDue(const struct timespec *start, unsigned long i, double rate) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long due = (long) (i * 1000000 / rate) - microsecondsBetween(start, &now);
+	if (due > 0) {
+		usleep(due);
+	}
+}
+
+/**
+ * Inject voltage frames through monitor_can.c at the passed rate
+ *
+ * @return the number of frames lost
+ */
+static unsigned long injectBmsFrames(double rate, double seconds) {
+	unsigned long count = rate * seconds;
+	resetCounters(count);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < count; i++) {
+		waitUntilDue(&start, i, rate);
+		unsigned short sequence = i % SEQUENCE_COUNT;
+		clock_gettime(CLOCK_MONOTONIC, sendTimes + sequence);
+		monitorCan_publishCellVoltage(0, i % battery.cellCount, 1, sequence);
+	}
+	printLatencies("bms", rate, count);
+	return count - __atomic_load_n(&receivedCount, __ATOMIC_ACQUIRE);
+}
+
+static int openRawSocket(const char *ifName) {
+	int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s == -1) {
+		return -1;
+	}
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, ifName, IFNAMSIZ - 1);
+	if (ioctl(s, SIOCGIFINDEX, &ifr)) {
+		close(s);
+		return -1;
+	}
+	struct sockaddr_can addr;
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/** Generate EVision traffic, every id in turn with the instantaneous frames interleaved */
+static void makeEvisionFrame(unsigned long i, struct can_frame *frame) {
+	static const canid_t ids[] = { 0x700, 0x702, 0x701, 0x700, 0x702, 0x703, 0x700, 0x702, 0x704, 0x700, 0x702,
+			0x705, 0x700, 0x702, 0x706, 0x700, 0x702, 0x708 };
+	memset(frame, 0, sizeof(struct can_frame));
+	frame->can_id = ids[i % (sizeof(ids) / sizeof(canid_t))];
+	frame->can_dlc = 8;
+	for (int j = 0; j < 8; j++) {
+		frame->data[j] = (i + j) & 0xff;
+	}
+}
+
+/**
+ * Replay EVision frames from a candump log at speed times the recorded rate, or generate them at rate frames per
+ * second if there is no log. lost is set to the number of instantaneous voltage frames lost.
+ *
+ * @return 0 if successful, 1 if the socket or log could not be opened
+ */
+static int replayEvision(const char *ifName, const char *logFileName, double speed, double rate, double seconds,
+		unsigned long *lost) {
+	int s = openRawSocket(ifName);
+	if (s == -1) {
+		perror(ifName);
+		return 1;
+	}
+	FILE *logFile = NULL;
+	if (logFileName) {
+		logFile = fopen(logFileName, "r");
+		if (!logFile) {
+			perror(logFileName);
+			close(s);
+			return 1;
+		}
+	}
+	unsigned long count = rate * seconds;
+	resetCounters(logFile ? 1000000 : count);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned long sent = 0;
+	unsigned long sentInstVoltage = 0;
+	unsigned long sendErrors = 0;
+	double firstWhen = -1;
+	char line[128];
+	while (1) {
+		struct can_frame frame;
+		if (logFile) {
+			double when;
+			if (!fgets(line, sizeof(line), logFile)) {
+				break;
+			}
+			if (socReplay_parseCandumpLine(line, &when, &frame) || frame.can_id < 0x700 || frame.can_id > 0x708) {
+				continue;
+			}
+			if (firstWhen < 0) {
+				firstWhen = when;
+			}
+			// one frame per microsecond of scaled log time
+			waitUntilDue(&start, (when - firstWhen) * 1000000 / speed, 1000000);
+		} else {
+			if (sent == count) {
+				break;
+			}
+			makeEvisionFrame(sent, &frame);
+			waitUntilDue(&start, sent, rate);
+		}
+		if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
+			sendErrors++;
+		}
+		if (frame.can_id == 0x702) {
+			sentInstVoltage++;
+		}
+		sent++;
+	}
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double actualRate = sent * 1000000.0 / microsecondsBetween(&start, &end);
+	usleep(DRAIN_MICROSECONDS);
+	printf("evision  %9.0f/s sent %7lu soc events %7lu send errors %lu\n", actualRate, sent,
+			__atomic_load_n(&socEventCount, __ATOMIC_ACQUIRE), sendErrors);
+	// the instantaneous voltage listener measures from the kernel receive timestamp
+	printLatencies("0x702", actualRate * sentInstVoltage / (sent ? sent : 1), sentInstVoltage);
+	if (logFile) {
+		fclose(logFile);
+	}
+	close(s);
+	*lost = sentInstVoltage - __atomic_load_n(&receivedCount, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: canbench [-i interface] [-c cells] [-r start rate] [-m max rate] [-t seconds per step]\n"
+			"                [-f candump log] [-s replay speed] [-e evision rate] [-h]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *logFileName = NULL;
+	double rate = 100;
+	double maxRate = 1000000;
+	double seconds = 2;
+	double speed = 1;
+	double evisionRate = 500;
+	unsigned char benchHiResLogger = 0;
+	battery.name = "canbench";
+	battery.cellCount = 100;
+	config.canInterface = "vcan0";
+	int opt;
+	while ((opt = getopt(argc, argv, "i:c:r:m:t:f:s:e:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			config.canInterface = optarg;
+			break;
+		case 'c':
+			battery.cellCount = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'm':
+			maxRate = atof(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'f':
+			logFileName = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'e':
+			evisionRate = atof(optarg);
+			break;
+		case 'h':
+			benchHiResLogger = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (battery.cellCount == 0 || battery.cellCount > MAX_CELLS || rate <= 0 || seconds <= 0 || speed <= 0) {
+		usage();
+	}
+	config.loopDelay = 1;
+	config.batteryCount = 1;
+	config.batteries = &battery;
+	// send every frame, we want to measure the bus rather than the publishing policy
+	config.publishRefreshInterval = 0;
+
+	canEventListener_init(&config);
+	if (soc_init(&config) || monitorCan_init(&config)) {
+		fprintf(stderr, "could not open %s\n", config.canInterface);
+		return 1;
+	}
+	canEventListener_registerVoltageListener(voltageListener);
+	soc_registerSocEventListener(socEventListener);
+	// give the listener thread time to bind
+	usleep(DRAIN_MICROSECONDS);
+
+	double sustainable = 0;
+	for (; rate <= maxRate; rate *= 2) {
+		if (injectBmsFrames(rate, seconds)) {
+			break;
+		}
+		sustainable = rate;
+	}
+	printf("maximum sustainable bms rate %.0f frames/s\n", sustainable);
+
+	soc_registerInstVoltageListener(instVoltageListener);
+	unsigned long lost;
+	if (!benchHiResLogger) {
+		return replayEvision(config.canInterface, logFileName, speed, evisionRate, seconds, &lost);
+	}
+
+	hiResLogger_init(&config);
+	hiResLogger_start();
+	double sustainableSamples = 0;
+	for (; evisionRate <= maxRate; speed *= 2, evisionRate *= 2) {
+		struct hiResLogger_stats_t before;
+		struct hiResLogger_stats_t after;
+		hiResLogger_getStats(&before);
+		struct timespec start;
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (replayEvision(config.canInterface, logFileName, speed, evisionRate, seconds, &lost)) {
+			hiResLogger_stop();
+			return 1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		hiResLogger_getStats(&after);
+		unsigned long samples = after.samples - before.samples;
+		unsigned long overruns = after.overruns - before.overruns;
+		double sampleRate = samples * 1000000.0 / microsecondsBetween(&start, &end);
+		printf("hiRes    %9.0f/s samples %7lu written %7lu overruns %lu truncated %lu\n", sampleRate, samples,
+				after.written - before.written, overruns, after.truncated - before.truncated);
+		if (lost || overruns) {
+			break;
+		}
+		sustainableSamples = sampleRate;
+	}
+	hiResLogger_stop();
+	printf("maximum sustainable hiRes rate %.0f samples/s\n", sustainableSamples);
+	return 0;
+}
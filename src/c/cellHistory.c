@@ -0,0 +1,255 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "cellHistory.h"
+#include "trace.h"
+
+struct bucket_t {
+	uint32_t start;
+	uint32_t count;
+	float mean;
+	uint16_t min;
+	uint16_t max;
+};
+
+/* A ring of samples or buckets, head is the latest */
+struct ring_t {
+	uint16_t head;
+	uint16_t count;
+};
+
+struct series_t {
+	struct ring_t rawRing;
+	struct ring_t minuteRing;
+	struct ring_t hourRing;
+	struct cellHistory_sample_t raw[CELL_HISTORY_RAW_SAMPLES];
+	struct bucket_t minutes[CELL_HISTORY_MINUTES];
+	struct bucket_t hours[CELL_HISTORY_HOURS];
+};
+
+static unsigned char batteryCount;
+static unsigned short *cellCounts;
+// indexed by cell * CELL_HISTORY_SIGNAL_COUNT + signal
+static struct series_t **series;
+
+// recorded on the monitor thread, read by whoever wants a trend
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t cellHistory_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/** @return the index of the next entry in the ring, making room for it if the ring is full */
+static uint16_t advance(struct ring_t *ring, uint16_t size) {
+	if (ring->count == 0) {
+		ring->head = 0;
+	} else {
+		ring->head = (ring->head + 1) % size;
+	}
+	if (ring->count < size) {
+		ring->count++;
+	}
+	return ring->head;
+}
+
+/** @return the index of the entry age entries before the latest */
+static uint16_t older(const struct ring_t *ring, uint16_t size, uint16_t age) {
+	return (ring->head + size - age) % size;
+}
+
+static void addToBucket(struct ring_t *ring, struct bucket_t *buckets, uint16_t size, uint32_t period, uint32_t time,
+		uint16_t value) {
+	struct bucket_t *bucket = buckets + ring->head;
+	// a late sample goes in the latest bucket rather than rewriting history
+	if (ring->count == 0 || time / period > bucket->start / period) {
+		bucket = buckets + advance(ring, size);
+		bucket->start = time / period * period;
+		bucket->count = 0;
+		bucket->mean = 0;
+		bucket->min = 0xffff;
+		bucket->max = 0;
+	}
+	bucket->count++;
+	bucket->mean += (value - bucket->mean) / bucket->count;
+	bucket->min = value < bucket->min ? value : bucket->min;
+	bucket->max = value > bucket->max ? value : bucket->max;
+}
+
+static struct series_t *getSeries(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal) {
+	if (batteryIndex >= batteryCount || cellIndex >= cellCounts[batteryIndex] || signal >= CELL_HISTORY_SIGNAL_COUNT) {
+		return NULL;
+	}
+	return series[batteryIndex] + cellIndex * CELL_HISTORY_SIGNAL_COUNT + signal;
+}
+
+void cellHistory_record(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal,
+		uint32_t time, uint16_t value) {
+	struct series_t *s = getSeries(batteryIndex, cellIndex, signal);
+	if (!s) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	struct cellHistory_sample_t *sample = s->raw + advance(&s->rawRing, CELL_HISTORY_RAW_SAMPLES);
+	sample->time = time;
+	sample->value = value;
+	addToBucket(&s->minuteRing, s->minutes, CELL_HISTORY_MINUTES, 60, time, value);
+	addToBucket(&s->hourRing, s->hours, CELL_HISTORY_HOURS, 60 * 60, time, value);
+	pthread_mutex_unlock(&mutex);
+}
+
+unsigned short cellHistory_getSamples(unsigned char batteryIndex, unsigned short cellIndex,
+		cellHistory_signal_t signal, struct cellHistory_sample_t *samples, unsigned short max) {
+	struct series_t *s = getSeries(batteryIndex, cellIndex, signal);
+	if (!s) {
+		return 0;
+	}
+	pthread_mutex_lock(&mutex);
+	unsigned short count = s->rawRing.count < max ? s->rawRing.count : max;
+	for (unsigned short i = 0; i < count; i++) {
+		samples[i] = s->raw[older(&s->rawRing, CELL_HISTORY_RAW_SAMPLES, i)];
+	}
+	pthread_mutex_unlock(&mutex);
+	return count;
+}
+
+static void summariseBuckets(const struct ring_t *ring, const struct bucket_t *buckets, uint16_t size,
+		uint32_t period, uint32_t since, struct cellHistory_summary_t *summary) {
+	double total = 0;
+	for (uint16_t age = 0; age < ring->count; age++) {
+		const struct bucket_t *bucket = buckets + older(ring, size, age);
+		if (bucket->start < since) {
+			break;
+		}
+		if (age == 0) {
+			summary->end = bucket->start + period;
+		}
+		summary->start = bucket->start;
+		summary->count += bucket->count;
+		total += (double) bucket->mean * bucket->count;
+		summary->min = bucket->min < summary->min ? bucket->min : summary->min;
+		summary->max = bucket->max > summary->max ? bucket->max : summary->max;
+	}
+	summary->mean = summary->count ? total / summary->count : 0;
+}
+
+static void summariseSamples(const struct series_t *s, uint32_t since, struct cellHistory_summary_t *summary) {
+	double total = 0;
+	for (uint16_t age = 0; age < s->rawRing.count; age++) {
+		const struct cellHistory_sample_t *sample = s->raw + older(&s->rawRing, CELL_HISTORY_RAW_SAMPLES, age);
+		if (sample->time < since) {
+			break;
+		}
+		if (age == 0) {
+			summary->end = sample->time;
+		}
+		summary->start = sample->time;
+		summary->count++;
+		total += sample->value;
+		summary->min = sample->value < summary->min ? sample->value : summary->min;
+		summary->max = sample->value > summary->max ? sample->value : summary->max;
+	}
+	summary->mean = summary->count ? total / summary->count : 0;
+}
+
+int cellHistory_getSummary(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal,
+		cellHistory_tier_t tier, uint32_t since, struct cellHistory_summary_t *summary) {
+	struct series_t *s = getSeries(batteryIndex, cellIndex, signal);
+	if (!s) {
+		return 1;
+	}
+	struct cellHistory_summary_t result = { 0, 0, 0, 0xffff, 0, 0 };
+	pthread_mutex_lock(&mutex);
+	switch (tier) {
+	case CELL_HISTORY_RAW:
+		summariseSamples(s, since, &result);
+		break;
+	case CELL_HISTORY_MINUTE:
+		summariseBuckets(&s->minuteRing, s->minutes, CELL_HISTORY_MINUTES, 60, since, &result);
+		break;
+	case CELL_HISTORY_HOUR:
+		summariseBuckets(&s->hourRing, s->hours, CELL_HISTORY_HOURS, 60 * 60, since, &result);
+		break;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!result.count) {
+		return 1;
+	}
+	*summary = result;
+	return 0;
+}
+
+int cellHistory_getSlope(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal,
+		uint32_t since, double *slope) {
+	struct cellHistory_sample_t samples[CELL_HISTORY_RAW_SAMPLES];
+	unsigned short count = cellHistory_getSamples(batteryIndex, cellIndex, signal, samples, CELL_HISTORY_RAW_SAMPLES);
+	// relative to the latest sample to keep the sums small
+	double n = 0, sumT = 0, sumV = 0, sumTT = 0, sumTV = 0;
+	for (unsigned short i = 0; i < count && samples[i].time >= since; i++) {
+		double t = (double) samples[i].time - samples[0].time;
+		n++;
+		sumT += t;
+		sumV += samples[i].value;
+		sumTT += t * t;
+		sumTV += t * samples[i].value;
+	}
+	double denominator = n * sumTT - sumT * sumT;
+	if (n < 2 || denominator == 0) {
+		return 1;
+	}
+	*slope = (n * sumTV - sumT * sumV) / denominator * 60 * 60;
+	return 0;
+}
+
+size_t cellHistory_getMemoryUsage(unsigned int cellCount) {
+	return (size_t) cellCount * CELL_HISTORY_SIGNAL_COUNT * sizeof(struct series_t);
+}
+
+int cellHistory_init(struct config_t *config) {
+	cellCounts = calloc(config->batteryCount, sizeof(unsigned short));
+	series = calloc(config->batteryCount, sizeof(struct series_t *));
+	if (!cellCounts || !series) {
+		return 1;
+	}
+	unsigned int cellCount = 0;
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		series[i] = calloc((size_t) config->batteries[i].cellCount * CELL_HISTORY_SIGNAL_COUNT,
+				sizeof(struct series_t));
+		if (!series[i] && config->batteries[i].cellCount) {
+			fprintf(stderr, "error allocating history for %s\n", config->batteries[i].name);
+			return 1;
+		}
+		cellCounts[i] = config->batteries[i].cellCount;
+		cellCount += cellCounts[i];
+	}
+	batteryCount = config->batteryCount;
+	TRACE_INFO(TRACE_MONITOR, "cell history is %zu KB, %zu KB at %d cells per battery",
+			cellHistory_getMemoryUsage(cellCount) / 1024, cellHistory_getMemoryUsage(MAX_CELLS) / 1024, MAX_CELLS);
+	return 0;
+}
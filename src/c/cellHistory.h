@@ -0,0 +1,94 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_CELL_HISTORY_H_
+#define TUMANAKO_CELL_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recent history of each cell's voltage, shunt current and temperature in memory.
+ *
+ * Every reading goes into three rings: the last CELL_HISTORY_RAW_SAMPLES readings as they were, then min, max and
+ * mean per minute for the last CELL_HISTORY_MINUTES minutes and per hour for the last CELL_HISTORY_HOURS hours. The
+ * rings are allocated once in cellHistory_init() so memory doesn't grow however long we run.
+ *
+ * Times are seconds from cellHistory_now(), which doesn't jump when the clock is set.
+ */
+
+#define CELL_HISTORY_RAW_SAMPLES 32
+#define CELL_HISTORY_MINUTES 60
+#define CELL_HISTORY_HOURS 24
+
+typedef enum {
+	CELL_HISTORY_VOLTAGE, CELL_HISTORY_SHUNT_CURRENT, CELL_HISTORY_TEMPERATURE, CELL_HISTORY_SIGNAL_COUNT
+} cellHistory_signal_t;
+
+typedef enum {
+	CELL_HISTORY_RAW, CELL_HISTORY_MINUTE, CELL_HISTORY_HOUR
+} cellHistory_tier_t;
+
+struct cellHistory_sample_t {
+	uint32_t time;
+	uint16_t value;
+};
+
+struct cellHistory_summary_t {
+	// the start of the earliest bucket or sample and the end of the latest
+	uint32_t start;
+	uint32_t end;
+	uint32_t count;
+	uint16_t min;
+	uint16_t max;
+	float mean;
+};
+
+struct config_t;
+
+/** Allocate the history of every configured cell, @return 0 on success */
+int cellHistory_init(struct config_t *config);
+
+/** @return bytes used by the history of cellCount cells */
+size_t cellHistory_getMemoryUsage(unsigned int cellCount);
+
+uint32_t cellHistory_now();
+
+void cellHistory_record(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal,
+		uint32_t time, uint16_t value);
+
+/** Copy up to max raw samples, newest first, @return the number copied */
+unsigned short cellHistory_getSamples(unsigned char batteryIndex, unsigned short cellIndex,
+		cellHistory_signal_t signal, struct cellHistory_sample_t *samples, unsigned short max);
+
+/**
+ * Summarise the samples or buckets of a tier that start at or after since, @return 0 if there are any, summary is
+ * left untouched if not
+ */
+int cellHistory_getSummary(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal,
+		cellHistory_tier_t tier, uint32_t since, struct cellHistory_summary_t *summary);
+
+/**
+ * Least squares slope of the raw samples at or after since in units per hour, eg mV/h, @return 0 if there are at
+ * least two samples at different times
+ */
+int cellHistory_getSlope(unsigned char batteryIndex, unsigned short cellIndex, cellHistory_signal_t signal,
+		uint32_t since, double *slope);
+
+#endif /* TUMANAKO_CELL_HISTORY_H_ */
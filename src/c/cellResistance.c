@@ -0,0 +1,184 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "soc.h"
+#include "cellResistance.h"
+#include "trace.h"
+
+// seconds we wait for the current after a reading, and the longest between two readings we pair
+#define MAX_WAIT 5
+#define MAX_STEP_INTERVAL 30
+// each step counts this much less than the one after it
+#define FORGETTING_FACTOR 0.99
+// 1/A^2, the starting resistance counts about as much as one step of 10A
+#define INITIAL_COVARIANCE 0.01
+#define MAX_RESISTANCE 0.1
+
+struct cell_t {
+	double resistance;
+	double covariance;
+	double lastVoltage;
+	double lastCurrent;
+	struct timeval lastReceived;
+	unsigned long updates;
+	unsigned char hasLast;
+};
+
+struct reading_t {
+	unsigned char batteryIndex;
+	unsigned short cellIndex;
+	unsigned short voltage;
+	struct timeval received;
+};
+
+static unsigned char batteryCount;
+static unsigned short *cellCounts;
+static struct cell_t **cells;
+
+// readings waiting for the current after them, a ring with room for a reading from every cell, oldest first
+static struct reading_t *pending;
+static unsigned int pendingSize;
+static unsigned int pendingStart;
+static unsigned int pendingCount;
+static unsigned long droppedCount;
+static unsigned long reportedDroppedCount;
+
+// updated on the monitor thread, read from any
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double secondsBetween(const struct timeval *from, const struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+int cellResistance_init(struct config_t *config) {
+	cellCounts = calloc(config->batteryCount, sizeof(unsigned short));
+	cells = calloc(config->batteryCount, sizeof(struct cell_t *));
+	if (!cellCounts || !cells) {
+		return 1;
+	}
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		cells[i] = calloc(config->batteries[i].cellCount, sizeof(struct cell_t));
+		if (!cells[i] && config->batteries[i].cellCount) {
+			fprintf(stderr, "error allocating resistance estimates for %s\n", config->batteries[i].name);
+			return 1;
+		}
+		for (unsigned short j = 0; j < config->batteries[i].cellCount; j++) {
+			cells[i][j].resistance = config->cellResistance / 1e6;
+			cells[i][j].covariance = INITIAL_COVARIANCE;
+		}
+		cellCounts[i] = config->batteries[i].cellCount;
+		pendingSize += cellCounts[i];
+	}
+	pending = calloc(pendingSize ? pendingSize : 1, sizeof(struct reading_t));
+	if (!pending) {
+		return 1;
+	}
+	batteryCount = config->batteryCount;
+	return 0;
+}
+
+void cellResistance_record(unsigned char batteryIndex, unsigned short cellIndex, unsigned short voltage,
+		const struct timeval *received) {
+	if (batteryIndex >= batteryCount || cellIndex >= cellCounts[batteryIndex]) {
+		return;
+	}
+	if (pendingCount == pendingSize) {
+		// a whole pack of readings is waiting, the current has stopped coming, drop the oldest
+		pendingStart = (pendingStart + 1) % pendingSize;
+		pendingCount--;
+		droppedCount++;
+	}
+	struct reading_t *reading = pending + (pendingStart + pendingCount) % pendingSize;
+	reading->batteryIndex = batteryIndex;
+	reading->cellIndex = cellIndex;
+	reading->voltage = voltage;
+	reading->received = *received;
+	pendingCount++;
+}
+
+/** One step of recursive least squares of the voltage drop on the current rise */
+static void addReading(struct cell_t *cell, double voltage, double current, const struct timeval *received) {
+	if (cell->hasLast && secondsBetween(&cell->lastReceived, received) <= MAX_STEP_INTERVAL) {
+		double step = current - cell->lastCurrent;
+		if (fabs(step) >= CELL_RESISTANCE_MIN_STEP) {
+			double drop = cell->lastVoltage - voltage;
+			double gain = cell->covariance * step / (FORGETTING_FACTOR + step * step * cell->covariance);
+			pthread_mutex_lock(&mutex);
+			cell->resistance = fmin(fmax(cell->resistance + gain * (drop - step * cell->resistance), 0), MAX_RESISTANCE);
+			cell->covariance = (cell->covariance - gain * step * cell->covariance) / FORGETTING_FACTOR;
+			cell->updates++;
+			pthread_mutex_unlock(&mutex);
+		}
+	}
+	cell->lastVoltage = voltage;
+	cell->lastCurrent = current;
+	cell->lastReceived = *received;
+	cell->hasLast = 1;
+}
+
+void cellResistance_process() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	while (pendingCount) {
+		struct reading_t *reading = pending + pendingStart;
+		double current;
+		int result = soc_getInstCurrentAt(&reading->received, &current);
+		if (result == SOC_NOT_YET && secondsBetween(&reading->received, &now) < MAX_WAIT) {
+			// the rest are later still
+			break;
+		}
+		if (result == 0) {
+			addReading(cells[reading->batteryIndex] + reading->cellIndex, reading->voltage / 1000.0, current,
+					&reading->received);
+		}
+		pendingStart = (pendingStart + 1) % pendingSize;
+		pendingCount--;
+	}
+	if (droppedCount != reportedDroppedCount) {
+		TRACE_WARN(TRACE_MONITOR, "dropped %lu cell readings waiting for the current, %lu in all",
+				droppedCount - reportedDroppedCount, droppedCount);
+		reportedDroppedCount = droppedCount;
+	}
+}
+
+unsigned long cellResistance_getDroppedCount() {
+	return droppedCount;
+}
+
+int cellResistance_get(unsigned char batteryIndex, unsigned short cellIndex,
+		struct cellResistance_estimate_t *estimate) {
+	if (batteryIndex >= batteryCount || cellIndex >= cellCounts[batteryIndex]) {
+		return 1;
+	}
+	pthread_mutex_lock(&mutex);
+	struct cell_t *cell = cells[batteryIndex] + cellIndex;
+	estimate->resistance = cell->resistance;
+	estimate->updates = cell->updates;
+	pthread_mutex_unlock(&mutex);
+	return estimate->updates == 0;
+}
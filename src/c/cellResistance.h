@@ -0,0 +1,66 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_CELL_RESISTANCE_H_
+#define TUMANAKO_CELL_RESISTANCE_H_
+
+#include <sys/time.h>
+
+/*
+ * Internal resistance of every cell, estimated while driving from how its voltage moves with the pack current.
+ *
+ * Each voltage reading is paired with the instantaneous current interpolated to the moment the reading was received.
+ * Once a cell has two readings the current changed by at least CELL_RESISTANCE_MIN_STEP A between, the drop in voltage
+ * over the rise in current updates a recursive least squares estimate of its resistance. Older steps are forgotten a
+ * little with each new one so the estimate follows the cell as it warms up or ages. Every reading costs the same small
+ * amount of work however long we have been running.
+ *
+ * A reading is held until the current after it has been received, so readings are recorded as they come in and
+ * cellResistance_process() catches up with whatever can be paired.
+ */
+
+#define CELL_RESISTANCE_MIN_STEP 10
+
+struct cellResistance_estimate_t {
+	// ohms
+	double resistance;
+	// how many current steps it is from
+	unsigned long updates;
+};
+
+struct config_t;
+
+/** @return 0 on success */
+int cellResistance_init(struct config_t *config);
+
+/** Queue a voltage (mV) read from a cell, received from gettimeofday() */
+void cellResistance_record(unsigned char batteryIndex, unsigned short cellIndex, unsigned short voltage,
+		const struct timeval *received);
+
+/** Use the queued readings we now have the current either side of */
+void cellResistance_process();
+
+/** @return how many readings were dropped because the queue was full of readings still waiting for the current */
+unsigned long cellResistance_getDroppedCount();
+
+/** @return 0 if the cell has an estimate from at least one current step */
+int cellResistance_get(unsigned char batteryIndex, unsigned short cellIndex,
+		struct cellResistance_estimate_t *estimate);
+
+#endif /* TUMANAKO_CELL_RESISTANCE_H_ */
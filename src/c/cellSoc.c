@@ -0,0 +1,224 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "cellSoc.h"
+
+/* Resting voltage of a LiFePO4 cell every 5% from empty to full */
+#define OCV_POINTS 21
+static const float openCircuitVoltages[OCV_POINTS] = {
+		2.800f, 3.100f, 3.200f, 3.240f, 3.260f, 3.270f, 3.280f, 3.290f, 3.295f, 3.300f, 3.305f,
+		3.310f, 3.315f, 3.320f, 3.325f, 3.330f, 3.335f, 3.340f, 3.350f, 3.380f, 3.500f };
+
+// V^2, mostly how far a cell under load strays from the curve rather than how well it reads
+#define MEASUREMENT_VARIANCE (0.02f * 0.02f)
+// per second, SOC and inverse capacity relative to the rated capacity
+#define SOC_NOISE 1e-9f
+#define CAPACITY_NOISE 1e-10f
+// the curve is flat enough that a first reading could be almost anywhere in the middle
+#define START_SOC_VARIANCE (0.3f * 0.3f)
+#define START_CAPACITY_VARIANCE (0.1f * 0.1f)
+// no cell is taken to hold less than half or more than twice its rating
+#define MIN_CAPACITY 0.5f
+#define MAX_CAPACITY 2.0f
+
+static unsigned char batteryCount;
+static struct cellSoc_filter_t filters[MAX_BATTERIES];
+// stepped on the monitor thread, read from any
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+float cellSoc_getOpenCircuitVoltage(float soc) {
+	float position = fminf(fmaxf(soc, 0), 1) * (OCV_POINTS - 1);
+	int index = (int) position;
+	index = index < OCV_POINTS - 2 ? index : OCV_POINTS - 2;
+	return openCircuitVoltages[index] + (position - index) * (openCircuitVoltages[index + 1] - openCircuitVoltages[index]);
+}
+
+/** @return the SOC at which a resting cell would read voltage */
+static float getSocAt(float voltage) {
+	if (voltage <= openCircuitVoltages[0]) {
+		return 0;
+	}
+	for (int i = 0; i < OCV_POINTS - 1; i++) {
+		if (voltage < openCircuitVoltages[i + 1]) {
+			return (i + (voltage - openCircuitVoltages[i]) / (openCircuitVoltages[i + 1] - openCircuitVoltages[i]))
+					/ (OCV_POINTS - 1);
+		}
+	}
+	return 1;
+}
+
+int cellSoc_initFilter(struct cellSoc_filter_t *filter, unsigned short cellCount, float ratedCapacity,
+		float resistance) {
+	memset(filter, 0, sizeof(struct cellSoc_filter_t));
+	filter->cellCount = cellCount;
+	filter->paddedCount = (cellCount + CELL_STORE_LANES - 1) / CELL_STORE_LANES * CELL_STORE_LANES;
+	filter->ratedCapacity = ratedCapacity;
+	filter->resistance = resistance;
+	filter->soc = calloc(filter->paddedCount, sizeof(float));
+	filter->inverseCapacity = calloc(filter->paddedCount, sizeof(float));
+	filter->p00 = calloc(filter->paddedCount, sizeof(float));
+	filter->p01 = calloc(filter->paddedCount, sizeof(float));
+	filter->p11 = calloc(filter->paddedCount, sizeof(float));
+	filter->started = calloc(filter->paddedCount, sizeof(unsigned char));
+	if (filter->paddedCount && (!filter->soc || !filter->inverseCapacity || !filter->p00 || !filter->p01
+			|| !filter->p11 || !filter->started)) {
+		cellSoc_freeFilter(filter);
+		return 1;
+	}
+	for (unsigned short i = 0; i < filter->paddedCount; i++) {
+		filter->inverseCapacity[i] = 1 / ratedCapacity;
+	}
+	return 0;
+}
+
+void cellSoc_freeFilter(struct cellSoc_filter_t *filter) {
+	free(filter->soc);
+	free(filter->inverseCapacity);
+	free(filter->p00);
+	free(filter->p01);
+	free(filter->p11);
+	free(filter->started);
+	memset(filter, 0, sizeof(struct cellSoc_filter_t));
+}
+
+/** Start the cells that have their first reading from the SOC their voltage suggests */
+static void startCells(struct cellSoc_filter_t *filter, const struct cellStore_t *store, float current) {
+	float inverseCapacity = 1 / filter->ratedCapacity;
+	for (unsigned short i = 0; i < filter->cellCount; i++) {
+		if (filter->started[i] || !(store->flags[i] & CELL_STORE_FRESH)) {
+			continue;
+		}
+		float cellCurrent = current + store->shuntCurrents[i] * 0.001f;
+		filter->soc[i] = getSocAt(store->voltages[i] * 0.001f + cellCurrent * filter->resistance);
+		filter->inverseCapacity[i] = inverseCapacity;
+		filter->p00[i] = START_SOC_VARIANCE;
+		filter->p01[i] = 0;
+		filter->p11[i] = START_CAPACITY_VARIANCE * inverseCapacity * inverseCapacity;
+		filter->started[i] = 1;
+		filter->startedCount++;
+	}
+}
+
+void cellSoc_step(struct cellSoc_filter_t *filter, const struct cellStore_t *store, float current, float charge,
+		float seconds) {
+	float * restrict soc = filter->soc;
+	float * restrict inverseCapacity = filter->inverseCapacity;
+	float * restrict p00 = filter->p00;
+	float * restrict p01 = filter->p01;
+	float * restrict p11 = filter->p11;
+	const unsigned char *started = filter->started;
+	const unsigned short *voltages = store->voltages;
+	const unsigned short *shuntCurrents = store->shuntCurrents;
+	const unsigned char *flags = store->flags;
+	float resistance = filter->resistance;
+	float minInverseCapacity = 1 / (MAX_CAPACITY * filter->ratedCapacity);
+	float maxInverseCapacity = 1 / (MIN_CAPACITY * filter->ratedCapacity);
+	float socNoise = SOC_NOISE * seconds;
+	float capacityNoise = CAPACITY_NOISE * seconds / (filter->ratedCapacity * filter->ratedCapacity);
+	// every cell does the same arithmetic, cells without a fresh reading just get no gain
+	for (unsigned short i = 0; i < filter->paddedCount; i++) {
+		float shuntCurrent = shuntCurrents[i] * 0.001f;
+		float cellCurrent = current + shuntCurrent;
+		float cellCharge = charge + shuntCurrent * seconds / (60 * 60);
+
+		// predict
+		float s = fminf(fmaxf(soc[i] - cellCharge * inverseCapacity[i], 0), 1);
+		float a = p00[i] - 2 * cellCharge * p01[i] + cellCharge * cellCharge * p11[i] + socNoise;
+		float b = p01[i] - cellCharge * p11[i];
+		float d = p11[i] + capacityNoise;
+
+		// correct
+		float position = s * (OCV_POINTS - 1);
+		int index = (int) position;
+		index = index < OCV_POINTS - 2 ? index : OCV_POINTS - 2;
+		float step = openCircuitVoltages[index + 1] - openCircuitVoltages[index];
+		float expected = openCircuitVoltages[index] + (position - index) * step - cellCurrent * resistance;
+		float isMeasured = (flags[i] & CELL_STORE_FRESH) && started[i] ? 1 : 0;
+		float h = step * (OCV_POINTS - 1) * isMeasured;
+		float innovation = voltages[i] * 0.001f - expected;
+		float innovationVariance = h * h * a + MEASUREMENT_VARIANCE;
+		float k0 = a * h / innovationVariance;
+		float k1 = b * h / innovationVariance;
+		soc[i] = fminf(fmaxf(s + k0 * innovation, 0), 1);
+		inverseCapacity[i] = fminf(fmaxf(inverseCapacity[i] + k1 * innovation, minInverseCapacity),
+				maxInverseCapacity);
+		p00[i] = a - k0 * h * a;
+		p01[i] = b - k0 * h * b;
+		p11[i] = d - k1 * h * b;
+	}
+	if (filter->startedCount < filter->cellCount) {
+		startCells(filter, store, current);
+	}
+}
+
+int cellSoc_getEstimate(const struct cellSoc_filter_t *filter, unsigned short cellIndex,
+		struct cellSoc_estimate_t *estimate) {
+	if (cellIndex >= filter->cellCount || !filter->started[cellIndex]) {
+		return 1;
+	}
+	float inverseCapacity = filter->inverseCapacity[cellIndex];
+	estimate->soc = filter->soc[cellIndex];
+	estimate->socError = sqrtf(fmaxf(filter->p00[cellIndex], 0));
+	estimate->capacity = 1 / inverseCapacity;
+	// to first order the error of 1/x is the error of x over x^2
+	estimate->capacityError = sqrtf(fmaxf(filter->p11[cellIndex], 0)) / (inverseCapacity * inverseCapacity);
+	return 0;
+}
+
+int cellSoc_init(struct config_t *config) {
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		if (cellSoc_initFilter(filters + i, config->batteries[i].cellCount, config->cellCapacity,
+				config->cellResistance / 1e6f)) {
+			fprintf(stderr, "error allocating SOC estimates for %s\n", config->batteries[i].name);
+			return 1;
+		}
+	}
+	batteryCount = config->batteryCount;
+	return 0;
+}
+
+void cellSoc_update(unsigned char batteryIndex, const struct cellStore_t *store, double current, double charge,
+		double seconds) {
+	if (batteryIndex >= batteryCount) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	cellSoc_step(filters + batteryIndex, store, current, charge, seconds);
+	pthread_mutex_unlock(&mutex);
+}
+
+int cellSoc_get(unsigned char batteryIndex, unsigned short cellIndex, struct cellSoc_estimate_t *estimate) {
+	if (batteryIndex >= batteryCount) {
+		return 1;
+	}
+	pthread_mutex_lock(&mutex);
+	int result = cellSoc_getEstimate(filters + batteryIndex, cellIndex, estimate);
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
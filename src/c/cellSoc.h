@@ -0,0 +1,97 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_CELL_SOC_H_
+#define TUMANAKO_CELL_SOC_H_
+
+#include "cellStore.h"
+
+/*
+ * State of charge and capacity of every cell, estimated each sweep by an extended Kalman filter.
+ *
+ * Each cell's state is its SOC and the inverse of its capacity. Between sweeps the SOC moves by the charge the pack
+ * current moved plus whatever the cell's shunt took. Each fresh voltage reading, less the drop across the cell's
+ * internal resistance, is then compared with the open circuit voltage that SOC should give. Where the curve is flat
+ * the reading says little and the estimate mostly follows the charge. Where the curve is steep, at either end, the
+ * reading pulls the estimate into line and over time shows which cells hold more or less than their rating.
+ *
+ * The state is one array per value so a step is one branch free pass over all the cells of a battery, padded to
+ * CELL_STORE_LANES like the cell store it reads from.
+ */
+
+struct cellSoc_estimate_t {
+	// 0 empty to 1 full
+	float soc;
+	// standard deviations
+	float socError;
+	// Ah
+	float capacity;
+	float capacityError;
+};
+
+struct cellSoc_filter_t {
+	unsigned short cellCount;
+	unsigned short paddedCount;
+	float *soc;
+	float *inverseCapacity;
+	// the symmetric covariance of soc and inverseCapacity
+	float *p00;
+	float *p01;
+	float *p11;
+	// non zero once the cell has had a reading to start from
+	unsigned char *started;
+	unsigned short startedCount;
+	float ratedCapacity;
+	// ohms
+	float resistance;
+};
+
+/** @return 0 on success */
+int cellSoc_initFilter(struct cellSoc_filter_t *filter, unsigned short cellCount, float ratedCapacity,
+		float resistance);
+void cellSoc_freeFilter(struct cellSoc_filter_t *filter);
+
+/**
+ * Move every cell on by seconds in which charge Ah left the pack, then correct the cells with a fresh voltage in store
+ * taken while current A was flowing. Positive is discharging as in soc.h. A cell's first reading starts it from the SOC
+ * its voltage suggests.
+ */
+void cellSoc_step(struct cellSoc_filter_t *filter, const struct cellStore_t *store, float current, float charge,
+		float seconds);
+
+/** @return 0 if the cell has an estimate */
+int cellSoc_getEstimate(const struct cellSoc_filter_t *filter, unsigned short cellIndex,
+		struct cellSoc_estimate_t *estimate);
+
+/** @return the open circuit voltage (V) of a cell at soc */
+float cellSoc_getOpenCircuitVoltage(float soc);
+
+struct config_t;
+
+/** Create a filter for every configured battery, @return 0 on success */
+int cellSoc_init(struct config_t *config);
+
+/** Step the filter of a battery after a sweep, see cellSoc_step(), on the monitor thread */
+void cellSoc_update(unsigned char batteryIndex, const struct cellStore_t *store, double current, double charge,
+		double seconds);
+
+/** The latest estimate of a cell from any thread, @return 0 if the cell has an estimate */
+int cellSoc_get(unsigned char batteryIndex, unsigned short cellIndex, struct cellSoc_estimate_t *estimate);
+
+#endif /* TUMANAKO_CELL_SOC_H_ */
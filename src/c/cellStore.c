@@ -0,0 +1,148 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "cellStore.h"
+
+int cellStore_init(struct cellStore_t *store, unsigned short cellCount) {
+	memset(store, 0, sizeof(struct cellStore_t));
+	store->cellCount = cellCount;
+	store->paddedCount = (cellCount + CELL_STORE_LANES - 1) / CELL_STORE_LANES * CELL_STORE_LANES;
+	store->voltages = calloc(store->paddedCount, sizeof(unsigned short));
+	store->shuntCurrents = calloc(store->paddedCount, sizeof(unsigned short));
+	store->temperatures = calloc(store->paddedCount, sizeof(unsigned short));
+	store->flags = calloc(store->paddedCount, sizeof(unsigned char));
+	if (store->paddedCount && (!store->voltages || !store->shuntCurrents || !store->temperatures || !store->flags)) {
+		cellStore_free(store);
+		return 1;
+	}
+	return 0;
+}
+
+void cellStore_free(struct cellStore_t *store) {
+	free(store->voltages);
+	free(store->shuntCurrents);
+	free(store->temperatures);
+	free(store->flags);
+	memset(store, 0, sizeof(struct cellStore_t));
+}
+
+void cellStore_update(struct cellStore_t *store, unsigned short cellIndex, unsigned short voltage,
+		unsigned short shuntCurrent, unsigned short temperature, unsigned char hasTemperature) {
+	store->voltages[cellIndex] = voltage;
+	store->shuntCurrents[cellIndex] = shuntCurrent;
+	store->temperatures[cellIndex] = temperature;
+	store->flags[cellIndex] = CELL_STORE_VALID | CELL_STORE_FRESH | (hasTemperature ? CELL_STORE_HAS_TEMPERATURE : 0);
+}
+
+void cellStore_clearFlags(struct cellStore_t *store, unsigned short cellIndex, unsigned char flags) {
+	store->flags[cellIndex] &= ~flags;
+}
+
+void cellStore_beginSweep(struct cellStore_t *store) {
+	for (unsigned short i = 0; i < store->paddedCount; i++) {
+		store->flags[i] &= ~CELL_STORE_FRESH;
+	}
+}
+
+void cellStore_getStats(const struct cellStore_t *store, struct cellStore_stats_t *stats) {
+	/*
+	 * Each lane keeps its own running values and the loop body has no branches so the compiler can keep the lanes
+	 * in vector registers. Within a lane the first cell wins a tie because the comparisons are strict, the lanes are
+	 * then combined preferring the lower cell.
+	 */
+	unsigned short minVoltage[CELL_STORE_LANES];
+	unsigned short minVoltageCell[CELL_STORE_LANES];
+	unsigned short maxVoltage[CELL_STORE_LANES];
+	unsigned short maxVoltageCell[CELL_STORE_LANES];
+	unsigned long totalVoltage[CELL_STORE_LANES];
+	unsigned short validCount[CELL_STORE_LANES];
+	unsigned short maxTemperature[CELL_STORE_LANES];
+	unsigned short maxTemperatureCell[CELL_STORE_LANES];
+	for (int lane = 0; lane < CELL_STORE_LANES; lane++) {
+		minVoltage[lane] = 0xffff;
+		minVoltageCell[lane] = lane;
+		maxVoltage[lane] = 0;
+		maxVoltageCell[lane] = lane;
+		totalVoltage[lane] = 0;
+		validCount[lane] = 0;
+		maxTemperature[lane] = 0;
+		maxTemperatureCell[lane] = lane;
+	}
+	const unsigned short *voltages = store->voltages;
+	const unsigned short *temperatures = store->temperatures;
+	const unsigned char *flags = store->flags;
+	for (unsigned short base = 0; base < store->paddedCount; base += CELL_STORE_LANES) {
+		for (int lane = 0; lane < CELL_STORE_LANES; lane++) {
+			unsigned short cell = base + lane;
+			unsigned short valid = flags[cell] & CELL_STORE_VALID;
+			// all ones for a valid cell, invalid cells can't be the minimum or add anything
+			unsigned short mask = -valid;
+			unsigned short voltage = voltages[cell] & mask;
+			unsigned short forMin = voltage | ~mask;
+			unsigned short temperatureMask = (flags[cell] & (CELL_STORE_VALID | CELL_STORE_HAS_TEMPERATURE))
+					== (CELL_STORE_VALID | CELL_STORE_HAS_TEMPERATURE) ? 0xffff : 0;
+			unsigned short temperature = temperatures[cell] & temperatureMask;
+
+			unsigned char isLower = forMin < minVoltage[lane];
+			minVoltageCell[lane] = isLower ? cell : minVoltageCell[lane];
+			minVoltage[lane] = isLower ? forMin : minVoltage[lane];
+			unsigned char isHigher = voltage > maxVoltage[lane];
+			maxVoltageCell[lane] = isHigher ? cell : maxVoltageCell[lane];
+			maxVoltage[lane] = isHigher ? voltage : maxVoltage[lane];
+			unsigned char isHotter = temperature > maxTemperature[lane];
+			maxTemperatureCell[lane] = isHotter ? cell : maxTemperatureCell[lane];
+			maxTemperature[lane] = isHotter ? temperature : maxTemperature[lane];
+			totalVoltage[lane] += voltage;
+			validCount[lane] += valid;
+		}
+	}
+
+	stats->minVoltage = 0xffff;
+	stats->minVoltageCell = 0;
+	stats->maxVoltage = 0;
+	stats->maxVoltageCell = 0;
+	stats->totalVoltage = 0;
+	stats->validCount = 0;
+	stats->maxTemperature = 0;
+	stats->maxTemperatureCell = 0;
+	for (int lane = 0; lane < CELL_STORE_LANES; lane++) {
+		if (minVoltage[lane] < stats->minVoltage
+				|| (minVoltage[lane] == stats->minVoltage && minVoltage[lane] != 0xffff
+						&& minVoltageCell[lane] < stats->minVoltageCell)) {
+			stats->minVoltage = minVoltage[lane];
+			stats->minVoltageCell = minVoltageCell[lane];
+		}
+		if (maxVoltage[lane] > stats->maxVoltage
+				|| (maxVoltage[lane] == stats->maxVoltage && maxVoltage[lane] && maxVoltageCell[lane] < stats->maxVoltageCell)) {
+			stats->maxVoltage = maxVoltage[lane];
+			stats->maxVoltageCell = maxVoltageCell[lane];
+		}
+		if (maxTemperature[lane] > stats->maxTemperature
+				|| (maxTemperature[lane] == stats->maxTemperature && maxTemperature[lane]
+						&& maxTemperatureCell[lane] < stats->maxTemperatureCell)) {
+			stats->maxTemperature = maxTemperature[lane];
+			stats->maxTemperatureCell = maxTemperatureCell[lane];
+		}
+		stats->totalVoltage += totalVoltage[lane];
+		stats->validCount += validCount[lane];
+	}
+}
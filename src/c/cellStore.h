@@ -0,0 +1,75 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_CELL_STORE_H_
+#define TUMANAKO_CELL_STORE_H_
+
+/*
+ * The measurements we look at every sweep kept as one array per signal, so pack statistics are one pass over a few
+ * contiguous arrays rather than a walk over struct status_t for each statistic.
+ *
+ * The arrays are padded to a multiple of CELL_STORE_LANES with invalid cells so the pass needs no remainder loop.
+ */
+
+#define CELL_STORE_LANES 8
+
+#define CELL_STORE_VALID 0x01
+#define CELL_STORE_HAS_TEMPERATURE 0x02
+// read in this sweep rather than kept from an earlier one
+#define CELL_STORE_FRESH 0x04
+
+struct cellStore_t {
+	unsigned short cellCount;
+	unsigned short paddedCount;
+	// mV, mA and hundredths of a degree
+	unsigned short *voltages;
+	unsigned short *shuntCurrents;
+	unsigned short *temperatures;
+	// CELL_STORE_VALID if we have a reading for the cell, CELL_STORE_HAS_TEMPERATURE if it has a sensor,
+	// CELL_STORE_FRESH if the reading is from this sweep
+	unsigned char *flags;
+};
+
+/* Statistics of the valid cells, min is 0xffff and everything else 0 if there are none */
+struct cellStore_stats_t {
+	unsigned short minVoltage;
+	unsigned short minVoltageCell;
+	unsigned short maxVoltage;
+	unsigned short maxVoltageCell;
+	unsigned long totalVoltage;
+	unsigned short validCount;
+	unsigned short maxTemperature;
+	unsigned short maxTemperatureCell;
+};
+
+/** @return 0 on success */
+int cellStore_init(struct cellStore_t *store, unsigned short cellCount);
+void cellStore_free(struct cellStore_t *store);
+
+void cellStore_update(struct cellStore_t *store, unsigned short cellIndex, unsigned short voltage,
+		unsigned short shuntCurrent, unsigned short temperature, unsigned char hasTemperature);
+/** Clear flags of a cell, eg CELL_STORE_FRESH when the voltage we were given wasn't read this time */
+void cellStore_clearFlags(struct cellStore_t *store, unsigned short cellIndex, unsigned char flags);
+/** Start a sweep, no reading is fresh until it is updated */
+void cellStore_beginSweep(struct cellStore_t *store);
+
+/** Min, max and where they are, total and count of the valid cells in one pass, ties go to the lowest cell */
+void cellStore_getStats(const struct cellStore_t *store, struct cellStore_stats_t *stats);
+
+#endif /* TUMANAKO_CELL_STORE_H_ */
@@ -0,0 +1,212 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the pack statistics from one pass over the cell store with a scan over struct status_t per statistic, the
+ * way monitor.c used to work them out.
+ *
+ * cellbench [cells [iterations]]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "monitor.h"
+#include "cellStore.h"
+
+static struct battery_t battery;
+static struct cellStore_t store;
+
+static unsigned short scanMinVoltage() {
+	unsigned short result = 0xffff;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		if (battery.cells[i].isDataCurrent && battery.cells[i].vCell < result) {
+			result = battery.cells[i].vCell;
+		}
+	}
+	return result;
+}
+
+static unsigned short scanMinVoltageCell() {
+	unsigned short min = 0xffff;
+	unsigned short result = 0;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		if (battery.cells[i].isDataCurrent && battery.cells[i].vCell < min) {
+			min = battery.cells[i].vCell;
+			result = i;
+		}
+	}
+	return result;
+}
+
+static unsigned short scanMaxVoltage() {
+	unsigned short result = 0;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		if (battery.cells[i].isDataCurrent && battery.cells[i].vCell > result) {
+			result = battery.cells[i].vCell;
+		}
+	}
+	return result;
+}
+
+static unsigned short scanMaxVoltageCell() {
+	unsigned short max = 0;
+	unsigned short result = 0;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		if (battery.cells[i].isDataCurrent && battery.cells[i].vCell > max) {
+			max = battery.cells[i].vCell;
+			result = i;
+		}
+	}
+	return result;
+}
+
+static unsigned long scanTotalVoltage() {
+	unsigned long result = 0;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		if (battery.cells[i].isDataCurrent) {
+			result += battery.cells[i].vCell;
+		}
+	}
+	return result;
+}
+
+static unsigned short scanValidCount() {
+	unsigned short result = 0;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		result += battery.cells[i].isDataCurrent ? 1 : 0;
+	}
+	return result;
+}
+
+static unsigned short scanMaxTemperature() {
+	unsigned short result = 0;
+	for (unsigned short i = 0; i < battery.cellCount; i++) {
+		struct status_t *cell = battery.cells + i;
+		if (cell->isDataCurrent && cell->hasTemperatureSensor && cell->temperature > result) {
+			result = cell->temperature;
+		}
+	}
+	return result;
+}
+
+static void scanStats(struct cellStore_stats_t *stats) {
+	stats->minVoltage = scanMinVoltage();
+	stats->minVoltageCell = scanMinVoltageCell();
+	stats->maxVoltage = scanMaxVoltage();
+	stats->maxVoltageCell = scanMaxVoltageCell();
+	stats->totalVoltage = scanTotalVoltage();
+	stats->validCount = scanValidCount();
+	stats->maxTemperature = scanMaxTemperature();
+}
+
+static void randomise(unsigned short cellCount, unsigned short range) {
+	for (unsigned short i = 0; i < cellCount; i++) {
+		struct status_t *cell = battery.cells + i;
+		// a small range gives lots of ties
+		cell->vCell = 3000 + rand() % range;
+		cell->temperature = 2000 + rand() % range;
+		cell->hasTemperatureSensor = rand() % 4 != 0;
+		cell->isDataCurrent = rand() % 20 != 0;
+		if (cell->isDataCurrent) {
+			cellStore_update(&store, i, cell->vCell, cell->iShunt, cell->temperature, cell->hasTemperatureSensor);
+		} else {
+			cellStore_update(&store, i, rand(), 0, rand(), 1);
+			cellStore_clearFlags(&store, i, CELL_STORE_VALID);
+		}
+	}
+}
+
+static int check(unsigned short cellCount) {
+	for (int round = 0; round < 1000; round++) {
+		unsigned short count = 1 + rand() % cellCount;
+		battery.cellCount = count;
+		store.cellCount = count;
+		store.paddedCount = (count + CELL_STORE_LANES - 1) / CELL_STORE_LANES * CELL_STORE_LANES;
+		memset(store.flags, 0, cellCount);
+		randomise(count, round % 2 ? 5 : 1000);
+		struct cellStore_stats_t expected;
+		struct cellStore_stats_t actual;
+		scanStats(&expected);
+		cellStore_getStats(&store, &actual);
+		if (expected.minVoltage != actual.minVoltage || expected.minVoltageCell != actual.minVoltageCell
+				|| expected.maxVoltage != actual.maxVoltage || expected.maxVoltageCell != actual.maxVoltageCell
+				|| expected.totalVoltage != actual.totalVoltage || expected.validCount != actual.validCount
+				|| expected.maxTemperature != actual.maxTemperature) {
+			fprintf(stderr, "%d cells: expected %hu@%hu %hu@%hu %lu %hu %hu got %hu@%hu %hu@%hu %lu %hu %hu\n", count,
+					expected.minVoltage, expected.minVoltageCell, expected.maxVoltage, expected.maxVoltageCell,
+					expected.totalVoltage, expected.validCount, expected.maxTemperature, actual.minVoltage,
+					actual.minVoltageCell, actual.maxVoltage, actual.maxVoltageCell, actual.totalVoltage,
+					actual.validCount, actual.maxTemperature);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double nanosecondsSince(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned short cellCount = argc > 1 ? atoi(argv[1]) : MAX_CELLS;
+	long iterations = argc > 2 ? atol(argv[2]) : 100000;
+	battery.cells = calloc(cellCount, sizeof(struct status_t));
+	if (!battery.cells || cellStore_init(&store, cellCount)) {
+		return 1;
+	}
+	srand(1);
+	if (check(cellCount)) {
+		return 1;
+	}
+	printf("one pass matches the separate scans\n");
+
+	battery.cellCount = cellCount;
+	store.cellCount = cellCount;
+	store.paddedCount = (cellCount + CELL_STORE_LANES - 1) / CELL_STORE_LANES * CELL_STORE_LANES;
+	randomise(cellCount, 1000);
+	struct cellStore_stats_t stats;
+	unsigned long total = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		scanStats(&stats);
+		total += stats.minVoltageCell;
+	}
+	double scanTime = nanosecondsSince(&start) / iterations;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		cellStore_getStats(&store, &stats);
+		total += stats.minVoltageCell;
+	}
+	double storeTime = nanosecondsSince(&start) / iterations;
+
+	printf("%d cells: separate scans %.0fns, one pass %.0fns, %.1fx (%lu)\n", cellCount, scanTime, storeTime,
+			scanTime / storeTime, total);
+	return 0;
+}
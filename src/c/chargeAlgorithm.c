@@ -19,13 +19,19 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include <pthread.h>
+
 #include "soc.h"
 #include "canEventListener.h"
 #include "monitor_can.h"
 #include "chargercontrol.h"
 #include "chargeAlgorithm.h"
+#include "trace.h"
+#include "packAggregates.h"
+#include "monitorStats.h"
 
 #define CHARGER_ON_VOLTAGE 3450
 #define CHARGER_OFF_VOLTAGE 3650
@@ -49,32 +55,42 @@ static char chargerState = 0;
 static chargerStateChangeReason_t chargerStateChangeReason = UNDEFINED;
 static unsigned short validCount;
 static unsigned short invalidCount;
+static unsigned short failedCount;
 static char errorLastTime = 0;
 
-#define CHARGER_CONTROL_BATTERY_INDEX 1
+/*
+ * Charge control runs on the CAN thread when a sweep completes and the over voltage trip on the monitor thread, this
+ * stops one turning the charger back on under the other and keeps them off the relay at the same time
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void doChargerControl() {
+	// every decision this pass is made on the same SOC values
+	struct soc_snapshot_t soc;
+	soc_getSnapshot(&soc);
+	double current = soc.current;
 	// do error checking stuff
 	if (soc_getError()) {
-		fprintf(stderr, "State of Charge error?");
+		TRACE_ERROR(TRACE_CHARGER, "State of Charge error?");
 		chargerShutdown = TRUE;
 		chargerStateChangeReason = SOC_ERROR;
 	}
 	if (config->maxBootTemperature) {
-		printf("boo");
+		TRACE_DEBUG(TRACE_CHARGER, "boo");
 	}
-	if (soc_getT1() > config->maxBootTemperature || soc_getT2() > config->maxBootTemperature) {
+	if (soc.t1 > config->maxBootTemperature || soc.t2 > config->maxBootTemperature) {
 		chargerShutdown = TRUE;
 		chargerStateChangeReason = OVER_BOOT_TEMPERATURE;
 	}
 	if (maxShuntTemperature / 1000 > config->maxCellTemperature) {
-		printf("max temp %d %d\n", maxShuntTemperature, config->maxCellTemperature);
+		TRACE_WARN(TRACE_CHARGER, "max temp %d %d", maxShuntTemperature, config->maxCellTemperature);
 		chargerShutdown = TRUE;
 		chargerStateChangeReason = OVER_SHUNT_TEMPERATURE;
 	}
 	unsigned short expectedCount = config->batteries[CHARGER_CONTROL_BATTERY_INDEX].cellCount;
-	if (validCount + invalidCount != expectedCount) {
-		fprintf(stderr, "got %d + %d = %d expected %d\n", validCount, invalidCount, validCount + invalidCount, config->batteries[2].cellCount);
+	if (failedCount != 0 || validCount + invalidCount != expectedCount) {
+		TRACE_WARN(TRACE_CHARGER, "got %d + %d = %d expected %d, %d failed", validCount, invalidCount, validCount + invalidCount,
+				expectedCount, failedCount);
 		if (errorLastTime) {
 			chargerShutdown = TRUE;
 			chargerStateChangeReason = CONSECUTIVE_ERRORS;
@@ -86,10 +102,10 @@ static void doChargerControl() {
 	}
 	time_t now;
 	time(&now);
-	if (validCount == expectedCount) {
+	if (failedCount == 0 && validCount == expectedCount) {
 		whenLastValid = now;
 	} else if (now - whenLastValid > 150) {
-		fprintf(stderr, "no valid data for %ld seconds", now - whenLastValid);
+		TRACE_ERROR(TRACE_CHARGER, "no valid data for %ld seconds", now - whenLastValid);
 		chargerShutdown = TRUE;
 		chargerStateChangeReason = DATA_TIMEOUT;
 	}
@@ -109,16 +125,16 @@ static void doChargerControl() {
 			chargerState = 0;
 			chargerStateChangeReason = OVER_VOLTAGE;
 			whenTurnedOff = now;
-		} else if (invalidCount == 0 && minVoltage > END_OF_CHARGE_VOLTAGE && soc_getCurrent() > -4) {
+		} else if (invalidCount == 0 && minVoltage > END_OF_CHARGE_VOLTAGE && current > -4) {
 			// charging is finished
 			chargercontrol_setCharger(FALSE);
 			chargerState = 0;
 			chargerStateChangeReason = END_OF_CHARGE;
 			chargerShutdown = TRUE;
 		} else if (
-				(soc_getCurrent() > -3 && maxVoltage > 3500) ||
-				(soc_getCurrent() > -2 && maxVoltage > 3450) ||
-				(soc_getCurrent() > -1 && maxVoltage > 3400)
+				(current > -3 && maxVoltage > 3500) ||
+				(current > -2 && maxVoltage > 3450) ||
+				(current > -1 && maxVoltage > 3400)
 				) {
 			// charging current is too low
 			// did we just just turn it on?
@@ -132,7 +148,7 @@ static void doChargerControl() {
 	} else {
 		// charger is off, find a reason to turn it on
 		chargercontrol_setCharger(FALSE);
-		fprintf(stderr, "shunt delay %ld %ld %d %ld\n",whenTurnedOff, now, whenTurnedOff + 10 * 60 > now, whenTurnedOff + 10 * 60 - now);
+		TRACE_DEBUG(TRACE_CHARGER, "shunt delay %ld %ld %d %ld", whenTurnedOff, now, whenTurnedOff + 10 * 60 > now, whenTurnedOff + 10 * 60 - now);
 		if (whenTurnedOff == 0) {
 			shuntingDelay = 0;
 		} else if (whenTurnedOff + 30 * 60 > now) {
@@ -167,61 +183,74 @@ static void doChargerControl() {
 		}
 	}
 
-	fprintf(stderr, "chargerState %d %d %s %d\n", chargerShutdown, chargerState,
+	TRACE_INFO(TRACE_CHARGER, "chargerState %d %d %s %d", chargerShutdown, chargerState,
 			chargeAlgorithm_getStateChangeReasonString(chargerStateChangeReason), shuntingDelay);
 	monitorCan_sendChargerState(chargerShutdown, chargerState, chargerStateChangeReason, shuntingDelay);
 }
 
-static void voltageListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned char isValid, unsigned short voltage) {
-	fprintf(stderr, "charger voltageListener %d %d %d %d\n", batteryIndex, cellIndex, isValid, voltage);
-	// we only control the charger in one battery
+static void sweepListener(unsigned char batteryIndex, const struct packAggregates_t *aggregates) {
 	if (batteryIndex != CHARGER_CONTROL_BATTERY_INDEX) {
 		return;
 	}
-	if (!isValid) {
-		invalidCount++;
-	} else {
-		validCount++;
-		if (voltage > maxVoltage) {
-			maxVoltage = voltage;
-		}
-		if (voltage < minVoltage) {
-			minVoltage = voltage;
+	maxVoltage = aggregates->maxVoltage;
+	minVoltage = aggregates->minVoltage;
+	// validCount and invalidCount are each cell's last known state, a cell that has gone quiet has to count as missing
+	validCount = aggregates->answeringValidCount;
+	invalidCount = aggregates->answeringCount - aggregates->answeringValidCount;
+	failedCount = aggregates->failedCount;
+	// any hot shunt stops the charger, not just those in the battery we control
+	maxShuntTemperature = 0;
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		struct packAggregates_t battery;
+		packAggregates_get(i, &battery);
+		if (battery.maxTemperature > maxShuntTemperature) {
+			maxShuntTemperature = battery.maxTemperature;
 		}
 	}
-	if (cellIndex == config->batteries[CHARGER_CONTROL_BATTERY_INDEX].cellCount - 1) {
-		fprintf(stderr, "doing charge control %d %d\n", minVoltage, maxVoltage);
-		doChargerControl();
-		maxVoltage = 0;
-		minVoltage = 0xffff;
-		validCount = 0;
-		invalidCount = 0;
+	TRACE_DEBUG(TRACE_CHARGER, "doing charge control %d %d", minVoltage, maxVoltage);
+	pthread_mutex_lock(&mutex);
+	doChargerControl();
+	pthread_mutex_unlock(&mutex);
+}
+
+void chargeAlgorithm_checkCellVoltage(unsigned char batteryIndex, unsigned short cellIndex, unsigned short voltage,
+		long long detected) {
+	if (batteryIndex != CHARGER_CONTROL_BATTERY_INDEX || voltage <= CHARGER_OFF_VOLTAGE) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	if (chargerState != 1) {
+		pthread_mutex_unlock(&mutex);
+		return;
 	}
+	chargercontrol_setCharger(FALSE);
+	long long latency = monitorStats_now() - detected;
+	chargerState = 0;
+	chargerStateChangeReason = OVER_VOLTAGE;
+	time(&whenTurnedOff);
+	pthread_mutex_unlock(&mutex);
+	monitorStats_recordTrip(latency);
+	TRACE_WARN(TRACE_CHARGER, "over voltage trip on cell %d at %dmV, relay open in %lldus", cellIndex, voltage, latency);
+	monitorCan_sendChargerState(chargerShutdown, chargerState, chargerStateChangeReason, 0);
 }
 
 static void minCurrentListener(unsigned char batteryIndex, unsigned short cellIndex,
 		unsigned short minCurrent) {
 	if (minCurrent > 0) {
-		// have to avoid compile error by accessing BatteryIndex and CellIndex, is there a bettery way?
-		fprintf(stderr, "minCurrent %d %d", batteryIndex, cellIndex);
+		TRACE_DEBUG(TRACE_CHARGER, "minCurrent %d %d", batteryIndex, cellIndex);
 		time(&whenLastShunting);
 	}
 }
 
-static void temperatureListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short temperature) {
-	if (temperature > maxShuntTemperature) {
-		fprintf(stderr, "max temperature at %d %d: %d", batteryIndex, cellIndex, temperature);
-		maxShuntTemperature = temperature;
-	}
-}
-
 void chargeAlgorithm_init(struct config_t *_config) {
 	config = _config;
 	if (config->loopDelay > 20) {
 		chargerShutdown = 1;
 	} else {
-		canEventListener_registerVoltageListener(voltageListener);
-		canEventListener_registerTemperatureListener(temperatureListener);
+		if (packAggregates_registerSweepListener(sweepListener)) {
+			chargerShutdown = 1;
+			return;
+		}
 		canEventListener_registerMinCurrentListener(minCurrentListener);
 		time(&whenLastValid);
 	}
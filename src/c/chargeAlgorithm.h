@@ -41,8 +41,20 @@ typedef enum {
 
 } chargerStateChangeReason_t;
 
+// the battery the charger is connected to
+#define CHARGER_CONTROL_BATTERY_INDEX 1
+
 void chargeAlgorithm_init(struct config_t *_config);
 
+/**
+ * Fast path for over voltage, called by the poller as soon as each cell voltage is decoded rather than waiting for
+ * the sweep to come back over CAN. If the charger is on and the cell is over the limit the relay is opened there and
+ * then. detected is when the voltage was decoded from monitorStats_now(), the time to open the relay is recorded in
+ * the monitor stats.
+ */
+void chargeAlgorithm_checkCellVoltage(unsigned char batteryIndex, unsigned short cellIndex, unsigned short voltage,
+		long long detected);
+
 __u8 chargeAlgorithm_isChargerOn();
 
 const char *chargeAlgorithm_getStateChangeReasonString(chargerStateChangeReason_t reason);
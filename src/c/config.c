@@ -38,12 +38,39 @@ struct config_t *getConfig() {
 	};
 	cfg_opt_t opts[] = {
 			CFG_STR("serialPort", NULL, CFGF_NONE),
+			CFG_STR("canInterface", "slcan0", CFGF_NONE),
 			CFG_INT("loopDelay", 10, CFGF_NONE),
 			CFG_INT("minVoltageSocRelevant", 3400, CFGF_NONE),
 			CFG_INT("voltageDeadband", 25, CFGF_NONE),
 			CFG_INT("minShuntCurrent", 0, CFGF_NONE),
 			CFG_INT("maxBootTemperature", 0, CFGF_NONE),
 			CFG_INT("maxCellTemperature", 0, CFGF_NONE),
+			CFG_INT("publishVoltageDeadband", 0, CFGF_NONE),
+			CFG_INT("publishCurrentDeadband", 0, CFGF_NONE),
+			CFG_INT("publishTemperatureDeadband", 0, CFGF_NONE),
+			CFG_INT("publishResistanceDeadband", 10, CFGF_NONE),
+			CFG_INT("publishRefreshInterval", 30, CFGF_NONE),
+			CFG_STR("logFormat", "text", CFGF_NONE),
+			CFG_INT("logCommitInterval", 1000, CFGF_NONE),
+			CFG_INT("logSyncInterval", 60, CFGF_NONE),
+			CFG_INT("logSegmentSize", 16, CFGF_NONE),
+			CFG_INT("hiResPreTrigger", 5, CFGF_NONE),
+			CFG_INT("hiResPostTrigger", 5, CFGF_NONE),
+			CFG_INT("hiResCurrentStep", 0, CFGF_NONE),
+			CFG_INT("hiResVoltageSag", 0, CFGF_NONE),
+			CFG_INT("hiResTriggerInterval", 200, CFGF_NONE),
+			CFG_INT("consoleRefreshInterval", 100, CFGF_NONE),
+			CFG_STR("trace", NULL, CFGF_NONE),
+			CFG_STR("traceFile", NULL, CFGF_NONE),
+			CFG_STR("statsSocket", "stats.sock", CFGF_NONE),
+			CFG_STR("timingTraceFile", NULL, CFGF_NONE),
+			CFG_STR("snapshotName", "/tumanako-bms", CFGF_NONE),
+			CFG_STR("socSource", "evision", CFGF_NONE),
+			CFG_STR("socReplayFile", NULL, CFGF_NONE),
+			CFG_INT("socReplaySpeed", 1, CFGF_NONE),
+			CFG_STR("socSyntheticProfile", "drive", CFGF_NONE),
+			CFG_INT("cellCapacity", 100, CFGF_NONE),
+			CFG_INT("cellResistance", 1000, CFGF_NONE),
 			CFG_SEC("battery", battery_opts, CFGF_TITLE | CFGF_MULTI),
 			CFG_END()
 	};
@@ -61,14 +88,48 @@ struct config_t *getConfig() {
 		return NULL;
 	}
 
+	long publishRefreshInterval = cfg_getint(cfg, "publishRefreshInterval");
+	if (publishRefreshInterval < 1 || publishRefreshInterval > MAX_PUBLISH_REFRESH_INTERVAL) {
+		fprintf(stderr, "publishRefreshInterval is %ld, it must be between 1 and %d seconds\n", publishRefreshInterval,
+				MAX_PUBLISH_REFRESH_INTERVAL);
+		return NULL;
+	}
+
 	struct config_t *result = malloc(sizeof(struct config_t));
 	result->serialPort = cfg_getstr(cfg, "serialPort");
+	result->canInterface = cfg_getstr(cfg, "canInterface");
 	result->loopDelay = cfg_getint(cfg, "loopDelay");
 	result->minVoltageSocRelevant = cfg_getint(cfg, "minVoltageSocRelevant");
 	result->voltageDeadband = cfg_getint(cfg, "voltageDeadband");
 	result->minShuntCurrent = cfg_getint(cfg, "minShuntCurrent");
 	result->maxBootTemperature = cfg_getint(cfg, "maxBootTemperature");
 	result->maxCellTemperature = cfg_getint(cfg, "maxCellTemperature");
+	result->publishVoltageDeadband = cfg_getint(cfg, "publishVoltageDeadband");
+	result->publishCurrentDeadband = cfg_getint(cfg, "publishCurrentDeadband");
+	result->publishTemperatureDeadband = cfg_getint(cfg, "publishTemperatureDeadband");
+	result->publishResistanceDeadband = cfg_getint(cfg, "publishResistanceDeadband");
+	result->publishRefreshInterval = publishRefreshInterval;
+	result->logFormat = cfg_getstr(cfg, "logFormat");
+	result->logCommitInterval = cfg_getint(cfg, "logCommitInterval");
+	result->logSyncInterval = cfg_getint(cfg, "logSyncInterval");
+	result->logSegmentSize = cfg_getint(cfg, "logSegmentSize");
+	result->hiResPreTrigger = cfg_getint(cfg, "hiResPreTrigger");
+	result->hiResPostTrigger = cfg_getint(cfg, "hiResPostTrigger");
+	result->hiResCurrentStep = cfg_getint(cfg, "hiResCurrentStep");
+	result->hiResVoltageSag = cfg_getint(cfg, "hiResVoltageSag");
+	result->hiResTriggerInterval = cfg_getint(cfg, "hiResTriggerInterval");
+	result->consoleRefreshInterval = cfg_getint(cfg, "consoleRefreshInterval");
+	result->trace = cfg_getstr(cfg, "trace");
+	result->traceFile = cfg_getstr(cfg, "traceFile");
+	result->statsSocket = cfg_getstr(cfg, "statsSocket");
+	result->timingTraceFile = cfg_getstr(cfg, "timingTraceFile");
+	result->snapshotName = cfg_getstr(cfg, "snapshotName");
+	result->socSource = cfg_getstr(cfg, "socSource");
+	result->socReplayFile = cfg_getstr(cfg, "socReplayFile");
+	result->socReplaySpeed = cfg_getint(cfg, "socReplaySpeed");
+	result->socSyntheticProfile = cfg_getstr(cfg, "socSyntheticProfile");
+	result->cellCapacity = cfg_getint(cfg, "cellCapacity");
+	result->cellResistance = cfg_getint(cfg, "cellResistance");
 	result->batteryCount = cfg_size(cfg, "battery");
 	result->batteries = malloc(sizeof(struct config_battery_t) * result->batteryCount);
 	for (unsigned int i = 0; i < cfg_size(cfg, "battery"); i++) {
@@ -24,6 +24,11 @@
 #define MAX_BATTERIES 10
 #define MAX_CELLS 1024
 #define MAX_CELL_ID 0xffff
+/*
+ * A cell that stops answering is only counted as silent once a refresh is overdue, which has to happen before the
+ * charge algorithm's 120s shunting timeout and so before its 150s data timeout
+ */
+#define MAX_PUBLISH_REFRESH_INTERVAL 119
 
 struct config_battery_t {
 	const char *name;
@@ -33,12 +38,56 @@ struct config_battery_t {
 
 struct config_t {
 	const char *serialPort;
+	// CAN network interface, an slcan adapter is attached automatically if the name starts with slcan
+	const char *canInterface;
 	unsigned short loopDelay;
 	unsigned short minVoltageSocRelevant;
 	unsigned short voltageDeadband;
 	unsigned short minShuntCurrent;
 	unsigned short maxBootTemperature;
 	unsigned short maxCellTemperature;
+	// cell values are only sent on CAN if they change by more than this (mV, mA and 0.01 degrees)
+	unsigned short publishVoltageDeadband;
+	unsigned short publishCurrentDeadband;
+	unsigned short publishTemperatureDeadband;
+	// micro ohms
+	unsigned short publishResistanceDeadband;
+	// seconds after which an unchanged value is sent anyway, 1 to MAX_PUBLISH_REFRESH_INTERVAL
+	unsigned short publishRefreshInterval;
+	// "text" (the default) or "binary", see binaryLog.h
+	const char *logFormat;
+	// ms between writes of the buffered log, seconds between fdatasync of the log files (0 never)
+	unsigned short logCommitInterval;
+	unsigned short logSyncInterval;
+	// MB after which the binary log starts a new segment
+	unsigned short logSegmentSize;
+	// seconds of hiResLogger samples written from before a capture starts and after the last trigger
+	unsigned short hiResPreTrigger;
+	unsigned short hiResPostTrigger;
+	// hiResLogger captures when the current changes by hiResCurrentStep A or the voltage drops by hiResVoltageSag V
+	// within hiResTriggerInterval ms, 0 disables
+	unsigned short hiResCurrentStep;
+	unsigned short hiResVoltageSag;
+	unsigned short hiResTriggerInterval;
+	// ms between console refreshes
+	unsigned short consoleRefreshInterval;
+	// trace levels, eg "logger=debug,charger=info", and where to write them, stderr if not set, see trace.h
+	const char *trace;
+	const char *traceFile;
+	// unix socket serving the monitor loop timing report, Chrome trace of each phase and transaction, see monitorStats.h
+	const char *statsSocket;
+	const char *timingTraceFile;
+	// POSIX shared memory segment the pack state is published in, see snapshot.h
+	const char *snapshotName;
+	// where SOC readings come from, "evision", "replay" or "synthetic", see socSource.h
+	const char *socSource;
+	const char *socReplayFile;
+	unsigned short socReplaySpeed;
+	const char *socSyntheticProfile;
+	// rated capacity of a cell (Ah) and its internal resistance (micro ohms) to start the SOC estimates from, see
+	// cellSoc.h
+	unsigned short cellCapacity;
+	unsigned short cellResistance;
 	unsigned char batteryCount;
 	struct config_battery_t *batteries;
 };
@@ -17,15 +17,19 @@
  along with the Tumanako EVD5 BMS.  If not, see
  <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
+
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
 #include <libgen.h>
 #include <time.h>
+#include <errno.h>
 
 #include <pthread.h>
 
@@ -36,63 +40,115 @@
 #include "console.h"
 #include "chargeAlgorithm.h"
 #include "monitor.h"
+#include "trace.h"
+#include "packAggregates.h"
 
-static unsigned short maxVoltage = 0;
-static unsigned short maxVoltageCell;
-static unsigned short minVoltage = 0xffff;
-static unsigned short minVoltageCell;
-static unsigned long totalVoltage = 0;
-static unsigned long totalVoltageCount = 0;
-
-static unsigned short *lastMaxVoltage;
-static unsigned short *lastMinVoltage;
+// wide enough for the second column of cells and the status line
+#define SCREEN_WIDTH 192
+// unchanged characters between two changes that are rewritten rather than moving the cursor
+#define MAX_GAP 8
+// the charger and monitor state go on the summary line of the third battery
+#define STATUS_BATTERY 2
 
 static struct config_t *config;
+// protects the screen model and dirtyRows
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * The listeners draw into screen and mark the rows they touch. The render thread copies the dirty rows into frame,
+ * compares them with shown, what the terminal has on it, and writes the differences with one write().
+ */
+static char *screen;
+static char *frame;
+static char *shown;
+static unsigned char *dirtyRows;
+static unsigned char *frameRows;
+static unsigned short screenHeight;
+static char *output;
+static pthread_t renderThread;
+
+// row of the first cell of each battery, counted from 1 like the terminal
+static unsigned short *firstRows;
+
 static double asDouble(int s) {
 	return ((double) s) / 1000;
 }
 
-void moveCursor(unsigned char x, unsigned char y) {
-	char buf[20];
-	sprintf(buf, "\E[%d;%df", y, x);
-	write(1, buf, strlen(buf));
+static unsigned short getLineCount(unsigned char batteryIndex) {
+	if (batteryIndex >= config->batteryCount) {
+		return 0;
+	}
+	unsigned short cellCount = config->batteries[batteryIndex].cellCount;
+	return cellCount / 2 + cellCount % 2;
 }
 
-void moveToCell(struct config_t *config, unsigned char batteryIndex, unsigned short cellIndex, unsigned char offset) {
-	unsigned char x;
-	unsigned char y;
-	if (cellIndex >= config->batteries[batteryIndex].cellCount / 2) {
-		x = 84;
-		y = cellIndex - config->batteries[batteryIndex].cellCount / 2;
-	} else {
+/** @return the row below the cells of the battery, batteries we don't have count as having no cells */
+static unsigned short getSummaryRow(unsigned char batteryIndex) {
+	unsigned short row = 0;
+	for (int i = 0; i < batteryIndex + 1; i++) {
+		row += getLineCount(i) + 1;
+	}
+	return row;
+}
+
+/** Put text on the screen model at column x and row y, both counted from 1 like the terminal */
+static void draw(unsigned short x, unsigned short y, const char *text, size_t length) {
+	if (x < 1) {
+		// the terminal treats column 0 as 1
 		x = 1;
-		y = cellIndex;
 	}
-	unsigned char batteryOffset = 1;
-	for (int i = 0; i < batteryIndex; i++) {
-		unsigned short cellCount = config->batteries[i].cellCount;
-		unsigned char lines = cellCount / 2;
-		if (cellCount % 2) {
-			lines++;
-		}
-		batteryOffset += lines + 1;
+	if (y < 1 || y > screenHeight || x > SCREEN_WIDTH) {
+		return;
+	}
+	if (length > (size_t) (SCREEN_WIDTH - x + 1)) {
+		length = SCREEN_WIDTH - x + 1;
 	}
-	moveCursor(x + offset, batteryOffset + y);
+	memcpy(screen + (y - 1) * SCREEN_WIDTH + x - 1, text, length);
+	dirtyRows[y - 1] = 1;
 }
 
-void moveToSummary(struct config_t *config, unsigned char batteryIndex, unsigned char xOffset) {
-	unsigned char batteryOffset = 0;
-	for (int i = 0; i < batteryIndex + 1; i++) {
-		unsigned short cellCount = config->batteries[i].cellCount;
-		unsigned char lines = cellCount / 2;
-		if (cellCount % 2) {
-			lines++;
-		}
-		batteryOffset += lines + 1;
+static void drawCell(unsigned char batteryIndex, unsigned short cellIndex, unsigned char offset, const char *text,
+		size_t length) {
+	unsigned short half = config->batteries[batteryIndex].cellCount / 2;
+	if (cellIndex >= half) {
+		draw(84 + offset, firstRows[batteryIndex] + cellIndex - half, text, length);
+	} else {
+		draw(1 + offset, firstRows[batteryIndex] + cellIndex, text, length);
 	}
-	moveCursor(xOffset, batteryOffset);
+}
+
+static void drawCellf(unsigned char batteryIndex, unsigned short cellIndex, unsigned char offset,
+		const char *format, ...) {
+	char buf[SCREEN_WIDTH + 1];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	drawCell(batteryIndex, cellIndex, offset, buf, length < (int) sizeof(buf) ? length : (int) sizeof(buf) - 1);
+}
+
+static void drawSummaryf(unsigned char batteryIndex, unsigned char x, const char *format, ...) {
+	char buf[SCREEN_WIDTH + 1];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	draw(x, getSummaryRow(batteryIndex), buf, length < (int) sizeof(buf) ? length : (int) sizeof(buf) - 1);
+}
+
+/** Draw label and value / 10^scale followed by a space, as printf("<label>%*.*f ") would */
+static void drawFixed(unsigned char batteryIndex, unsigned short cellIndex, unsigned char offset, const char *label,
+		long long value, unsigned char scale, unsigned char decimals, unsigned char width) {
+	char buf[64];
+	size_t length = strlen(label);
+	memcpy(buf, label, length);
+	length += formatFixed(buf + length, value, scale, decimals, width);
+	buf[length++] = ' ';
+	drawCell(batteryIndex, cellIndex, offset, buf, length);
+}
+
+static void drawCellIndex(unsigned char batteryIndex, unsigned short cellIndex) {
+	drawFixed(batteryIndex, cellIndex, 0, "", cellIndex, 0, 0, 3);
 }
 
 static void voltageListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned char isValid, unsigned short voltage) {
@@ -100,41 +156,14 @@ static void voltageListener(unsigned char batteryIndex, unsigned short cellIndex
 		return;
 	}
 	pthread_mutex_lock(&mutex);
-	struct config_battery_t *battery = config->batteries + batteryIndex;
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3d ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 4);
-	fprintf(stdout, "Vc=%.3f ", milliToDouble(voltage));
-	fflush(stdout);
-	if (voltage > maxVoltage) {
-		maxVoltage = voltage;
-		maxVoltageCell = cellIndex;
-	}
-	if (voltage < minVoltage) {
-		minVoltage = voltage;
-		minVoltageCell = cellIndex;
-	}
-	totalVoltageCount++;
-	totalVoltage += voltage;
-	if (cellIndex == config->batteries[batteryIndex].cellCount - 1) {
-		if (totalVoltageCount == battery->cellCount) {
-			moveToSummary(config, batteryIndex, 0);
-			printf("%20s %.3f@%02d %.3f %.3f@%02d %7.3fV", battery->name,
-					asDouble(minVoltage), minVoltageCell, asDouble(totalVoltage / battery->cellCount),
-					asDouble(maxVoltage), maxVoltageCell, asDouble(totalVoltage));
-			fflush(stdout);
-		}
-		lastMinVoltage[batteryIndex] = minVoltage;
-		lastMaxVoltage[batteryIndex] = maxVoltage;
-		minVoltage = 0xffff;
-		maxVoltage = 0;
-		totalVoltage = 0;
-		totalVoltageCount = 0;
-	}
+	drawCellIndex(batteryIndex, cellIndex);
+	drawFixed(batteryIndex, cellIndex, 4, "Vc=", voltage, 3, 3, 0);
 
-	unsigned short minVoltageHundreds = lastMinVoltage[batteryIndex] / 100 * 100;
-	unsigned short maxVoltageHundreds = lastMaxVoltage[batteryIndex] / 100 * 100;
+	// the bar is scaled to the last sweep
+	struct packAggregates_t aggregates;
+	packAggregates_get(batteryIndex, &aggregates);
+	unsigned short minVoltageHundreds = aggregates.minVoltage / 100 * 100;
+	unsigned short maxVoltageHundreds = aggregates.maxVoltage / 100 * 100;
 	unsigned short barMin = minVoltageHundreds;
 	unsigned char tens;
 	unsigned char hundreds;
@@ -149,111 +178,84 @@ static void voltageListener(unsigned char batteryIndex, unsigned short cellIndex
 		hundreds = 2;
 		tens = 9;
 	}
-	fprintf(stderr, "%d %d %d %d %d %d\n", voltage, maxVoltage, maxVoltageHundreds, barMin, tens, hundreds);
-	moveToCell(config, batteryIndex, cellIndex, 54);
+	TRACE_DEBUG(TRACE_CONSOLE, "bar %d %d %d %d %d %d", voltage, aggregates.maxVoltage, maxVoltageHundreds, barMin, tens, hundreds);
+	// ten characters for each hundred mV above the minimum, alternating # and *, then one - per ten mV
+	char bar[30];
+	memset(bar, ' ', sizeof(bar));
 	for (int i = 0; i < hundreds; i++) {
-		if (i % 2) {
-			fprintf(stdout, "**********");
-		} else {
-			fprintf(stdout, "##########");
-		}
-	}
-	for (int i = 0; i < 10; i++) {
-		if (i < tens) {
-			fprintf(stdout, "-");
-		} else {
-			fprintf(stdout, " ");
-		}
+		memset(bar + i * 10, i % 2 ? '*' : '#', 10);
 	}
-	if (hundreds < 2) {
-		printf("          ");
-	}
-	if (hundreds < 1) {
-		printf("          ");
+	memset(bar + hundreds * 10, '-', tens);
+	drawCell(batteryIndex, cellIndex, 54, bar, sizeof(bar));
+	pthread_mutex_unlock(&mutex);
+}
+
+static void sweepListener(unsigned char batteryIndex, const struct packAggregates_t *aggregates) {
+	pthread_mutex_lock(&mutex);
+	struct config_battery_t *battery = config->batteries + batteryIndex;
+	if (aggregates->failedCount == 0 && aggregates->readingCount == battery->cellCount) {
+		drawSummaryf(batteryIndex, 0, "%20s %.3f@%02d %.3f %.3f@%02d %7.3fV %4hu/%4hu", battery->name,
+				asDouble(aggregates->minVoltage), aggregates->minVoltageCell,
+				asDouble(aggregates->totalVoltage / battery->cellCount), asDouble(aggregates->maxVoltage),
+				aggregates->maxVoltageCell, asDouble(aggregates->totalVoltage), aggregates->sentCount,
+				aggregates->suppressedCount);
 	}
-	fflush(stdout);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void shuntCurrentListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short shuntCurrent) {
 	pthread_mutex_lock(&mutex);
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3d ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 13);
-	printf("Is=%.3f ", milliToDouble(shuntCurrent));
-	fflush(stdout);
+	drawCellIndex(batteryIndex, cellIndex);
+	drawFixed(batteryIndex, cellIndex, 13, "Is=", shuntCurrent, 3, 3, 0);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void minCurrentListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short minCurrent) {
 	pthread_mutex_lock(&mutex);
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3d ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 22);
-	fprintf(stdout, "It=%.3f ", milliToDouble(minCurrent));
-	fflush(stdout);
+	drawCellIndex(batteryIndex, cellIndex);
+	drawFixed(batteryIndex, cellIndex, 22, "It=", minCurrent, 3, 3, 0);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void temperatureListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short temperature) {
 	pthread_mutex_lock(&mutex);
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3d ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 31);
-	fprintf(stdout, "t=%4.1f ", milliToDouble(temperature) * 10);
-	fflush(stdout);
+	drawCellIndex(batteryIndex, cellIndex);
+	drawFixed(batteryIndex, cellIndex, 31, "t=", temperature, 2, 1, 4);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void cellConfigListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short revision,
 		unsigned char cellConfig) {
 	pthread_mutex_lock(&mutex);
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3d ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 38);
+	drawCellIndex(batteryIndex, cellIndex);
 	char isClean = cellConfig & 0x8 ? ' ' : '*';
 	char shuntType = cellConfig & 0x2 ? 'r' : ' ';
 	char hardSwitched = cellConfig & 0x4 ? 'h' : ' ';
 	char kelvin = cellConfig & 0x1 ? 'k' : ' ';
-	printf("%4hd%c%c%c%c", revision, isClean, shuntType, hardSwitched, kelvin);
-	fflush(stdout);
+	drawCellf(batteryIndex, cellIndex, 38, "%4hd%c%c%c%c", revision, isClean, shuntType, hardSwitched, kelvin);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void errorListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short errorCount) {
 	pthread_mutex_lock(&mutex);
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3d ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 46);
-	fprintf(stdout, "%4d", errorCount);
-	fflush(stdout);
+	drawCellIndex(batteryIndex, cellIndex);
+	drawCellf(batteryIndex, cellIndex, 46, "%4d", errorCount);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void latencyListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned char latency) {
 	pthread_mutex_lock(&mutex);
-	moveToCell(config, batteryIndex, cellIndex, 0);
-	fprintf(stdout, "%3hu ", cellIndex);
-	fflush(stdout);
-	moveToCell(config, batteryIndex, cellIndex, 51);
-	fprintf(stdout, "%2hhu", latency);
-	fflush(stdout);
+	drawCellIndex(batteryIndex, cellIndex);
+	drawCellf(batteryIndex, cellIndex, 51, "%2hhu", latency);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void chargerStateListener(unsigned char shutdown, unsigned char state, unsigned char reason, __u16 shuntDelay) {
 	pthread_mutex_lock(&mutex);
-	moveToSummary(config, 2, 85);
 	const char *reasonString = chargeAlgorithm_getStateChangeReasonString(reason);
 	const char *shutdownString = shutdown ? "Shutdown" : "Running";
 	const char *stateString = state ? "On" : "Off";
-	fprintf(stdout, "%8s %3s %18s %5d", shutdownString, stateString, reasonString, shuntDelay);
-	fflush(stdout);
+	drawSummaryf(STATUS_BATTERY, 85, "%8s %3s %18s %5d", shutdownString, stateString, reasonString, shuntDelay);
 	pthread_mutex_unlock(&mutex);
 }
 
@@ -265,10 +267,10 @@ static void socListener() {
 	struct timeval now;
 	gettimeofday(&now, NULL);
 	if ((now.tv_sec - last.tv_sec) * 1000000 + (now.tv_usec - last.tv_usec) > 500000) {
-		moveToSummary(config, 2, 10);
-		printf("%6.2fV %7.2fA %7.2fAh %7.2fWh %5.1fC %5.1fC %3.0fkm/h", soc_getVoltage(), soc_getCurrent(), soc_getAh(),
-				soc_getWh(), soc_getT1(), soc_getT2(), soc_getSpeed());
-		fflush(stdout);
+		struct soc_snapshot_t soc;
+		soc_getSnapshot(&soc);
+		drawSummaryf(STATUS_BATTERY, 10, "%6.2fV %7.2fA %7.2fAh %7.2fWh %5.1fC %5.1fC %3.0fkm/h", soc.voltage,
+				soc.current, soc.ah, soc.wh, soc.t1, soc.t2, soc.speed);
 		last.tv_sec = now.tv_sec;
 		last.tv_usec = now.tv_usec;
 	}
@@ -277,18 +279,113 @@ static void socListener() {
 
 static void monitorStateListener(monitor_state_t state, __u16 delay, __u8 loopsUntilVoltage) {
 	pthread_mutex_lock(&mutex);
-	moveToSummary(config, 2, 130);
 	const char *stateString = monitor_getStateString(state);
-	fprintf(stdout, "%20s %3d %d", stateString, delay, loopsUntilVoltage);
-	fflush(stdout);
+	drawSummaryf(STATUS_BATTERY, 130, "%20s %3d %d", stateString, delay, loopsUntilVoltage);
 	pthread_mutex_unlock(&mutex);
 }
 
+/** @return the length of the escape sequence moving the cursor to the 0 based column and row written to buf */
+static int formatMove(char *buf, unsigned short column, unsigned short row) {
+	char *p = buf;
+	*p++ = '\033';
+	*p++ = '[';
+	p += formatFixed(p, row + 1, 0, 0, 0);
+	*p++ = ';';
+	p += formatFixed(p, column + 1, 0, 0, 0);
+	*p++ = 'f';
+	return p - buf;
+}
+
+/** @return the length of the escape sequences and text bringing the row from shown to frame written to buf */
+static size_t diffRow(char *buf, unsigned short row) {
+	const char *next = frame + row * SCREEN_WIDTH;
+	char *current = shown + row * SCREEN_WIDTH;
+	size_t length = 0;
+	unsigned short column = 0;
+	while (column < SCREEN_WIDTH) {
+		if (next[column] == current[column]) {
+			column++;
+			continue;
+		}
+		// carry on through short runs of unchanged characters, they are cheaper than another move
+		unsigned short start = column;
+		unsigned short end = column + 1;
+		for (column++; column < SCREEN_WIDTH && column - end < MAX_GAP; column++) {
+			if (next[column] != current[column]) {
+				end = column + 1;
+			}
+		}
+		length += formatMove(buf + length, start, row);
+		memcpy(buf + length, next + start, end - start);
+		memcpy(current + start, next + start, end - start);
+		length += end - start;
+		column = end;
+	}
+	return length;
+}
+
+static void *renderThreadMain(void *ptr __attribute__ ((unused))) {
+	struct timespec interval = { config->consoleRefreshInterval / 1000,
+			(config->consoleRefreshInterval % 1000) * 1000000L };
+	while (1) {
+		nanosleep(&interval, NULL);
+		pthread_mutex_lock(&mutex);
+		for (unsigned short row = 0; row < screenHeight; row++) {
+			frameRows[row] = dirtyRows[row];
+			if (dirtyRows[row]) {
+				memcpy(frame + row * SCREEN_WIDTH, screen + row * SCREEN_WIDTH, SCREEN_WIDTH);
+				dirtyRows[row] = 0;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+
+		size_t length = 0;
+		for (unsigned short row = 0; row < screenHeight; row++) {
+			if (frameRows[row]) {
+				length += diffRow(output + length, row);
+			}
+		}
+		for (size_t written = 0; written < length;) {
+			ssize_t result = write(1, output + written, length - written);
+			if (result == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			written += result;
+		}
+	}
+	return NULL;
+}
+
 void console_init(struct config_t *configArg) {
 	config = configArg;
 	gettimeofday(&last, NULL);
-	lastMaxVoltage = malloc(sizeof(unsigned short) * config->batteryCount);
-	lastMinVoltage = malloc(sizeof(unsigned short) * config->batteryCount);
+	firstRows = malloc(sizeof(unsigned short) * config->batteryCount);
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		firstRows[i] = getSummaryRow(i) - getLineCount(i);
+	}
+	screenHeight = getSummaryRow(config->batteryCount > STATUS_BATTERY ? config->batteryCount - 1 : STATUS_BATTERY);
+	size_t size = (size_t) screenHeight * SCREEN_WIDTH;
+	screen = malloc(size);
+	frame = malloc(size);
+	shown = malloc(size);
+	dirtyRows = calloc(screenHeight, 1);
+	frameRows = calloc(screenHeight, 1);
+	// each changed run costs a move of at most 12 characters and runs are more than MAX_GAP apart
+	output = malloc(size * 3);
+	if (!screen || !frame || !shown || !dirtyRows || !frameRows || !output) {
+		fprintf(stderr, "no memory for the console\n");
+		return;
+	}
+	// nothing is drawn until it changes, like the terminal we start on
+	memset(screen, ' ', size);
+	memset(shown, ' ', size);
+	if (pthread_create(&renderThread, NULL, renderThreadMain, NULL)) {
+		fprintf(stderr, "could not start the console render thread\n");
+		return;
+	}
 	canEventListener_registerVoltageListener(voltageListener);
 	canEventListener_registerShuntCurrentListener(shuntCurrentListener);
 	canEventListener_registerMinCurrentListener(minCurrentListener);
@@ -298,5 +395,6 @@ void console_init(struct config_t *configArg) {
 	canEventListener_registerLatencyListener(latencyListener);
 	canEventListener_registerChargerStateListener(chargerStateListener);
 	canEventListener_registerMonitorStateListener(monitorStateListener);
+	packAggregates_registerSweepListener(sweepListener);
 	soc_registerSocEventListener(socListener);
 }
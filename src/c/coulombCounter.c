@@ -0,0 +1,82 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "coulombCounter.h"
+
+static double secondsBetween(const struct timeval *from, const struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+void coulombCounter_init(struct coulombCounter_t *counter) {
+	memset(counter, 0, sizeof(struct coulombCounter_t));
+}
+
+void coulombCounter_addVoltage(struct coulombCounter_t *counter, double voltage) {
+	counter->voltage = voltage;
+}
+
+void coulombCounter_addCurrent(struct coulombCounter_t *counter, double current, const struct timeval *received) {
+	double seconds = secondsBetween(&counter->currentReceived, received);
+	// the clock can be set backwards and a gap means we don't know what the current did
+	if (counter->integrating && seconds > 0 && seconds <= COULOMB_COUNTER_MAX_GAP) {
+		double ah = (counter->current + current) / 2 * seconds / (60 * 60);
+		counter->ah += ah;
+		counter->charge += ah;
+		counter->wh += ah * counter->voltage;
+	}
+	counter->integrating = 1;
+	counter->current = current;
+	counter->currentReceived = *received;
+}
+
+/** Move value towards reference, @return the correction made */
+static double correct(double *value, double reference, char *seeded, struct timeval *last,
+		const struct timeval *received) {
+	double correction = reference - *value;
+	if (*seeded) {
+		double seconds = secondsBetween(last, received);
+		if (seconds <= 0) {
+			return 0;
+		}
+		correction *= seconds / (COULOMB_COUNTER_TIME_CONSTANT + seconds);
+	}
+	*seeded = 1;
+	*last = *received;
+	*value += correction;
+	return correction;
+}
+
+void coulombCounter_correctAh(struct coulombCounter_t *counter, double ah, const struct timeval *received) {
+	char seeded = counter->ahSeeded;
+	double correction = correct(&counter->ah, ah, &counter->ahSeeded, &counter->ahReceived, received);
+	// where we start from isn't drift
+	if (seeded) {
+		counter->ahCorrection += correction;
+	}
+}
+
+void coulombCounter_correctWh(struct coulombCounter_t *counter, double wh, const struct timeval *received) {
+	char seeded = counter->whSeeded;
+	double correction = correct(&counter->wh, wh, &counter->whSeeded, &counter->whReceived, received);
+	if (seeded) {
+		counter->whCorrection += correction;
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_COULOMB_COUNTER_H_
+#define TUMANAKO_COULOMB_COUNTER_H_
+
+#include <sys/time.h>
+
+/*
+ * Integrates the instantaneous current into Ah and Wh between the EVision's own, much less frequent and coarser, Ah
+ * and Wh readings.
+ *
+ * The first EVision reading sets where we start from, after that each reading pulls us towards it with a time constant
+ * of COULOMB_COUNTER_TIME_CONSTANT seconds so the integration can't drift away from the EVision but the 0.01Ah steps of
+ * its readings don't show up in ours. Until the first reading we count from zero.
+ *
+ * Units and signs are those of soc.h, positive current is discharging and positive Ah and Wh are discharged.
+ */
+
+// seconds without a current reading after which we stop integrating until the next one rather than guess
+#define COULOMB_COUNTER_MAX_GAP 2
+#define COULOMB_COUNTER_TIME_CONSTANT 60
+
+struct coulombCounter_t {
+	double ah;
+	double wh;
+	// the sum of the corrections made to ah and wh, how far the integration would have drifted without them
+	double ahCorrection;
+	double whCorrection;
+	// Ah integrated since we started, never corrected or seeded, for the charge between two moments
+	double charge;
+	char ahSeeded;
+	char whSeeded;
+	char integrating;
+	double current;
+	struct timeval currentReceived;
+	double voltage;
+	struct timeval ahReceived;
+	struct timeval whReceived;
+};
+
+void coulombCounter_init(struct coulombCounter_t *counter);
+
+/** The pack voltage used for Wh from now on */
+void coulombCounter_addVoltage(struct coulombCounter_t *counter, double voltage);
+
+/** Add the charge since the previous current reading, received is when the kernel received this one */
+void coulombCounter_addCurrent(struct coulombCounter_t *counter, double current, const struct timeval *received);
+
+/** Correct the integrated Ah against a reading received from the EVision */
+void coulombCounter_correctAh(struct coulombCounter_t *counter, double ah, const struct timeval *received);
+
+/** Correct the integrated Wh against a reading received from the EVision */
+void coulombCounter_correctWh(struct coulombCounter_t *counter, double wh, const struct timeval *received);
+
+#endif /* TUMANAKO_COULOMB_COUNTER_H_ */
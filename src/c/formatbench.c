@@ -0,0 +1,150 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check formatFixed() against snprintf for every value in the formats we log and compare their speed.
+ *
+ * formatbench [iterations]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+struct format_t {
+	const char *name;
+	unsigned char scale;
+	unsigned char decimals;
+	unsigned char width;
+	long long min;
+	long long max;
+};
+
+static const struct format_t formats[] = {
+	// cell voltage and shunt current in the log and on the console
+	{ "milli %.3f", 3, 3, 0, 0, 65535 },
+	// cell temperature in the log
+	{ "centi %.1f", 2, 1, 0, 0, 65535 },
+	// temperature on the console
+	{ "centi %4.1f", 2, 1, 4, 0, 65535 },
+	// hires voltage and current, log SOC values
+	{ "hundredths %.2f", 2, 2, 0, -200000, 200000 },
+	{ "hundredths %.1f", 2, 1, 0, -200000, 200000 },
+	// cell index on the console
+	{ "integer %3d", 0, 0, 3, -1000, 1000 },
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+static double scaled(long long value, unsigned char scale) {
+	double divisor = 1;
+	for (unsigned char i = 0; i < scale; i++) {
+		divisor *= 10;
+	}
+	return value / divisor;
+}
+
+static double nanosecondsSince(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+static int check(const struct format_t *format) {
+	char expected[64];
+	char actual[64];
+	int mismatches = 0;
+	for (long long value = format->min; value <= format->max; value++) {
+		int expectedLength = snprintf(expected, sizeof(expected), "%*.*f", format->width, format->decimals,
+				scaled(value, format->scale));
+		int actualLength = formatFixed(actual, value, format->scale, format->decimals, format->width);
+		if (expectedLength != actualLength || strcmp(expected, actual)) {
+			if (mismatches++ < 5) {
+				fprintf(stderr, "%s: %lld gave '%s' not '%s'\n", format->name, value, actual, expected);
+			}
+		}
+	}
+	return mismatches;
+}
+
+/** microsecond timestamps as written by hiResLogger, every tie plus a spread of other values */
+static int checkTimestamps() {
+	char expected[64];
+	char actual[64];
+	int mismatches = 0;
+	srand(1);
+	for (long i = 0; i < 2000000; i++) {
+		long long seconds = 1370000000LL + rand() % 100000000;
+		long long microseconds = i % 2 ? rand() % 1000000 : (rand() % 1000) * 1000 + 500;
+		long long value = seconds * 1000000 + microseconds;
+		double now = value / 1000000 + (value % 1000000) / (double) 1000000;
+		snprintf(expected, sizeof(expected), "%.3f", now);
+		formatFixed(actual, value, 6, 3, 0);
+		if (strcmp(expected, actual) && mismatches++ < 5) {
+			fprintf(stderr, "timestamp: %lld gave '%s' not '%s'\n", value, actual, expected);
+		}
+	}
+	return mismatches;
+}
+
+static void benchmark(const struct format_t *format, long iterations) {
+	char buf[64];
+	long range = format->max - format->min + 1;
+	unsigned long total = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		total += snprintf(buf, sizeof(buf), "%*.*f", format->width, format->decimals,
+				scaled(format->min + i % range, format->scale));
+	}
+	double printfTime = nanosecondsSince(&start) / iterations;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		total += formatFixed(buf, format->min + i % range, format->scale, format->decimals, format->width);
+	}
+	double fixedTime = nanosecondsSince(&start) / iterations;
+
+	printf("%-18s snprintf %6.1fns formatFixed %6.1fns %5.1fx (%lu)\n", format->name, printfTime, fixedTime,
+			printfTime / fixedTime, total);
+}
+
+int main(int argc, char *argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+	int mismatches = 0;
+	for (unsigned int i = 0; i < FORMAT_COUNT; i++) {
+		mismatches += check(formats + i);
+	}
+	mismatches += checkTimestamps();
+	if (mismatches) {
+		fprintf(stderr, "%d values formatted differently to snprintf\n", mismatches);
+		return 1;
+	}
+	printf("all values match snprintf\n");
+	for (unsigned int i = 0; i < FORMAT_COUNT; i++) {
+		benchmark(formats + i, iterations);
+	}
+	return 0;
+}
@@ -18,42 +18,251 @@
  <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <linux/types.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
 #include <pthread.h>
 
 #include "soc.h"
+#include "util.h"
+#include "config.h"
+#include "hiResLogger.h"
+
+// must be powers of two
+#define RING_SIZE 8192
+#define HISTORY_SIZE 16384
+// the writer formats this many samples at a time
+#define BLOCK_SAMPLES 256
+// how long the writer sleeps when the ring is empty
+#define POLL_NANOSECONDS 20000000
+
+/*
+ * Samples are taken on the CAN listener thread and written by the writer thread. The ring has a single producer and a
+ * single consumer so head is only written by the listener and tail only by the writer.
+ *
+ * Every sample goes into the writer's history so when a capture starts the preceding hiResPreTrigger seconds can be
+ * written too. A capture runs while hiResLogger_start() is in effect, and for hiResPostTrigger seconds after the
+ * current steps or the voltage sags by more than the configured amount within hiResTriggerInterval ms.
+ *
+ * The history holds HISTORY_SIZE samples, at more than HISTORY_SIZE / hiResPreTrigger samples per second the start of
+ * the pre-trigger window has already been overwritten. Those captures are counted as truncated.
+ */
+struct sample_t {
+	long long microseconds;
+	// hundredths
+	int voltage;
+	int current;
+	int speed;
+};
 
 FILE *logFile;
 
+static struct config_t *config;
 static volatile __u8 logging = 0;
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// when hiResLogger_start() and hiResLogger_stop() were last called, the writer may be a little behind
+static long long startedAt = -1;
+static long long stoppedAt = -1;
+static struct sample_t ring[RING_SIZE];
+static unsigned long head;
+static unsigned long tail;
+static unsigned long overruns;
+static unsigned long written;
+static unsigned long captures;
+static unsigned long truncated;
+// incremented by hiResLogger_stop() so the writer can end the capture even if no more samples arrive
+static unsigned long stopCount;
+static pthread_t writerThread;
 
-static void voltageListener() {
-	if (logging) {
-		struct timeval t;
-		gettimeofday(&t, NULL);
-		double now = t.tv_sec + t.tv_usec / (double) 1000000;
-		pthread_mutex_lock(&mutex);
-		fprintf(logFile, "%.3f %.2f %.2f %.1f\n", now, soc_getInstVoltage(), soc_getInstCurrent(), soc_getSpeed());
-		pthread_mutex_unlock(&mutex);
+// only used by the writer thread
+static struct sample_t history[HISTORY_SIZE];
+static unsigned long historyCount;
+// the sample hiResTriggerInterval before the latest one
+static unsigned long lookback;
+static unsigned char capturing;
+static long long captureUntil;
+static long long lastWritten = -1;
+static char buf[BLOCK_SAMPLES * 64];
+static int bufLength;
+
+static void voltageListener(const struct timeval *received) {
+	unsigned long h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+		__atomic_add_fetch(&overruns, 1, __ATOMIC_RELAXED);
+		return;
 	}
+	struct sample_t *sample = ring + (h & (RING_SIZE - 1));
+	sample->microseconds = received->tv_sec * 1000000LL + received->tv_usec;
+	// the voltage and current must be from the same moment
+	struct soc_snapshot_t soc;
+	soc_getSnapshot(&soc);
+	sample->voltage = lround(soc.instVoltage * 100);
+	sample->current = lround(soc.instCurrent * 100);
+	sample->speed = lround(soc.speed * 100);
+	__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
 }
 
-void hiResLogger_init() {
+static void flushOutput() {
+	if (bufLength) {
+		fwrite(buf, 1, bufLength, logFile);
+		bufLength = 0;
+	}
+}
+
+static void writeSample(struct sample_t *sample) {
+	// "1370000000.123 330.12 -123.45 12.3\n"
+	if (bufLength > (int) sizeof(buf) - 64) {
+		flushOutput();
+	}
+	char *p = buf + bufLength;
+	p += formatFixed(p, sample->microseconds, 6, 3, 0);
+	*p++ = ' ';
+	p += formatFixed(p, sample->voltage, 2, 2, 0);
+	*p++ = ' ';
+	p += formatFixed(p, sample->current, 2, 2, 0);
+	*p++ = ' ';
+	p += formatFixed(p, sample->speed, 2, 1, 0);
+	*p++ = '\n';
+	bufLength = p - buf;
+	lastWritten = sample->microseconds;
+	__atomic_add_fetch(&written, 1, __ATOMIC_RELAXED);
+}
+
+static void endCapture() {
+	capturing = 0;
+	flushOutput();
+	fprintf(logFile, "\n");
+	fflush(logFile);
+}
+
+/** @return true if the current stepped or the voltage sagged since the sample hiResTriggerInterval ago */
+static unsigned char isTriggered(struct sample_t *sample) {
+	long long interval = config->hiResTriggerInterval * 1000LL;
+	while (lookback + 1 < historyCount
+			&& history[(lookback + 1) & (HISTORY_SIZE - 1)].microseconds <= sample->microseconds - interval) {
+		lookback++;
+	}
+	if (historyCount - lookback > HISTORY_SIZE) {
+		lookback = historyCount - HISTORY_SIZE;
+	}
+	struct sample_t *before = history + (lookback & (HISTORY_SIZE - 1));
+	if (config->hiResCurrentStep && abs(sample->current - before->current) > config->hiResCurrentStep * 100) {
+		return 1;
+	}
+	return config->hiResVoltageSag && before->voltage - sample->voltage > config->hiResVoltageSag * 100;
+}
+
+static long long nowMicroseconds() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+static unsigned char isStarted(struct sample_t *sample) {
+	long long started = __atomic_load_n(&startedAt, __ATOMIC_ACQUIRE);
+	long long stopped = __atomic_load_n(&stoppedAt, __ATOMIC_ACQUIRE);
+	return started >= 0 && sample->microseconds >= started && (stopped < started || sample->microseconds < stopped);
+}
+
+static void processSample(struct sample_t *sample) {
+	history[historyCount & (HISTORY_SIZE - 1)] = *sample;
+	historyCount++;
+	if (isTriggered(sample)) {
+		captureUntil = sample->microseconds + config->hiResPostTrigger * 1000000LL;
+	}
+	unsigned char shouldCapture = isStarted(sample) || sample->microseconds <= captureUntil;
+	if (shouldCapture && !capturing) {
+		capturing = 1;
+		__atomic_add_fetch(&captures, 1, __ATOMIC_RELAXED);
+		// the pre-trigger window, this sample is the last one in the history
+		long long from = sample->microseconds - config->hiResPreTrigger * 1000000LL;
+		unsigned long i = historyCount > HISTORY_SIZE ? historyCount - HISTORY_SIZE : 0;
+		struct sample_t *oldest = history + (i & (HISTORY_SIZE - 1));
+		if (i && oldest->microseconds > from) {
+			// the history has wrapped so the start of the window is gone, warn the first time
+			if (__atomic_add_fetch(&truncated, 1, __ATOMIC_RELAXED) == 1) {
+				double held = (sample->microseconds - oldest->microseconds) / 1000000.0;
+				fprintf(stderr, "hiResLogger: only %.1fs of the %ds pre-trigger window fit in %d samples at %.0f/s\n",
+						held, config->hiResPreTrigger, HISTORY_SIZE, held > 0 ? (HISTORY_SIZE - 1) / held : 0);
+			}
+		}
+		for (; i < historyCount; i++) {
+			struct sample_t *old = history + (i & (HISTORY_SIZE - 1));
+			if (old->microseconds >= from && old->microseconds > lastWritten) {
+				writeSample(old);
+			}
+		}
+	} else if (shouldCapture) {
+		writeSample(sample);
+	} else if (capturing) {
+		endCapture();
+	}
+}
+
+static void *writerThreadMain(void *ptr __attribute__ ((unused))) {
+	unsigned long seenStopCount = 0;
+	while (1) {
+		unsigned long t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		unsigned long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		if (h == t) {
+			flushOutput();
+			unsigned long s = __atomic_load_n(&stopCount, __ATOMIC_ACQUIRE);
+			if (s != seenStopCount) {
+				seenStopCount = s;
+				if (capturing && !logging && lastWritten > captureUntil) {
+					endCapture();
+				}
+			}
+			struct timespec delay = { 0, POLL_NANOSECONDS };
+			nanosleep(&delay, NULL);
+			continue;
+		}
+		if (h - t > BLOCK_SAMPLES) {
+			h = t + BLOCK_SAMPLES;
+		}
+		for (unsigned long i = t; i != h; i++) {
+			processSample(ring + (i & (RING_SIZE - 1)));
+		}
+		__atomic_store_n(&tail, h, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+void hiResLogger_init(struct config_t *_config) {
+	config = _config;
 	logFile = fopen("hiRes.txt", "a");
+	if (!logFile) {
+		perror("hiRes.txt");
+		return;
+	}
+	pthread_create(&writerThread, NULL, writerThreadMain, NULL);
 	soc_registerInstVoltageListener(voltageListener);
 }
 
 void hiResLogger_start() {
+	if (!logging) {
+		__atomic_store_n(&startedAt, nowMicroseconds(), __ATOMIC_RELEASE);
+	}
 	logging = 1;
 }
 
 void hiResLogger_stop() {
+	if (logging) {
+		__atomic_store_n(&stoppedAt, nowMicroseconds(), __ATOMIC_RELEASE);
+	}
 	logging = 0;
-	pthread_mutex_lock(&mutex);
-	fprintf(logFile, "\n");
-	fflush(logFile);
-	pthread_mutex_unlock(&mutex);
+	__atomic_add_fetch(&stopCount, 1, __ATOMIC_RELEASE);
+}
+
+void hiResLogger_getStats(struct hiResLogger_stats_t *stats) {
+	stats->written = __atomic_load_n(&written, __ATOMIC_RELAXED);
+	stats->overruns = __atomic_load_n(&overruns, __ATOMIC_RELAXED);
+	stats->samples = __atomic_load_n(&head, __ATOMIC_ACQUIRE) + stats->overruns;
+	stats->captures = __atomic_load_n(&captures, __ATOMIC_RELAXED);
+	stats->truncated = __atomic_load_n(&truncated, __ATOMIC_RELAXED);
 }
@@ -18,6 +18,25 @@
  <http://www.gnu.org/licenses/>.
  */
 
-extern void hiResLogger_init();
+#ifndef HIRESLOGGER_H
+#define HIRESLOGGER_H
+
+struct hiResLogger_stats_t {
+	// samples taken, samples written to hiRes.txt and samples lost because the ring was full
+	unsigned long samples;
+	unsigned long written;
+	unsigned long overruns;
+	// capture windows started, by hiResLogger_start() or a trigger
+	unsigned long captures;
+	// captures missing the start of their pre-trigger window because it no longer fitted in the history
+	unsigned long truncated;
+};
+
+struct config_t;
+
+extern void hiResLogger_init(struct config_t *config);
 extern void hiResLogger_start();
 extern void hiResLogger_stop();
+extern void hiResLogger_getStats(struct hiResLogger_stats_t *stats);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "histogram.h"
+
+static unsigned int getBucket(unsigned long long value) {
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	// the sub bucket is the bits after the highest set one
+	int highBit = 63 - __builtin_clzll(value);
+	int shift = highBit - HISTOGRAM_SUB_BUCKET_BITS;
+	unsigned int subBucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+/** @return the largest value that goes in the bucket */
+static unsigned long long getBucketLimit(unsigned int bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	unsigned long long subBucket = bucket % HISTOGRAM_SUB_BUCKETS;
+	return ((HISTOGRAM_SUB_BUCKETS + subBucket + 1) << shift) - 1;
+}
+
+void histogram_clear(struct histogram_t *histogram) {
+	memset(histogram, 0, sizeof(struct histogram_t));
+}
+
+void histogram_record(struct histogram_t *histogram, unsigned long long value) {
+	if (!histogram->count || value < histogram->min) {
+		histogram->min = value;
+	}
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+	histogram->count++;
+	histogram->sum += value;
+	histogram->buckets[getBucket(value)]++;
+}
+
+unsigned long long histogram_getPercentile(const struct histogram_t *histogram, double fraction) {
+	if (!histogram->count) {
+		return 0;
+	}
+	unsigned long long wanted = (unsigned long long) (fraction * histogram->count + 0.5);
+	if (wanted < 1) {
+		wanted = 1;
+	}
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= wanted) {
+			unsigned long long limit = getBucketLimit(i);
+			// no point reporting more than we ever saw
+			return limit < histogram->max ? limit : histogram->max;
+		}
+	}
+	return histogram->max;
+}
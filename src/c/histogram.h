@@ -0,0 +1,46 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_HISTOGRAM_H_
+#define TUMANAKO_HISTOGRAM_H_
+
+/*
+ * Fixed size log-linear histogram. Each power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets so any
+ * value is recorded to within 1 / HISTOGRAM_SUB_BUCKETS of itself, values below HISTOGRAM_SUB_BUCKETS exactly.
+ */
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram_t {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_clear(struct histogram_t *histogram);
+void histogram_record(struct histogram_t *histogram, unsigned long long value);
+
+/** @return the value below which the fraction (0 to 1) of the recorded values fall, 0 if nothing is recorded */
+unsigned long long histogram_getPercentile(const struct histogram_t *histogram, double fraction);
+
+#endif /* TUMANAKO_HISTOGRAM_H_ */
@@ -0,0 +1,167 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Record a day and a half of sweeps of MAX_CELLS cells into the cell history, check its summaries against every
+ * sample kept for a few cells and report the memory used and the time each reading takes to record.
+ *
+ * historybench [seconds between sweeps [hours]]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "config.h"
+#include "cellHistory.h"
+
+// cells with every sample kept to check against
+#define CHECKED_CELLS 4
+
+static uint16_t *checkedValues[CHECKED_CELLS];
+static uint32_t *checkedTimes;
+static unsigned long sampleCount;
+
+static uint16_t getValue(unsigned short cell, uint32_t time) {
+	switch (cell % CHECKED_CELLS) {
+	case 0:
+		// a steady 100mV per hour
+		return 3000 + time / 36;
+	case 1:
+		return 3300 + rand() % 200;
+	case 2:
+		return 3300 + 100 * sin(time / 600.0);
+	default:
+		return time % 7 ? 3400 : 3100;
+	}
+}
+
+/** @return the summary of the samples of cell from since to the end worked out from every sample */
+static void summarise(unsigned short cell, uint32_t since, struct cellHistory_summary_t *summary) {
+	double total = 0;
+	memset(summary, 0, sizeof(struct cellHistory_summary_t));
+	summary->min = 0xffff;
+	for (unsigned long i = 0; i < sampleCount; i++) {
+		if (checkedTimes[i] < since) {
+			continue;
+		}
+		uint16_t value = checkedValues[cell][i];
+		summary->count++;
+		total += value;
+		summary->min = value < summary->min ? value : summary->min;
+		summary->max = value > summary->max ? value : summary->max;
+	}
+	summary->mean = total / summary->count;
+}
+
+static int check(unsigned short cell, cellHistory_tier_t tier, uint32_t since, const char *name) {
+	struct cellHistory_summary_t expected;
+	struct cellHistory_summary_t actual;
+	summarise(cell, since, &expected);
+	if (cellHistory_getSummary(0, cell, CELL_HISTORY_VOLTAGE, tier, since, &actual)) {
+		fprintf(stderr, "cell %d %s: no summary\n", cell, name);
+		return 1;
+	}
+	if (actual.count != expected.count || actual.min != expected.min || actual.max != expected.max
+			|| fabs(actual.mean - expected.mean) > 0.01) {
+		fprintf(stderr, "cell %d %s: expected %u %hu-%hu %.3f got %u %hu-%hu %.3f\n", cell, name, expected.count,
+				expected.min, expected.max, expected.mean, actual.count, actual.min, actual.max, actual.mean);
+		return 1;
+	}
+	return 0;
+}
+
+static double nanosecondsSince(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int interval = argc > 1 ? atoi(argv[1]) : 5;
+	unsigned int hours = argc > 2 ? atoi(argv[2]) : 36;
+	if (interval < 1 || hours < 1) {
+		fprintf(stderr, "usage: historybench [seconds between sweeps [hours]]\n");
+		return 1;
+	}
+	struct config_battery_t battery = { "battery", MAX_CELLS, NULL };
+	struct config_t config;
+	memset(&config, 0, sizeof(config));
+	config.batteryCount = 1;
+	config.batteries = &battery;
+	if (cellHistory_init(&config)) {
+		return 1;
+	}
+	unsigned long sweeps = hours * 60UL * 60 / interval;
+	checkedTimes = malloc(sweeps * sizeof(uint32_t));
+	for (int i = 0; i < CHECKED_CELLS; i++) {
+		checkedValues[i] = malloc(sweeps * sizeof(uint16_t));
+	}
+
+	srand(1);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// start part way through an hour
+	uint32_t time = 1000;
+	for (unsigned long sweep = 0; sweep < sweeps; sweep++, time += interval) {
+		for (unsigned short cell = 0; cell < MAX_CELLS; cell++) {
+			uint16_t value = getValue(cell, time);
+			cellHistory_record(0, cell, CELL_HISTORY_VOLTAGE, time, value);
+			cellHistory_record(0, cell, CELL_HISTORY_SHUNT_CURRENT, time, value);
+			cellHistory_record(0, cell, CELL_HISTORY_TEMPERATURE, time, value);
+			if (cell < CHECKED_CELLS) {
+				checkedValues[cell][sweep] = value;
+			}
+		}
+		checkedTimes[sweep] = time;
+		sampleCount++;
+	}
+	double recordTime = nanosecondsSince(&start) / ((double) sweeps * MAX_CELLS * CELL_HISTORY_SIGNAL_COUNT);
+
+	uint32_t last = time - interval;
+	int failures = 0;
+	for (unsigned short cell = 0; cell < CHECKED_CELLS; cell++) {
+		failures += check(cell, CELL_HISTORY_RAW, last - (CELL_HISTORY_RAW_SAMPLES - 1) * interval, "raw");
+		failures += check(cell, CELL_HISTORY_MINUTE, last / 60 * 60 - 10 * 60, "last 10 minutes");
+		failures += check(cell, CELL_HISTORY_MINUTE, last / 60 * 60 - (CELL_HISTORY_MINUTES - 1) * 60, "last hour");
+		if (hours >= CELL_HISTORY_HOURS) {
+			failures += check(cell, CELL_HISTORY_HOUR, last / 3600 * 3600 - (CELL_HISTORY_HOURS - 1) * 3600,
+					"last day");
+		}
+	}
+	double slope;
+	// readings are whole mV so over a short window the slope is only good to a few mV over the window
+	double tolerance = 5 + 2 * 60 * 60 / ((CELL_HISTORY_RAW_SAMPLES - 1.0) * interval);
+	if (cellHistory_getSlope(0, 0, CELL_HISTORY_VOLTAGE, 0, &slope) || fabs(slope - 100) > tolerance) {
+		fprintf(stderr, "expected a slope of 100mV/h not %.1f\n", slope);
+		failures++;
+	}
+	if (failures) {
+		return 1;
+	}
+	printf("summaries match every sample, slope %.1fmV/h\n", slope);
+	printf("%lu sweeps of %d cells, %.0fns per reading, %zu KB for %d cells (%zu bytes per cell)\n", sweeps,
+			MAX_CELLS, recordTime, cellHistory_getMemoryUsage(MAX_CELLS) / 1024, MAX_CELLS,
+			cellHistory_getMemoryUsage(1));
+	return 0;
+}
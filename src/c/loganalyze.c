@@ -0,0 +1,530 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per cell statistics over one battery's logs, text (.txt) or binary segments (.bin).
+ *
+ * loganalyze [-j threads] [-c end of charge mV] [-s start] [-e end] battery.txt battery-*.bin
+ *
+ * The files are split into chunks, text at line boundaries and indexed binary segments at keyframes, which worker
+ * threads take from a queue. Each worker keeps its own partial aggregates which are merged at the end.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "binaryLog.h"
+#include "config.h"
+
+// text files are split into chunks of about this size
+#define TEXT_CHUNK_SIZE (4 * 1024 * 1024)
+// indexed binary segments are split every this many index entries
+#define BINARY_CHUNK_ENTRIES 64
+
+struct signalStats_t {
+	unsigned long count;
+	unsigned short min;
+	unsigned short max;
+	unsigned long long sum;
+	double sumOfSquares;
+};
+
+struct cellStats_t {
+	struct signalStats_t signals[BINARY_LOG_SIGNAL_COUNT];
+	// rows where the cell was shunting
+	unsigned long shuntingCount;
+	long maxTemperatureTimestamp;
+};
+
+/* Everything here can be merged, so workers can each aggregate their own chunks */
+struct partial_t {
+	unsigned long rows;
+	unsigned long badRows;
+	long firstTimestamp;
+	long lastTimestamp;
+	// spread between the highest and lowest cell in rows where the highest cell is at the end of charge voltage
+	unsigned long endOfChargeRows;
+	unsigned long long spreadSum;
+	unsigned short maxSpread;
+	long maxSpreadTimestamp;
+	unsigned short cellCount;
+	struct cellStats_t cells[MAX_CELLS];
+};
+
+struct chunk_t {
+	const char *fileName;
+	const char *data;
+	size_t length;
+	unsigned char isBinary;
+	// binary chunks decode from the keyframe at start up to the row starting at or after end, start -1 for all
+	long start;
+	long end;
+};
+
+static struct chunk_t *chunks;
+static unsigned int chunkCount;
+static unsigned int nextChunk;
+static unsigned short endOfChargeVoltage = 3600;
+static long startTime = LONG_MIN;
+static long endTime = LONG_MAX;
+
+static void initPartial(struct partial_t *partial) {
+	memset(partial, 0, sizeof(struct partial_t));
+	partial->firstTimestamp = LONG_MAX;
+	partial->lastTimestamp = LONG_MIN;
+}
+
+static void addRow(struct partial_t *partial, const struct binaryLog_row_t *row, unsigned short cellCount) {
+	if (row->timestamp < startTime || row->timestamp > endTime) {
+		return;
+	}
+	partial->rows++;
+	if (row->timestamp < partial->firstTimestamp) {
+		partial->firstTimestamp = row->timestamp;
+	}
+	if (row->timestamp > partial->lastTimestamp) {
+		partial->lastTimestamp = row->timestamp;
+	}
+	if (cellCount > partial->cellCount) {
+		partial->cellCount = cellCount;
+	}
+	unsigned short minVoltage = USHRT_MAX;
+	unsigned short maxVoltage = 0;
+	for (unsigned short cell = 0; cell < cellCount; cell++) {
+		struct cellStats_t *cellStats = partial->cells + cell;
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			if (!BINARY_LOG_IS_VALID(row, signal, cell)) {
+				continue;
+			}
+			unsigned short value = row->values[signal][cell];
+			struct signalStats_t *stats = cellStats->signals + signal;
+			if (!stats->count || value < stats->min) {
+				stats->min = value;
+			}
+			if (!stats->count || value > stats->max) {
+				stats->max = value;
+				if (signal == BINARY_LOG_SIGNAL_TEMPERATURE) {
+					cellStats->maxTemperatureTimestamp = row->timestamp;
+				}
+			}
+			stats->count++;
+			stats->sum += value;
+			stats->sumOfSquares += (double) value * value;
+			if (signal == BINARY_LOG_SIGNAL_SHUNT_CURRENT && value > 0) {
+				cellStats->shuntingCount++;
+			}
+			if (signal == BINARY_LOG_SIGNAL_VOLTAGE) {
+				minVoltage = value < minVoltage ? value : minVoltage;
+				maxVoltage = value > maxVoltage ? value : maxVoltage;
+			}
+		}
+	}
+	if (maxVoltage >= endOfChargeVoltage && minVoltage <= maxVoltage) {
+		unsigned short spread = maxVoltage - minVoltage;
+		partial->endOfChargeRows++;
+		partial->spreadSum += spread;
+		if (spread > partial->maxSpread) {
+			partial->maxSpread = spread;
+			partial->maxSpreadTimestamp = row->timestamp;
+		}
+	}
+}
+
+static void mergePartial(struct partial_t *to, const struct partial_t *from) {
+	to->rows += from->rows;
+	to->badRows += from->badRows;
+	to->firstTimestamp = from->firstTimestamp < to->firstTimestamp ? from->firstTimestamp : to->firstTimestamp;
+	to->lastTimestamp = from->lastTimestamp > to->lastTimestamp ? from->lastTimestamp : to->lastTimestamp;
+	to->endOfChargeRows += from->endOfChargeRows;
+	to->spreadSum += from->spreadSum;
+	if (from->maxSpread > to->maxSpread) {
+		to->maxSpread = from->maxSpread;
+		to->maxSpreadTimestamp = from->maxSpreadTimestamp;
+	}
+	if (from->cellCount > to->cellCount) {
+		to->cellCount = from->cellCount;
+	}
+	for (unsigned short cell = 0; cell < from->cellCount; cell++) {
+		const struct cellStats_t *fromCell = from->cells + cell;
+		struct cellStats_t *toCell = to->cells + cell;
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			const struct signalStats_t *f = fromCell->signals + signal;
+			struct signalStats_t *t = toCell->signals + signal;
+			if (!f->count) {
+				continue;
+			}
+			if (!t->count || f->min < t->min) {
+				t->min = f->min;
+			}
+			if (!t->count || f->max > t->max) {
+				t->max = f->max;
+				if (signal == BINARY_LOG_SIGNAL_TEMPERATURE) {
+					toCell->maxTemperatureTimestamp = fromCell->maxTemperatureTimestamp;
+				}
+			}
+			t->count += f->count;
+			t->sum += f->sum;
+			t->sumOfSquares += f->sumOfSquares;
+		}
+		toCell->shuntingCount += fromCell->shuntingCount;
+	}
+}
+
+/* Parse a decimal like 3.456 into an integer with the passed number of decimal places, 3456 */
+static long parseFixed(const char **p, const char *end, int decimals) {
+	const char *s = *p;
+	int negative = s < end && *s == '-';
+	if (negative) {
+		s++;
+	}
+	long result = 0;
+	while (s < end && *s >= '0' && *s <= '9') {
+		result = result * 10 + (*s++ - '0');
+	}
+	int places = 0;
+	if (s < end && *s == '.') {
+		s++;
+		while (s < end && *s >= '0' && *s <= '9') {
+			if (places < decimals) {
+				result = result * 10 + (*s - '0');
+				places++;
+			}
+			s++;
+		}
+	}
+	for (; places < decimals; places++) {
+		result *= 10;
+	}
+	*p = s;
+	return negative ? -result : result;
+}
+
+static const char *skipSpaces(const char *p, const char *end) {
+	while (p < end && *p == ' ') {
+		p++;
+	}
+	return p;
+}
+
+/** @return 0 if the line was a valid row */
+static int parseTextLine(const char *p, const char *end, struct binaryLog_row_t *row, unsigned short *cellCount) {
+	static const int decimals[BINARY_LOG_SIGNAL_COUNT] = { 3, 3, 2 };
+	p = skipSpaces(p, end);
+	row->timestamp = parseFixed(&p, end, 0);
+	for (int i = 0; i < BINARY_LOG_SOC_COUNT; i++) {
+		p = skipSpaces(p, end);
+		row->soc[i] = parseFixed(&p, end, 2);
+	}
+	unsigned short cell = 0;
+	while ((p = skipSpaces(p, end)) < end) {
+		if (cell >= MAX_CELLS) {
+			return 1;
+		}
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			p = skipSpaces(p, end);
+			if (p >= end) {
+				return 1;
+			}
+			if (*p == '-' && (p + 1 == end || p[1] == ' ')) {
+				p++;
+				binaryLog_setValid(row, signal, cell, 0);
+			} else {
+				row->values[signal][cell] = (unsigned short) parseFixed(&p, end, decimals[signal]);
+				binaryLog_setValid(row, signal, cell, 1);
+			}
+			if (p < end && *p != ' ') {
+				return 1;
+			}
+		}
+		cell++;
+	}
+	*cellCount = cell;
+	return 0;
+}
+
+static void analyseText(struct chunk_t *chunk, struct partial_t *partial, struct binaryLog_row_t *row) {
+	const char *p = chunk->data + chunk->start;
+	const char *end = chunk->data + chunk->end;
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol) {
+			eol = end;
+		}
+		if (eol > p) {
+			unsigned short cellCount;
+			if (parseTextLine(p, eol, row, &cellCount)) {
+				partial->badRows++;
+			} else {
+				addRow(partial, row, cellCount);
+			}
+		}
+		p = eol + 1;
+	}
+}
+
+static void analyseBinary(struct chunk_t *chunk, struct partial_t *partial) {
+	FILE *in = fmemopen((void *) chunk->data, chunk->length, "r");
+	if (!in) {
+		perror(chunk->fileName);
+		return;
+	}
+	struct binaryLog_reader_t *reader = binaryLog_openReader(in);
+	if (reader && (chunk->start < 0 || !binaryLog_seek(reader, chunk->start))) {
+		const struct binaryLog_row_t *row;
+		while (ftell(in) < chunk->end && (row = binaryLog_readRow(reader))) {
+			if (binaryLog_getCellCount(reader) > MAX_CELLS) {
+				// the header is corrupt or not one of ours, we only have room for MAX_CELLS
+				partial->badRows++;
+				break;
+			}
+			addRow(partial, row, binaryLog_getCellCount(reader));
+		}
+		if (!feof(in) && ftell(in) < chunk->end) {
+			partial->badRows++;
+		}
+	}
+	binaryLog_closeReader(reader);
+	fclose(in);
+}
+
+static void *workerMain(void *ptr) {
+	struct partial_t *partial = ptr;
+	struct binaryLog_row_t row;
+	if (binaryLog_allocRow(&row, MAX_CELLS)) {
+		return NULL;
+	}
+	unsigned int i;
+	while ((i = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_RELAXED)) < chunkCount) {
+		struct chunk_t *chunk = chunks + i;
+		if (chunk->isBinary) {
+			analyseBinary(chunk, partial);
+		} else {
+			analyseText(chunk, partial, &row);
+		}
+	}
+	binaryLog_freeRow(&row);
+	return NULL;
+}
+
+static void addChunk(struct chunk_t *chunk) {
+	static unsigned int capacity;
+	if (chunkCount == capacity) {
+		capacity = capacity ? capacity * 2 : 64;
+		chunks = realloc(chunks, capacity * sizeof(struct chunk_t));
+		if (!chunks) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	chunks[chunkCount++] = *chunk;
+}
+
+static void *mapFile(const char *fileName, size_t *length) {
+	*length = 0;
+	int fd = open(fileName, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	void *result = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		result = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (result == MAP_FAILED) {
+			result = NULL;
+		} else {
+			*length = st.st_size;
+		}
+	}
+	close(fd);
+	return result;
+}
+
+static void splitText(struct chunk_t *chunk) {
+	while (chunk->start < (long) chunk->length) {
+		long end = chunk->start + TEXT_CHUNK_SIZE;
+		if (end >= (long) chunk->length) {
+			end = chunk->length;
+		} else {
+			const char *eol = memchr(chunk->data + end, '\n', chunk->length - end);
+			end = eol ? eol - chunk->data + 1 : (long) chunk->length;
+		}
+		chunk->end = end;
+		addChunk(chunk);
+		chunk->start = end;
+	}
+}
+
+static void splitBinary(struct chunk_t *chunk) {
+	char indexName[strlen(chunk->fileName) + strlen(BINARY_LOG_INDEX_EXTENSION) + 1];
+	strcpy(indexName, chunk->fileName);
+	char *extension = strrchr(indexName, '.');
+	strcpy(extension ? extension : indexName + strlen(indexName), BINARY_LOG_INDEX_EXTENSION);
+	size_t indexLength;
+	const struct binaryLog_indexEntry_t *entries = mapFile(indexName, &indexLength);
+	size_t entryCount = indexLength / sizeof(struct binaryLog_indexEntry_t);
+	chunk->start = -1;
+	chunk->end = chunk->length;
+	if (!entryCount) {
+		addChunk(chunk);
+		return;
+	}
+	for (size_t i = 0; i < entryCount; i += BINARY_CHUNK_ENTRIES) {
+		unsigned char isLast = i + BINARY_CHUNK_ENTRIES >= entryCount;
+		const struct binaryLog_indexEntry_t *last = entries + (isLast ? entryCount - 1 : i + BINARY_CHUNK_ENTRIES - 1);
+		if ((!isLast && last->lastTimestamp < startTime) || entries[i].firstTimestamp > endTime) {
+			continue;
+		}
+		chunk->start = entries[i].offset;
+		// the last chunk includes any rows after the last index entry
+		chunk->end = isLast ? (long) chunk->length : (long) entries[i + BINARY_CHUNK_ENTRIES].offset;
+		addChunk(chunk);
+	}
+	munmap((void *) entries, indexLength);
+}
+
+static void printResults(struct partial_t *total) {
+	static const double scale[BINARY_LOG_SIGNAL_COUNT] = { 1000, 1000, 100 };
+	printf("cell   V min   mean    max     sd  shunting mean mA  T max   at\n");
+	for (unsigned short cell = 0; cell < total->cellCount; cell++) {
+		struct cellStats_t *cellStats = total->cells + cell;
+		struct signalStats_t *v = cellStats->signals + BINARY_LOG_SIGNAL_VOLTAGE;
+		struct signalStats_t *s = cellStats->signals + BINARY_LOG_SIGNAL_SHUNT_CURRENT;
+		struct signalStats_t *t = cellStats->signals + BINARY_LOG_SIGNAL_TEMPERATURE;
+		printf("%4d", cell);
+		if (v->count) {
+			double mean = (double) v->sum / v->count;
+			double variance = v->sumOfSquares / v->count - mean * mean;
+			printf(" %6.3f %6.3f %6.3f %6.3f", v->min / scale[0], mean / scale[0], v->max / scale[0],
+					sqrt(variance > 0 ? variance : 0) / scale[0]);
+		} else {
+			printf("      -      -      -      -");
+		}
+		if (s->count) {
+			printf("  %7.2f%% %7.1f", 100.0 * cellStats->shuntingCount / s->count, (double) s->sum / s->count);
+		} else {
+			printf("        -       -");
+		}
+		if (t->count) {
+			printf("  %5.1f %ld", t->max / scale[2], cellStats->maxTemperatureTimestamp);
+		} else {
+			printf("      -");
+		}
+		printf("\n");
+	}
+	printf("rows %lu from %ld to %ld, %lu unreadable\n", total->rows, total->firstTimestamp, total->lastTimestamp,
+			total->badRows);
+	if (total->endOfChargeRows) {
+		printf("end of charge (max cell >= %dmV) rows %lu, mean spread %.0fmV, max spread %dmV at %ld\n",
+				endOfChargeVoltage, total->endOfChargeRows, (double) total->spreadSum / total->endOfChargeRows,
+				total->maxSpread, total->maxSpreadTimestamp);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-j threads] [-c end of charge mV] [-s start] [-e end] log...\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "j:c:s:e:")) != -1) {
+		switch (opt) {
+		case 'j':
+			threadCount = atol(optarg);
+			break;
+		case 'c':
+			endOfChargeVoltage = atoi(optarg);
+			break;
+		case 's':
+			startTime = atol(optarg);
+			break;
+		case 'e':
+			endTime = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || threadCount < 1) {
+		usage(argv[0]);
+	}
+
+	size_t totalBytes = 0;
+	for (int i = optind; i < argc; i++) {
+		struct chunk_t chunk;
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.fileName = argv[i];
+		chunk.data = mapFile(argv[i], &chunk.length);
+		if (!chunk.data) {
+			perror(argv[i]);
+			continue;
+		}
+		totalBytes += chunk.length;
+		const char *extension = strrchr(argv[i], '.');
+		chunk.isBinary = extension && !strcmp(extension, BINARY_LOG_EXTENSION);
+		if (chunk.isBinary) {
+			splitBinary(&chunk);
+		} else {
+			splitText(&chunk);
+		}
+	}
+
+	struct timespec started;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	pthread_t threads[threadCount];
+	struct partial_t *partials = malloc(threadCount * sizeof(struct partial_t));
+	if (!partials) {
+		perror("malloc");
+		return 1;
+	}
+	for (long i = 0; i < threadCount; i++) {
+		initPartial(partials + i);
+		if (pthread_create(threads + i, NULL, workerMain, partials + i)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (long i = 0; i < threadCount; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (long i = 1; i < threadCount; i++) {
+		mergePartial(partials, partials + i);
+	}
+	struct timespec finished;
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	double elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+	printResults(partials);
+	fprintf(stderr, "%u chunks, %ld threads, %.3fs, %.0f rows/s, %.1f MB/s\n", chunkCount, threadCount, elapsed,
+			partials->rows / elapsed, totalBytes / elapsed / 1e6);
+	free(partials);
+	return 0;
+}
@@ -0,0 +1,337 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the size and write CPU time of the text and binary cell logs on a synthetic battery and check that every
+ * binary row reads back as the same text.
+ *
+ * Each sweep is published into the battery the way the CAN listeners do, then a row is made the way logger.c makes
+ * it, formatted or encoded into a buffer which is written when it can't hold another row. Only making and writing
+ * the rows is timed, with the monotonic clock as the bench is single threaded, and the fastest of PASSES is kept.
+ *
+ * logbench [cells] [rows]
+ */
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binaryLog.h"
+#include "config.h"
+#include "util.h"
+
+// as logger.c
+#define BUFFERED_ROWS 32
+#define PASSES 5
+
+// a cell's last published values and when they were heard, as logger.c keeps them
+struct cell_t {
+	char valued;
+	unsigned short values[BINARY_LOG_SIGNAL_COUNT];
+	time_t whenHeard[BINARY_LOG_SIGNAL_COUNT];
+};
+
+struct sweep_t {
+	time_t timestamp;
+	double soc[BINARY_LOG_SOC_COUNT];
+	struct cell_t *cells;
+};
+
+struct result_t {
+	long bytes;
+	double seconds;
+};
+
+static unsigned short cellCount;
+static long sweepCount;
+static time_t staleBefore = 1000;
+// the cells as published so far
+static struct cell_t *battery;
+
+static double secondsNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static long nextStep(long value, long step, long min, long max) {
+	value += rand() % (2 * step + 1) - step;
+	return value < min ? min : value > max ? max : value;
+}
+
+/**
+ * A battery being charged, one sweep every two seconds. Voltages wander a few mV, cells over 3.45V shunt,
+ * temperatures change by a tenth of a degree now and then and now and again a cell doesn't answer.
+ */
+static struct sweep_t *makeSweeps() {
+	struct sweep_t *sweeps = calloc(sweepCount, sizeof(struct sweep_t));
+	if (!sweeps) {
+		return NULL;
+	}
+	srand(1);
+	for (long i = 0; i < sweepCount; i++) {
+		struct sweep_t *sweep = sweeps + i;
+		struct sweep_t *previous = i ? sweeps + i - 1 : NULL;
+		sweep->cells = malloc(cellCount * sizeof(struct cell_t));
+		if (!sweep->cells) {
+			return NULL;
+		}
+		sweep->timestamp = 1370000000 + i * 2;
+		for (int j = 0; j < BINARY_LOG_SOC_COUNT; j++) {
+			sweep->soc[j] = (previous ? nextStep(lround(previous->soc[j] * 100), 5, -20000, 20000) : 1000 * j) / 100.0;
+		}
+		for (unsigned short j = 0; j < cellCount; j++) {
+			struct cell_t *cell = sweep->cells + j;
+			struct cell_t *previousCell = previous ? previous->cells + j : NULL;
+			unsigned short voltage = previous ?
+					nextStep(previousCell->values[BINARY_LOG_SIGNAL_VOLTAGE], 2, 3000, 3600) : 3300 + rand() % 100;
+			cell->values[BINARY_LOG_SIGNAL_VOLTAGE] = voltage;
+			cell->values[BINARY_LOG_SIGNAL_SHUNT_CURRENT] = voltage > 3450 ? 500 + rand() % 3 : 0;
+			cell->values[BINARY_LOG_SIGNAL_TEMPERATURE] = previous ?
+					nextStep(previousCell->values[BINARY_LOG_SIGNAL_TEMPERATURE], rand() % 10 == 0 ? 10 : 0, 0, 6000)
+					: 2500 + rand() % 200;
+			cell->valued = (1 << BINARY_LOG_SIGNAL_COUNT) - 1;
+			time_t whenHeard = rand() % 500 ? staleBefore : staleBefore - 1;
+			for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+				cell->whenHeard[signal] = whenHeard;
+			}
+		}
+	}
+	return sweeps;
+}
+
+/** What the listeners in logger.c do as each value arrives, the binary logger also keeps the values in its row */
+static void publish(const struct sweep_t *sweep, struct binaryLog_row_t *row) {
+	memcpy(battery, sweep->cells, cellCount * sizeof(struct cell_t));
+	if (row) {
+		for (unsigned short i = 0; i < cellCount; i++) {
+			for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+				row->values[signal][i] = battery[i].values[signal];
+			}
+		}
+	}
+}
+
+static char isCurrent(const struct cell_t *cell, int signal) {
+	return (cell->valued & (1 << signal)) && cell->whenHeard[signal] >= staleBefore;
+}
+
+/** As appendFixed() in logger.c */
+static unsigned int appendFixed(char *buf, unsigned short value, char isValid, unsigned char scale,
+		unsigned char decimals) {
+	char *p = buf;
+	*p++ = ' ';
+	if (isValid) {
+		p += formatFixed(p, value, scale, decimals, 0);
+	} else {
+		*p++ = '-';
+	}
+	return p - buf;
+}
+
+/** As writeTextLine() in logger.c */
+static unsigned int formatText(char *buf, const struct sweep_t *sweep) {
+	const double *soc = sweep->soc;
+	unsigned int length = sprintf(buf, "%d %.1f %.2f %.2f %.2f %.2f %.1f %.1f %.1f", (int) sweep->timestamp, soc[0],
+			soc[1], soc[2], soc[3], soc[4], soc[5], soc[6], soc[7]);
+	for (unsigned short i = 0; i < cellCount; i++) {
+		const struct cell_t *cell = battery + i;
+		length += appendFixed(buf + length, cell->values[BINARY_LOG_SIGNAL_VOLTAGE],
+				isCurrent(cell, BINARY_LOG_SIGNAL_VOLTAGE), 3, 3);
+		length += appendFixed(buf + length, cell->values[BINARY_LOG_SIGNAL_SHUNT_CURRENT],
+				isCurrent(cell, BINARY_LOG_SIGNAL_SHUNT_CURRENT), 3, 3);
+		length += appendFixed(buf + length, cell->values[BINARY_LOG_SIGNAL_TEMPERATURE],
+				isCurrent(cell, BINARY_LOG_SIGNAL_TEMPERATURE), 2, 1);
+	}
+	buf[length++] = '\n';
+	return length;
+}
+
+/** As currentBits() in logger.c */
+static unsigned char currentBits(unsigned short first, unsigned short count, int signal) {
+	const struct cell_t *cell = battery + first;
+	unsigned char result = 0;
+	for (unsigned short i = 0; i < count; i++, cell++) {
+		result |= (((cell->valued >> signal) & 1) && cell->whenHeard[signal] >= staleBefore) << i;
+	}
+	return result;
+}
+
+/** As writeBinaryRow() in logger.c */
+static unsigned int encodeBinary(struct binaryLog_writer_t *writer, struct binaryLog_row_t *row,
+		const struct sweep_t *sweep, unsigned char *buf, unsigned int length) {
+	row->timestamp = sweep->timestamp;
+	for (int i = 0; i < BINARY_LOG_SOC_COUNT; i++) {
+		row->soc[i] = lround(sweep->soc[i] * 100);
+	}
+	for (unsigned short first = 0; first < cellCount; first += 8) {
+		unsigned short count = cellCount - first < 8 ? cellCount - first : 8;
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			row->valid[signal][first / 8] = currentBits(first, count, signal);
+		}
+	}
+	return binaryLog_encodeRow(writer, row, buf, length);
+}
+
+/**
+ * Write a row for every sweep, in text if row is NULL
+ *
+ * @return 0 if successful
+ */
+static int writePass(FILE *out, const struct sweep_t *sweeps, struct binaryLog_row_t *row, double *seconds) {
+	struct binaryLog_writer_t *writer = NULL;
+	// the longest text value is " 65.535"
+	unsigned int maxRowLength = 128 + cellCount * BINARY_LOG_SIGNAL_COUNT * 7;
+	rewind(out);
+	if (row) {
+		writer = binaryLog_openWriter(out, "bench", cellCount);
+		if (!writer) {
+			return 1;
+		}
+		maxRowLength = binaryLog_maxRowLength(writer);
+	}
+	unsigned int capacity = BUFFERED_ROWS * maxRowLength;
+	char *buf = malloc(capacity);
+	if (!buf) {
+		return 1;
+	}
+	unsigned int length = 0;
+	*seconds = 0;
+	for (long i = 0; i < sweepCount; i++) {
+		publish(sweeps + i, row);
+		double start = secondsNow();
+		if (length + maxRowLength > capacity) {
+			if (fwrite(buf, 1, length, out) != length) {
+				return 1;
+			}
+			length = 0;
+		}
+		length += row ? encodeBinary(writer, row, sweeps + i, (unsigned char *) buf + length, capacity - length)
+				: formatText(buf + length, sweeps + i);
+		*seconds += secondsNow() - start;
+	}
+	double start = secondsNow();
+	if (fwrite(buf, 1, length, out) != length || fflush(out)) {
+		return 1;
+	}
+	*seconds += secondsNow() - start;
+	binaryLog_closeWriter(writer);
+	free(buf);
+	return 0;
+}
+
+static int write(FILE *out, const struct sweep_t *sweeps, struct binaryLog_row_t *row, struct result_t *result) {
+	for (int pass = 0; pass < PASSES; pass++) {
+		double seconds;
+		if (writePass(out, sweeps, row, &seconds)) {
+			return 1;
+		}
+		if (pass == 0 || seconds < result->seconds) {
+			result->seconds = seconds;
+		}
+	}
+	result->bytes = ftell(out);
+	return 0;
+}
+
+/** @return the number of rows that don't read back as the text we wrote */
+static long checkBinary(FILE *binary, FILE *text) {
+	rewind(binary);
+	rewind(text);
+	struct binaryLog_reader_t *reader = binaryLog_openReader(binary);
+	if (!reader) {
+		return sweepCount;
+	}
+	char *decoded = NULL;
+	size_t decodedLength = 0;
+	FILE *decodedOut = open_memstream(&decoded, &decodedLength);
+	char *expected = NULL;
+	size_t expectedLength = 0;
+	long mismatches = 0;
+	long rows = 0;
+	const struct binaryLog_row_t *row;
+	while ((row = binaryLog_readRow(reader))) {
+		rewind(decodedOut);
+		binaryLog_printText(decodedOut, row, binaryLog_getCellCount(reader));
+		fputc(0, decodedOut);
+		fflush(decodedOut);
+		if (getline(&expected, &expectedLength, text) == -1 || strcmp(expected, decoded)) {
+			mismatches++;
+		}
+		rows++;
+	}
+	binaryLog_closeReader(reader);
+	fclose(decodedOut);
+	free(decoded);
+	free(expected);
+	return mismatches + (sweepCount - rows);
+}
+
+static void report(const char *name, struct result_t *result) {
+	printf("%-6s %10ld bytes %8.1f bytes/row %8.2fus/row\n", name, result->bytes, (double) result->bytes / sweepCount,
+			result->seconds * 1e6 / sweepCount);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: logbench [cells 1-%d] [rows]\n", MAX_CELLS);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	char *end;
+	long cells = argc > 1 ? strtol(argv[1], &end, 10) : 96;
+	if (argc > 3 || (argc > 1 && (*end || cells < 1 || cells > MAX_CELLS))) {
+		usage();
+	}
+	sweepCount = argc > 2 ? strtol(argv[2], &end, 10) : 10000;
+	if (argc > 2 && (*end || sweepCount < 1)) {
+		usage();
+	}
+	cellCount = cells;
+	struct sweep_t *sweeps = makeSweeps();
+	struct binaryLog_row_t row;
+	battery = malloc(cellCount * sizeof(struct cell_t));
+	FILE *text = tmpfile();
+	FILE *binary = tmpfile();
+	if (!sweeps || !battery || binaryLog_allocRow(&row, cellCount) || !text || !binary) {
+		perror("logbench");
+		return 1;
+	}
+	struct result_t textResult;
+	struct result_t binaryResult;
+	if (write(text, sweeps, NULL, &textResult) || write(binary, sweeps, &row, &binaryResult)) {
+		perror("writing");
+		return 1;
+	}
+	long mismatches = checkBinary(binary, text);
+	if (mismatches) {
+		fprintf(stderr, "%ld rows read back differently\n", mismatches);
+		return 1;
+	}
+	printf("%d cells, %ld rows, all rows read back\n", cellCount, sweepCount);
+	report("text", &textResult);
+	report("binary", &binaryResult);
+	printf("binary is %.1fx smaller and %.1fx less CPU\n", (double) textResult.bytes / binaryResult.bytes,
+			textResult.seconds / binaryResult.seconds);
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Convert cell logs between the text format and the binary format described in binaryLog.h.
+ *
+ * logconvert [-n name] battery.txt battery.bin   convert a text log to binary
+ * logconvert -t battery.bin battery.txt          convert a binary log back to text, '-' writes to stdout
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <math.h>
+
+#include "binaryLog.h"
+#include "config.h"
+
+#define SOC_COLUMNS (1 + BINARY_LOG_SOC_COUNT)
+#define MAX_COLUMNS (SOC_COLUMNS + BINARY_LOG_SIGNAL_COUNT * MAX_CELLS)
+
+static const int signalScale[BINARY_LOG_SIGNAL_COUNT] = { 1000, 1000, 100 };
+
+static int textToBinary(FILE *in, FILE *out, const char *name) {
+	struct binaryLog_writer_t *writer = NULL;
+	struct binaryLog_row_t row;
+	unsigned short cellCount = 0;
+	unsigned char newSession = 1;
+	char *line = NULL;
+	size_t lineLength = 0;
+	char **columns = malloc(MAX_COLUMNS * sizeof(char *));
+	long rows = 0;
+	if (!columns) {
+		return 1;
+	}
+	memset(&row, 0, sizeof(row));
+	while (getline(&line, &lineLength, in) != -1) {
+		int columnCount = 0;
+		for (char *token = strtok(line, " \n"); token && columnCount < MAX_COLUMNS; token = strtok(NULL, " \n")) {
+			columns[columnCount++] = token;
+		}
+		if (columnCount == 0) {
+			// the logger writes an empty line each time it starts
+			newSession = 1;
+			continue;
+		}
+		if (columnCount < SOC_COLUMNS || (columnCount - SOC_COLUMNS) % BINARY_LOG_SIGNAL_COUNT != 0) {
+			fprintf(stderr, "skipping line %ld with %d columns\n", rows + 1, columnCount);
+			continue;
+		}
+		unsigned short lineCellCount = (columnCount - SOC_COLUMNS) / BINARY_LOG_SIGNAL_COUNT;
+		if (newSession || lineCellCount != cellCount) {
+			binaryLog_closeWriter(writer);
+			binaryLog_freeRow(&row);
+			cellCount = lineCellCount;
+			writer = binaryLog_openWriter(out, name, cellCount);
+			if (!writer || binaryLog_allocRow(&row, cellCount)) {
+				perror("writing header");
+				return 1;
+			}
+			newSession = 0;
+		}
+		row.timestamp = atol(columns[0]);
+		for (int i = 0; i < BINARY_LOG_SOC_COUNT; i++) {
+			row.soc[i] = lround(atof(columns[1 + i]) * 100);
+		}
+		for (unsigned short cell = 0; cell < cellCount; cell++) {
+			for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+				char *column = columns[SOC_COLUMNS + cell * BINARY_LOG_SIGNAL_COUNT + signal];
+				unsigned char isValid = strcmp(column, "-") != 0;
+				row.values[signal][cell] = isValid ? (unsigned short) lround(atof(column) * signalScale[signal]) : 0;
+				binaryLog_setValid(&row, signal, cell, isValid);
+			}
+		}
+		if (binaryLog_writeRow(writer, &row)) {
+			perror("writing row");
+			return 1;
+		}
+		rows++;
+	}
+	binaryLog_closeWriter(writer);
+	binaryLog_freeRow(&row);
+	free(columns);
+	free(line);
+	fprintf(stderr, "converted %ld rows\n", rows);
+	return 0;
+}
+
+static int binaryToText(FILE *in, FILE *out) {
+	struct binaryLog_reader_t *reader = binaryLog_openReader(in);
+	if (!reader) {
+		return 1;
+	}
+	const struct binaryLog_row_t *row;
+	long rows = 0;
+	while ((row = binaryLog_readRow(reader))) {
+		if (binaryLog_isNewSession(reader)) {
+			fprintf(out, "\n");
+		}
+		binaryLog_printText(out, row, binaryLog_getCellCount(reader));
+		rows++;
+	}
+	int result = !feof(in);
+	if (result) {
+		fprintf(stderr, "stopped at corrupt row %ld\n", rows + 1);
+	}
+	binaryLog_closeReader(reader);
+	fprintf(stderr, "converted %ld rows\n", rows);
+	return result;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-t] [-n battery name] in out\n", name);
+	fprintf(stderr, "  -t convert binary to text, otherwise text is converted to binary\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned char toText = 0;
+	char *name = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "tn:")) != -1) {
+		switch (opt) {
+		case 't':
+			toText = 1;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+	}
+	char *inName = argv[optind];
+	char *outName = argv[optind + 1];
+	if (!name) {
+		// battery name is the file name without the extension
+		name = basename(strdup(inName));
+		char *dot = strrchr(name, '.');
+		if (dot) {
+			*dot = 0;
+		}
+	}
+
+	FILE *in = fopen(inName, "r");
+	if (!in) {
+		perror(inName);
+		return 1;
+	}
+	FILE *out = strcmp(outName, "-") ? fopen(outName, toText ? "w" : "wb") : stdout;
+	if (!out) {
+		perror(outName);
+		return 1;
+	}
+	int result = toText ? binaryToText(in, out) : textToBinary(in, out, name);
+	fclose(in);
+	if (fclose(out)) {
+		perror(outName);
+		return 1;
+	}
+	return result;
+}
@@ -17,14 +17,22 @@
  along with the Tumanako EVD5 BMS.  If not, see
  <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
 #include <libgen.h>
 #include <time.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <pthread.h>
 
@@ -32,11 +40,57 @@
 #include "util.h"
 #include "canEventListener.h"
 #include "logger.h"
+#include "binaryLog.h"
+#include "trace.h"
+
+// room for this many rows in each buffer before rows are dropped
+#define BUFFERED_ROWS 32
+
+// the bit in valued and index into whenHeard of each value we log
+#define LOGGED_VOLTAGE 0
+#define LOGGED_SHUNT_CURRENT 1
+#define LOGGED_TEMPERATURE 2
+#define LOGGED_SIGNAL_COUNT 3
+
+/*
+ * Rows are formatted into the active buffer on the CAN listener thread, the writer thread swaps the buffers and
+ * writes the full one so the listeners never wait for the disk.
+ */
+struct logger_buffer_t {
+	char *data;
+	unsigned int length;
+	unsigned int rowCount;
+	// completed index entries for the binary log
+	struct binaryLog_indexEntry_t *entries;
+	unsigned int entryCount;
+	// if >= 0 a new segment starts at this offset in data, with the index entry rotateEntry and the row rotateRow
+	int rotateAt;
+	unsigned int rotateEntry;
+	unsigned int rotateRow;
+	time_t rotateTimestamp;
+};
 
 struct logger_battery_t {
 	FILE *out;
+	// NULL if we are writing text
+	struct binaryLog_writer_t *binaryOut;
+	FILE *indexOut;
+	// the writer couldn't open the last segment, the next row starts another for it to try again
+	unsigned char needsSegment;
+	// where the next row will be in the current segment and the run of rows since the last keyframe
+	unsigned long long segmentOffset;
+	struct binaryLog_indexEntry_t block;
+	struct binaryLog_row_t row;
 	time_t whenLastLogged;
+	// monotonic seconds when the last sweep completed and values heard before staleBefore are out of date
+	time_t whenLastSweep;
+	time_t staleBefore;
 	struct logger_status_t *cells;
+	struct logger_buffer_t buffers[2];
+	unsigned char active;
+	unsigned int capacity;
+	unsigned int maxRowLength;
+	unsigned long droppedRows;
 };
 
 struct logger_status_t {
@@ -46,23 +100,71 @@ struct logger_status_t {
 	unsigned short shuntCurrent;
 	unsigned short minCurrent;
 	unsigned short temperature;
+	// monotonic seconds each value was last published
+	time_t whenHeard[LOGGED_SIGNAL_COUNT];
 };
 
 static void voltageListener(unsigned char batteryId, unsigned short cellIndex, unsigned char isValid, unsigned short voltage);
 static void shuntCurrentListener(unsigned char batteryId, unsigned short cellIndex, unsigned short shuntCurrent);
 static void temperatureListener(unsigned char batteryId, unsigned short cellIndex, unsigned short temperature);
-void *logger_backgroundThread(void *ptr);
+static void sweepCompleteListener(unsigned char batteryId, unsigned short failedCount, unsigned short sentCount,
+		unsigned short suppressedCount);
+static void *writerThreadMain(void *ptr);
 void logger_writeLogLine(unsigned char i);
-void logMilli(FILE *out, unsigned short value, char isValid);
+static void writeTextLine(struct logger_battery_t *loggerBattery, unsigned short cellCount, time_t now);
+static void writeBinaryRow(unsigned char batteryIndex, unsigned short cellCount, time_t now);
+static void closeBlock(struct logger_battery_t *loggerBattery, struct logger_buffer_t *buffer);
+static void logMilli(struct logger_buffer_t *buffer, unsigned short value, char isValid);
+static int openSegment(unsigned char batteryIndex, time_t timestamp);
 int countCellsWithData(struct logger_status_t cells[], short cellCount);
 
-static pthread_t thread;
+static time_t monotonicNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* LOGGED_* are in the same order as BINARY_LOG_SIGNAL_* so the value can go straight into the binary row */
+static void markHeard(struct logger_battery_t *loggerBattery, unsigned short cellIndex, int signal,
+		unsigned short value) {
+	struct logger_status_t *cell = loggerBattery->cells + cellIndex;
+	cell->valued |= 1 << signal;
+	cell->whenHeard[signal] = monotonicNow();
+	if (loggerBattery->binaryOut) {
+		loggerBattery->row.values[signal][cellIndex] = value;
+	}
+}
+
+/*
+ * A cell that is still answering republishes each value at least every publishRefreshInterval seconds, so a value
+ * that should have been refreshed during the sweep but wasn't belongs to a cell we aren't hearing from any more
+ */
+static char isCurrent(const struct logger_battery_t *loggerBattery, const struct logger_status_t *cell, int signal) {
+	return (cell->valued & (1 << signal)) && cell->whenHeard[signal] >= loggerBattery->staleBefore;
+}
+
+/* The validity bitmap byte for count (at most 8) cells from first */
+static unsigned char currentBits(const struct logger_battery_t *loggerBattery, unsigned short first,
+		unsigned short count, int signal) {
+	const struct logger_status_t *cell = loggerBattery->cells + first;
+	unsigned char result = 0;
+	for (unsigned short i = 0; i < count; i++, cell++) {
+		result |= (((cell->valued >> signal) & 1) && cell->whenHeard[signal] >= loggerBattery->staleBefore) << i;
+	}
+	return result;
+}
+
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a buffer is more than half full
+static pthread_cond_t commitCondition = PTHREAD_COND_INITIALIZER;
+static pthread_t writerThread;
 static struct config_t *config;
 static struct logger_battery_t *loggerBatteries;
+static unsigned char isBinary;
 
 unsigned char logger_init(struct config_t *_config) {
 	config = _config;
+	isBinary = strcmp(config->logFormat, "text") != 0;
 	loggerBatteries = calloc(config->batteryCount, sizeof(struct logger_battery_t));
 	if (!loggerBatteries) {
 		goto error;
@@ -79,54 +181,147 @@ unsigned char logger_init(struct config_t *_config) {
 			(cells + i)->index = j;
 			(cells + i)->valued = 0;
 		}
-		char *filename = malloc(strlen(configBattery->name) + strlen(".txt") + 1);
-		if (!filename) {
-			goto error;
+		if (isBinary) {
+			if (binaryLog_allocRow(&loggerBattery->row, configBattery->cellCount)) {
+				goto error;
+			}
+			loggerBattery->binaryOut = binaryLog_openWriter(NULL, configBattery->name, configBattery->cellCount);
+			if (!loggerBattery->binaryOut || openSegment(i, time(NULL))) {
+				goto error;
+			}
+			loggerBattery->maxRowLength = binaryLog_maxRowLength(loggerBattery->binaryOut);
+			loggerBattery->segmentOffset = binaryLog_headerLength(configBattery->name);
+		} else {
+			char *filename = malloc(strlen(configBattery->name) + strlen(".txt") + 1);
+			if (!filename) {
+				goto error;
+			}
+			strcpy(filename, config->batteries[i].name);
+			strcat(filename, ".txt");
+			loggerBattery->out = fopen(filename, "a");
+			free(filename);
+			if (!loggerBattery->out) {
+				goto error;
+			}
+			fprintf(loggerBattery->out, "\n");
+			fflush(loggerBattery->out);
+			// " 65.535 65.535 655.4" per cell plus the SOC values
+			loggerBattery->maxRowLength = configBattery->cellCount * 21 + 256;
 		}
-		strcpy(filename, config->batteries[i].name);
-		strcat(filename, ".txt");
-		loggerBattery->out = fopen(filename, "a");
-		free(filename);
-		if (!loggerBattery->out) {
-			goto error;
+		loggerBattery->capacity = loggerBattery->maxRowLength * BUFFERED_ROWS;
+		for (int j = 0; j < 2; j++) {
+			struct logger_buffer_t *buffer = loggerBattery->buffers + j;
+			buffer->data = malloc(loggerBattery->capacity);
+			// at most one entry per row, plus the one closed when rotating
+			buffer->entries = malloc((BUFFERED_ROWS + 1) * sizeof(struct binaryLog_indexEntry_t));
+			buffer->rotateAt = -1;
+			if (!buffer->data || !buffer->entries) {
+				goto error;
+			}
 		}
-		fprintf(loggerBattery->out, "\n");
-		fflush(loggerBattery->out);
 	}
-	pthread_create(&thread, NULL, logger_backgroundThread, (void *) "unused");
+	if (pthread_create(&writerThread, NULL, writerThreadMain, NULL)) {
+		goto error;
+	}
 	canEventListener_registerVoltageListener(voltageListener);
 	canEventListener_registerShuntCurrentListener(shuntCurrentListener);
 	canEventListener_registerTemperatureListener(temperatureListener);
+	canEventListener_registerSweepCompleteListener(sweepCompleteListener);
 	return 0;
 error:
 	// todo cleanup
 	return 1;
 }
 
-void *logger_backgroundThread(void *unused __attribute__ ((unused))) {
-	while (1) {
-		sleep(1);
-		for (unsigned char i = 0; i < config->batteryCount; i++) {
-			logger_writeLogLine(i);
+/**
+ * Open <battery>-<timestamp>.bin and its index and write the header, called on startup and from the writer thread
+ * when the segment is full.
+ *
+ * @return 0 if successful
+ */
+static int openSegment(unsigned char batteryIndex, time_t timestamp) {
+	struct logger_battery_t *loggerBattery = loggerBatteries + batteryIndex;
+	struct config_battery_t *configBattery = config->batteries + batteryIndex;
+	char filename[strlen(configBattery->name) + 32];
+	if (loggerBattery->out) {
+		fclose(loggerBattery->out);
+		loggerBattery->out = NULL;
+	}
+	if (loggerBattery->indexOut) {
+		fclose(loggerBattery->indexOut);
+		loggerBattery->indexOut = NULL;
+	}
+	// index offsets are from the start of the segment so never append to an existing one
+	int fd = -1;
+	for (; fd == -1; timestamp++) {
+		snprintf(filename, sizeof(filename), "%s-%010ld%s", configBattery->name, (long) timestamp,
+				BINARY_LOG_EXTENSION);
+		fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd == -1 && errno != EEXIST) {
+			perror(filename);
+			return 1;
 		}
 	}
-	return NULL;
+	loggerBattery->out = fdopen(fd, "w");
+	strcpy(filename + strlen(filename) - strlen(BINARY_LOG_EXTENSION), BINARY_LOG_INDEX_EXTENSION);
+	loggerBattery->indexOut = fopen(filename, "w");
+	if (!loggerBattery->out || !loggerBattery->indexOut) {
+		perror(filename);
+		goto error;
+	}
+	if (!binaryLog_writeHeader(loggerBattery->out, configBattery->name, configBattery->cellCount)
+			|| fflush(loggerBattery->out)) {
+		perror("writing header");
+		goto error;
+	}
+	return 0;
+error:
+	// rows mustn't go into a segment without its header
+	if (loggerBattery->out) {
+		fclose(loggerBattery->out);
+		loggerBattery->out = NULL;
+	} else if (fd != -1) {
+		close(fd);
+	}
+	if (loggerBattery->indexOut) {
+		fclose(loggerBattery->indexOut);
+		loggerBattery->indexOut = NULL;
+	}
+	return 1;
 }
 
-static void logCenti(FILE *out, unsigned short value, char isValid) {
+static void appendf(struct logger_buffer_t *buffer, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	// rows are only started if there is room for the longest row so this can't overflow
+	buffer->length += vsprintf(buffer->data + buffer->length, format, args);
+	va_end(args);
+}
+
+/** Append " -" or the value with the given scale and decimals, the same as appendf(" %.<decimals>f") */
+static void appendFixed(struct logger_buffer_t *buffer, unsigned short value, char isValid, unsigned char scale,
+		unsigned char decimals) {
+	char *p = buffer->data + buffer->length;
+	*p++ = ' ';
 	if (isValid) {
-		fprintf(out, " %.1f", centiToDouble(value));
+		p += formatFixed(p, value, scale, decimals, 0);
 	} else {
-		fprintf(out, " -");
+		*p++ = '-';
 	}
+	buffer->length = p - buffer->data;
+}
+
+static void logCenti(struct logger_buffer_t *buffer, unsigned short value, char isValid) {
+	appendFixed(buffer, value, isValid, 2, 1);
 }
 
 /*
- * Write a line to the log if:
- * The appropriate amount of time has passed (so we don't log too quickly)
- * (All the data has been refreshed since the last line was written
- * or
- * the timeout has expired and we log a line with incomplete data)
+ * Add a line to the log, called at the end of each pass over the battery. Cells are only published when they
+ * change so a cell keeps its last value until it is replaced, cells we have no valid value for or that have stopped
+ * answering are logged as '-'.
+ *
+ * The line is only buffered, it is written by the writer thread. If the writer has fallen so far behind that there is
+ * no room the line is dropped.
  */
 void logger_writeLogLine(unsigned char i) {
 	pthread_mutex_lock(&mutex);
@@ -134,87 +329,276 @@ void logger_writeLogLine(unsigned char i) {
 	struct config_battery_t *configBattery = config->batteries + i;
 	time_t now;
 	time(&now);
-	if (now - loggerBattery->whenLastLogged < 1) {
-		// we wrote a line recently, wait some more
+	// anything due a refresh by the start of this sweep should have been heard during it, allow a second for rounding
+	time_t sweepEnd = monotonicNow();
+	if (loggerBattery->whenLastSweep) {
+		loggerBattery->staleBefore = loggerBattery->whenLastSweep - config->publishRefreshInterval - 1;
+	}
+	loggerBattery->whenLastSweep = sweepEnd;
+	if (countCellsWithData(loggerBattery->cells, configBattery->cellCount) == 0) {
+		// we haven't had any data, make sure we don't log anything until we do
 		pthread_mutex_unlock(&mutex);
 		return;
 	}
-	int thisCount = countCellsWithData(loggerBattery->cells, configBattery->cellCount);
-	if (thisCount != configBattery->cellCount) {
-		// no data from at least one cell since we last wrote a line
-		if (thisCount == 0) {
-			// we haven't had any data, make sure we don't log anything until we do
-			loggerBattery->whenLastLogged = now;
-			pthread_mutex_unlock(&mutex);
-			return;
-		}
-		// todo, this is too long during motoring, but expected during charging with
-		// non kelvin connected transistor shunts. Either choose a short delay for
-		// motoring or make the transistor shunts faster
-		if (now - loggerBattery->whenLastLogged < 120) {
-			// we had complete data less than 2 minutes ago, wait some more
-			pthread_mutex_unlock(&mutex);
-			return;
+
+	struct logger_buffer_t *buffer = loggerBattery->buffers + loggerBattery->active;
+	if (buffer->length + loggerBattery->maxRowLength > loggerBattery->capacity) {
+		loggerBattery->droppedRows++;
+		if (isBinary) {
+			// the next row can't be a delta against one the reader never sees
+			binaryLog_forceKeyframe(loggerBattery->binaryOut);
 		}
+	} else if (isBinary) {
+		writeBinaryRow(i, configBattery->cellCount, now);
+	} else {
+		writeTextLine(loggerBattery, configBattery->cellCount, now);
 	}
-
-	fprintf(loggerBattery->out, "%d %.1f %.2f %.2f %.2f %.2f %.1f %.1f %.1f", (int) now, soc_getCurrent(), soc_getAh(),
-			soc_getVoltage(), soc_getHalfVoltage(), soc_getWh(), soc_getT1(), soc_getT2(), soc_getSpeed());
-	for (int i = 0; i < configBattery->cellCount; i++) {
-		struct logger_status_t *cell = loggerBattery->cells + i;
-		logMilli(loggerBattery->out, cell->voltage, cell->valued & 0x01);
-		logMilli(loggerBattery->out, cell->shuntCurrent, cell->valued & 0x02);
-		logCenti(loggerBattery->out, cell->temperature, cell->valued & 0x04);
-		cell->valued = 0;
+	if (buffer->length > loggerBattery->capacity / 2) {
+		pthread_cond_signal(&commitCondition);
 	}
-	fprintf(loggerBattery->out, "\n");
-	fflush(loggerBattery->out);
 	loggerBattery->whenLastLogged = now;
 	pthread_mutex_unlock(&mutex);
 }
 
+static void writeTextLine(struct logger_battery_t *loggerBattery, unsigned short cellCount, time_t now) {
+	struct logger_buffer_t *buffer = loggerBattery->buffers + loggerBattery->active;
+	struct soc_snapshot_t soc;
+	soc_getSnapshot(&soc);
+	appendf(buffer, "%d %.1f %.2f %.2f %.2f %.2f %.1f %.1f %.1f", (int) now, soc.current, soc.ah, soc.voltage,
+			soc.halfVoltage, soc.wh, soc.t1, soc.t2, soc.speed);
+	for (int i = 0; i < cellCount; i++) {
+		struct logger_status_t *cell = loggerBattery->cells + i;
+		logMilli(buffer, cell->voltage, isCurrent(loggerBattery, cell, LOGGED_VOLTAGE));
+		logMilli(buffer, cell->shuntCurrent, isCurrent(loggerBattery, cell, LOGGED_SHUNT_CURRENT));
+		logCenti(buffer, cell->temperature, isCurrent(loggerBattery, cell, LOGGED_TEMPERATURE));
+	}
+	appendf(buffer, "\n");
+	buffer->rowCount++;
+}
+
+static void writeBinaryRow(unsigned char batteryIndex, unsigned short cellCount, time_t now) {
+	struct logger_battery_t *loggerBattery = loggerBatteries + batteryIndex;
+	struct binaryLog_row_t *row = &loggerBattery->row;
+	row->timestamp = now;
+	struct soc_snapshot_t soc;
+	soc_getSnapshot(&soc);
+	row->soc[BINARY_LOG_SOC_CURRENT] = lround(soc.current * 100);
+	row->soc[BINARY_LOG_SOC_AH] = lround(soc.ah * 100);
+	row->soc[BINARY_LOG_SOC_VOLTAGE] = lround(soc.voltage * 100);
+	row->soc[BINARY_LOG_SOC_HALF_VOLTAGE] = lround(soc.halfVoltage * 100);
+	row->soc[BINARY_LOG_SOC_WH] = lround(soc.wh * 100);
+	row->soc[BINARY_LOG_SOC_T1] = lround(soc.t1 * 100);
+	row->soc[BINARY_LOG_SOC_T2] = lround(soc.t2 * 100);
+	row->soc[BINARY_LOG_SOC_SPEED] = lround(soc.speed * 100);
+	// the listeners keep the values in the row, only which of them are current changes here
+	for (unsigned short first = 0; first < cellCount; first += 8) {
+		unsigned short count = cellCount - first < 8 ? cellCount - first : 8;
+		row->valid[BINARY_LOG_SIGNAL_VOLTAGE][first / 8] = currentBits(loggerBattery, first, count, LOGGED_VOLTAGE);
+		row->valid[BINARY_LOG_SIGNAL_SHUNT_CURRENT][first / 8] = currentBits(loggerBattery, first, count,
+				LOGGED_SHUNT_CURRENT);
+		row->valid[BINARY_LOG_SIGNAL_TEMPERATURE][first / 8] = currentBits(loggerBattery, first, count,
+				LOGGED_TEMPERATURE);
+	}
+	struct logger_buffer_t *buffer = loggerBattery->buffers + loggerBattery->active;
+	if ((loggerBattery->segmentOffset >= config->logSegmentSize * 1024ULL * 1024 || loggerBattery->needsSegment)
+			&& buffer->rotateAt < 0) {
+		closeBlock(loggerBattery, buffer);
+		loggerBattery->needsSegment = 0;
+		buffer->rotateAt = buffer->length;
+		buffer->rotateEntry = buffer->entryCount;
+		buffer->rotateRow = buffer->rowCount;
+		buffer->rotateTimestamp = now;
+		loggerBattery->segmentOffset = binaryLog_headerLength(config->batteries[batteryIndex].name);
+		binaryLog_forceKeyframe(loggerBattery->binaryOut);
+	}
+	unsigned int length = binaryLog_encodeRow(loggerBattery->binaryOut, row,
+			(unsigned char *) buffer->data + buffer->length, loggerBattery->capacity - buffer->length);
+	if (!length) {
+		return;
+	}
+	struct binaryLog_indexEntry_t *block = &loggerBattery->block;
+	if (binaryLog_wasKeyframe(loggerBattery->binaryOut)) {
+		closeBlock(loggerBattery, buffer);
+		block->firstTimestamp = now;
+		block->offset = loggerBattery->segmentOffset;
+		block->minVoltage = block->maxVoltage = row->soc[BINARY_LOG_SOC_VOLTAGE];
+		block->minCurrent = block->maxCurrent = row->soc[BINARY_LOG_SOC_CURRENT];
+	}
+	block->lastTimestamp = now;
+	block->rowCount++;
+	block->minVoltage = MIN(block->minVoltage, row->soc[BINARY_LOG_SOC_VOLTAGE]);
+	block->maxVoltage = MAX(block->maxVoltage, row->soc[BINARY_LOG_SOC_VOLTAGE]);
+	block->minCurrent = MIN(block->minCurrent, row->soc[BINARY_LOG_SOC_CURRENT]);
+	block->maxCurrent = MAX(block->maxCurrent, row->soc[BINARY_LOG_SOC_CURRENT]);
+	loggerBattery->segmentOffset += length;
+	buffer->length += length;
+	buffer->rowCount++;
+}
+
+/* Queue the index entry for the run of rows since the last keyframe */
+static void closeBlock(struct logger_battery_t *loggerBattery, struct logger_buffer_t *buffer) {
+	if (loggerBattery->block.rowCount) {
+		buffer->entries[buffer->entryCount++] = loggerBattery->block;
+		memset(&loggerBattery->block, 0, sizeof(struct binaryLog_indexEntry_t));
+	}
+}
+
 int countCellsWithData(struct logger_status_t cells[], short cellCount) {
 	int result = 0;
 	for (unsigned short i = 0; i < cellCount; i++) {
-		if ((cells[i].valued & 0x01) && (cells[i].valued & 0x2)) {
+		if ((cells[i].valued & (1 << LOGGED_VOLTAGE)) && (cells[i].valued & (1 << LOGGED_SHUNT_CURRENT))) {
 			result++;
 		}
 	}
 	return result;
 }
 
-void logMilli(FILE *out, unsigned short value, char isValid) {
-	if (isValid) {
-		fprintf(out, " %.3f", milliToDouble(value));
-	} else {
-		fprintf(out, " -");
+static void logMilli(struct logger_buffer_t *buffer, unsigned short value, char isValid) {
+	appendFixed(buffer, value, isValid, 3, 3);
+}
+
+static void writeBuffer(struct logger_battery_t *loggerBattery, struct logger_buffer_t *buffer, unsigned int start,
+		unsigned int end, unsigned int startEntry, unsigned int endEntry) {
+	if (!loggerBattery->out) {
+		return;
+	}
+	if (end > start && (fwrite(buffer->data + start, 1, end - start, loggerBattery->out) != end - start
+			|| fflush(loggerBattery->out))) {
+		perror("writing log");
 	}
+	// entries go after the rows they point at so the index never refers past the end of the segment
+	if (loggerBattery->indexOut && endEntry > startEntry
+			&& (fwrite(buffer->entries + startEntry, sizeof(struct binaryLog_indexEntry_t), endEntry - startEntry,
+					loggerBattery->indexOut) != endEntry - startEntry || fflush(loggerBattery->indexOut))) {
+		perror("writing log index");
+	}
+}
+
+static void syncFiles(struct logger_battery_t *loggerBattery) {
+	if (loggerBattery->out) {
+		fdatasync(fileno(loggerBattery->out));
+	}
+	if (loggerBattery->indexOut) {
+		fdatasync(fileno(loggerBattery->indexOut));
+	}
+}
+
+static unsigned char isBufferHalfFull() {
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		if (loggerBatteries[i].buffers[loggerBatteries[i].active].length > loggerBatteries[i].capacity / 2) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Group commit, every logCommitInterval ms (or sooner if a buffer is filling up) swap the buffers and write out
+ * everything logged since the last commit with a single write per battery. fdatasync every logSyncInterval seconds.
+ */
+static void *writerThreadMain(void *ptr __attribute__ ((unused))) {
+	time_t lastSync = time(NULL);
+	unsigned long reportedDroppedRows[config->batteryCount];
+	memset(reportedDroppedRows, 0, sizeof(reportedDroppedRows));
+	while (1) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		long long deadlineMicros = now.tv_sec * 1000000LL + now.tv_usec + config->logCommitInterval * 1000LL;
+		struct timespec deadline = { deadlineMicros / 1000000, (deadlineMicros % 1000000) * 1000 };
+
+		pthread_mutex_lock(&mutex);
+		while (!isBufferHalfFull()) {
+			if (pthread_cond_timedwait(&commitCondition, &mutex, &deadline)) {
+				break;
+			}
+		}
+		unsigned long droppedRows[config->batteryCount];
+		for (unsigned char i = 0; i < config->batteryCount; i++) {
+			loggerBatteries[i].active = !loggerBatteries[i].active;
+			droppedRows[i] = loggerBatteries[i].droppedRows;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		unsigned char shouldSync = config->logSyncInterval && time(NULL) - lastSync >= config->logSyncInterval;
+		for (unsigned char i = 0; i < config->batteryCount; i++) {
+			struct logger_battery_t *loggerBattery = loggerBatteries + i;
+			struct logger_buffer_t *buffer = loggerBattery->buffers + !loggerBattery->active;
+			// rows with no segment to go in, the segment they belong to couldn't be opened
+			unsigned int lostRows = 0;
+			if (buffer->rotateAt >= 0) {
+				lostRows += loggerBattery->out ? 0 : buffer->rotateRow;
+				writeBuffer(loggerBattery, buffer, 0, buffer->rotateAt, 0, buffer->rotateEntry);
+				if (shouldSync) {
+					syncFiles(loggerBattery);
+				}
+				if (openSegment(i, buffer->rotateTimestamp)) {
+					lostRows += buffer->rowCount - buffer->rotateRow;
+				} else {
+					writeBuffer(loggerBattery, buffer, buffer->rotateAt, buffer->length, buffer->rotateEntry,
+							buffer->entryCount);
+				}
+				buffer->rotateAt = -1;
+			} else {
+				lostRows += loggerBattery->out ? 0 : buffer->rowCount;
+				writeBuffer(loggerBattery, buffer, 0, buffer->length, 0, buffer->entryCount);
+			}
+			buffer->length = buffer->entryCount = buffer->rowCount = 0;
+			if (lostRows || (isBinary && !loggerBattery->out)) {
+				pthread_mutex_lock(&mutex);
+				loggerBattery->droppedRows += lostRows;
+				// start another segment with the next row so we try to open it again on the next commit
+				loggerBattery->needsSegment = isBinary && !loggerBattery->out;
+				pthread_mutex_unlock(&mutex);
+			}
+			if (shouldSync) {
+				syncFiles(loggerBattery);
+			}
+			if (droppedRows[i] != reportedDroppedRows[i]) {
+				fprintf(stderr, "%s: dropped %lu log rows, writing is too slow or failing\n",
+						config->batteries[i].name, droppedRows[i] - reportedDroppedRows[i]);
+				reportedDroppedRows[i] = droppedRows[i];
+			}
+		}
+		if (shouldSync) {
+			lastSync = time(NULL);
+		}
+	}
+	return NULL;
 }
 
 static void voltageListener(unsigned char batteryId, unsigned short cellIndex, unsigned char isValid, unsigned short voltage) {
-	fprintf(stderr, "v %d %d %d %d\n", batteryId, cellIndex, isValid, voltage);
-	if (!isValid) {
-		return;
+	TRACE_DEBUG(TRACE_LOGGER, "v %d %d %d %d", batteryId, cellIndex, isValid, voltage);
+	struct logger_battery_t *loggerBattery = loggerBatteries + batteryId;
+	struct logger_status_t *cells = loggerBattery->cells;
+	pthread_mutex_lock(&mutex);
+	if (isValid) {
+		cells[cellIndex].voltage = voltage;
+		markHeard(loggerBattery, cellIndex, LOGGED_VOLTAGE, voltage);
+	} else {
+		cells[cellIndex].valued &= ~(1 << LOGGED_VOLTAGE);
 	}
-	struct logger_status_t *cells = (loggerBatteries + batteryId)->cells;
-	cells[cellIndex].voltage = voltage;
-	cells[cellIndex].valued |= 0x01;
-	logger_writeLogLine(batteryId);
+	pthread_mutex_unlock(&mutex);
 }
 
 static void shuntCurrentListener(unsigned char batteryId, unsigned short cellIndex, unsigned short shuntCurrent) {
-	fprintf(stderr, "s %d %d %d\n", batteryId, cellIndex, shuntCurrent);
-	struct logger_status_t *cells = (loggerBatteries + batteryId)->cells;
-	cells[cellIndex].shuntCurrent = shuntCurrent;
-	cells[cellIndex].valued |= 0x02;
-	logger_writeLogLine(batteryId);
+	TRACE_DEBUG(TRACE_LOGGER, "s %d %d %d", batteryId, cellIndex, shuntCurrent);
+	struct logger_battery_t *loggerBattery = loggerBatteries + batteryId;
+	pthread_mutex_lock(&mutex);
+	loggerBattery->cells[cellIndex].shuntCurrent = shuntCurrent;
+	markHeard(loggerBattery, cellIndex, LOGGED_SHUNT_CURRENT, shuntCurrent);
+	pthread_mutex_unlock(&mutex);
 }
 
 static void temperatureListener(unsigned char batteryId, unsigned short cellIndex, unsigned short temperature) {
-	fprintf(stderr, "t %d %d %d\n", batteryId, cellIndex, temperature);
-	struct logger_status_t *cells = (loggerBatteries + batteryId)->cells;
-	cells[cellIndex].temperature = temperature;
-	cells[cellIndex].valued |= 0x04;
-	logger_writeLogLine(batteryId);
+	TRACE_DEBUG(TRACE_LOGGER, "t %d %d %d", batteryId, cellIndex, temperature);
+	struct logger_battery_t *loggerBattery = loggerBatteries + batteryId;
+	pthread_mutex_lock(&mutex);
+	loggerBattery->cells[cellIndex].temperature = temperature;
+	markHeard(loggerBattery, cellIndex, LOGGED_TEMPERATURE, temperature);
+	pthread_mutex_unlock(&mutex);
 }
 
+static void sweepCompleteListener(unsigned char batteryId, unsigned short failedCount __attribute__ ((unused)),
+		unsigned short sentCount __attribute__ ((unused)), unsigned short suppressedCount __attribute__ ((unused))) {
+	logger_writeLogLine(batteryId);
+}
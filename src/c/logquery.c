@@ -0,0 +1,300 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Query binary log segments using their indexes.
+ *
+ * logquery [-s start] [-e end] battery-*.bin      print the rows between start and end (unix time) as text
+ * logquery [-s start] [-e end] -a battery-*.bin   per cell min/max/mean of each signal between start and end
+ * logquery -l battery-*.bin                       list the segments with their pack voltage and current ranges
+ *
+ * Segments are mapped and only the rows from the index entry before start are decoded.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "binaryLog.h"
+
+struct segment_t {
+	const char *fileName;
+	unsigned char *data;
+	size_t length;
+	const struct binaryLog_indexEntry_t *entries;
+	size_t entryCount;
+};
+
+struct cellStats_t {
+	unsigned short min[BINARY_LOG_SIGNAL_COUNT];
+	unsigned short max[BINARY_LOG_SIGNAL_COUNT];
+	unsigned long long sum[BINARY_LOG_SIGNAL_COUNT];
+	unsigned long count[BINARY_LOG_SIGNAL_COUNT];
+};
+
+static long start = LONG_MIN;
+static long end = LONG_MAX;
+static struct cellStats_t *cellStats;
+static unsigned short statsCellCount;
+static unsigned long rowsDecoded;
+static unsigned long rowsMatched;
+
+static void *mapFile(const char *fileName, size_t *length) {
+	*length = 0;
+	int fd = open(fileName, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	void *result = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		result = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (result == MAP_FAILED) {
+			result = NULL;
+		} else {
+			*length = st.st_size;
+		}
+	}
+	close(fd);
+	return result;
+}
+
+static int loadSegment(const char *fileName, struct segment_t *segment) {
+	segment->fileName = fileName;
+	segment->data = mapFile(fileName, &segment->length);
+	if (!segment->data) {
+		perror(fileName);
+		return 1;
+	}
+	char indexName[strlen(fileName) + strlen(BINARY_LOG_INDEX_EXTENSION) + 1];
+	strcpy(indexName, fileName);
+	char *extension = strrchr(indexName, '.');
+	strcpy(extension ? extension : indexName + strlen(indexName), BINARY_LOG_INDEX_EXTENSION);
+	size_t indexLength;
+	segment->entries = mapFile(indexName, &indexLength);
+	// a partially written entry at the end is ignored
+	segment->entryCount = indexLength / sizeof(struct binaryLog_indexEntry_t);
+	return 0;
+}
+
+static int compareSegments(const void *a, const void *b) {
+	return strcmp(((const struct segment_t *) a)->fileName, ((const struct segment_t *) b)->fileName);
+}
+
+static void listSegment(struct segment_t *segment) {
+	if (!segment->entryCount) {
+		printf("%s %zu bytes, not indexed\n", segment->fileName, segment->length);
+		return;
+	}
+	struct binaryLog_indexEntry_t summary = segment->entries[0];
+	for (size_t i = 1; i < segment->entryCount; i++) {
+		const struct binaryLog_indexEntry_t *entry = segment->entries + i;
+		summary.lastTimestamp = entry->lastTimestamp;
+		summary.rowCount += entry->rowCount;
+		summary.minVoltage = entry->minVoltage < summary.minVoltage ? entry->minVoltage : summary.minVoltage;
+		summary.maxVoltage = entry->maxVoltage > summary.maxVoltage ? entry->maxVoltage : summary.maxVoltage;
+		summary.minCurrent = entry->minCurrent < summary.minCurrent ? entry->minCurrent : summary.minCurrent;
+		summary.maxCurrent = entry->maxCurrent > summary.maxCurrent ? entry->maxCurrent : summary.maxCurrent;
+	}
+	printf("%s %lld-%lld %u rows %.2f-%.2fV %.2f-%.2fA\n", segment->fileName, (long long) summary.firstTimestamp,
+			(long long) summary.lastTimestamp, summary.rowCount, summary.minVoltage / 100.0,
+			summary.maxVoltage / 100.0, summary.minCurrent / 100.0, summary.maxCurrent / 100.0);
+}
+
+/** @return the offset of the keyframe to start decoding from, -1 to decode from the start */
+static long findStart(struct segment_t *segment) {
+	if (!segment->entryCount) {
+		return -1;
+	}
+	// the first run that ends at or after start
+	size_t low = 0;
+	size_t high = segment->entryCount;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (segment->entries[mid].lastTimestamp < start) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == segment->entryCount) {
+		// everything indexed is before start but there may be an unindexed run at the end
+		low = segment->entryCount - 1;
+	}
+	return segment->entries[low].offset;
+}
+
+static void addToStats(const struct binaryLog_row_t *row, unsigned short cellCount) {
+	if (cellCount > statsCellCount) {
+		cellStats = realloc(cellStats, cellCount * sizeof(struct cellStats_t));
+		if (!cellStats) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(cellStats + statsCellCount, 0, (cellCount - statsCellCount) * sizeof(struct cellStats_t));
+		statsCellCount = cellCount;
+	}
+	for (unsigned short cell = 0; cell < cellCount; cell++) {
+		struct cellStats_t *stats = cellStats + cell;
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			if (!BINARY_LOG_IS_VALID(row, signal, cell)) {
+				continue;
+			}
+			unsigned short value = row->values[signal][cell];
+			if (!stats->count[signal] || value < stats->min[signal]) {
+				stats->min[signal] = value;
+			}
+			if (!stats->count[signal] || value > stats->max[signal]) {
+				stats->max[signal] = value;
+			}
+			stats->sum[signal] += value;
+			stats->count[signal]++;
+		}
+	}
+}
+
+static void printStats() {
+	static const double scale[BINARY_LOG_SIGNAL_COUNT] = { 1000, 1000, 100 };
+	printf("cell V min max mean I min max mean T min max mean\n");
+	for (unsigned short cell = 0; cell < statsCellCount; cell++) {
+		struct cellStats_t *stats = cellStats + cell;
+		printf("%d", cell);
+		for (int signal = 0; signal < BINARY_LOG_SIGNAL_COUNT; signal++) {
+			if (stats->count[signal]) {
+				printf(" %.3f %.3f %.3f", stats->min[signal] / scale[signal], stats->max[signal] / scale[signal],
+						stats->sum[signal] / scale[signal] / stats->count[signal]);
+			} else {
+				printf(" - - -");
+			}
+		}
+		printf("\n");
+	}
+}
+
+/** @return 1 if we have gone past end and there is no need to look at later segments */
+static int querySegment(struct segment_t *segment, unsigned char aggregate) {
+	FILE *in = fmemopen(segment->data, segment->length, "r");
+	if (!in) {
+		perror(segment->fileName);
+		return 0;
+	}
+	struct binaryLog_reader_t *reader = binaryLog_openReader(in);
+	long offset = findStart(segment);
+	int result = 0;
+	if (reader && (offset < 0 || !binaryLog_seek(reader, offset))) {
+		const struct binaryLog_row_t *row;
+		while ((row = binaryLog_readRow(reader))) {
+			rowsDecoded++;
+			if (row->timestamp < start) {
+				continue;
+			}
+			if (row->timestamp > end) {
+				result = 1;
+				break;
+			}
+			rowsMatched++;
+			if (aggregate) {
+				addToStats(row, binaryLog_getCellCount(reader));
+			} else {
+				binaryLog_printText(stdout, row, binaryLog_getCellCount(reader));
+			}
+		}
+	} else {
+		fprintf(stderr, "%s: could not read from offset %ld\n", segment->fileName, offset);
+	}
+	binaryLog_closeReader(reader);
+	fclose(in);
+	return result;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-s start] [-e end] [-a | -l] segment.bin...\n", name);
+	fprintf(stderr, "  -a per cell min/max/mean instead of the rows\n");
+	fprintf(stderr, "  -l list the segments\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned char aggregate = 0;
+	unsigned char list = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:e:al")) != -1) {
+		switch (opt) {
+		case 's':
+			start = atol(optarg);
+			break;
+		case 'e':
+			end = atol(optarg);
+			break;
+		case 'a':
+			aggregate = 1;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	int segmentCount = argc - optind;
+	if (segmentCount < 1) {
+		usage(argv[0]);
+	}
+	struct segment_t segments[segmentCount];
+	for (int i = 0; i < segmentCount; i++) {
+		if (loadSegment(argv[optind + i], segments + i)) {
+			return 1;
+		}
+	}
+	// segment names end with the time of their first row
+	qsort(segments, segmentCount, sizeof(struct segment_t), compareSegments);
+
+	for (int i = 0; i < segmentCount; i++) {
+		struct segment_t *segment = segments + i;
+		if (list) {
+			listSegment(segment);
+			continue;
+		}
+		if (segment->entryCount && segment->entries[0].firstTimestamp > end) {
+			break;
+		}
+		struct segment_t *next = i + 1 < segmentCount ? segment + 1 : NULL;
+		if (next && next->entryCount && next->entries[0].firstTimestamp < start) {
+			// the whole of this segment is before the next one starts
+			continue;
+		}
+		if (querySegment(segment, aggregate)) {
+			break;
+		}
+	}
+	if (aggregate) {
+		printStats();
+	}
+	if (!list) {
+		fprintf(stderr, "%lu rows matched, %lu decoded\n", rowsMatched, rowsDecoded);
+	}
+	return 0;
+}
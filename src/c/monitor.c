@@ -27,6 +27,7 @@
 #include <strings.h>
 #include <string.h>
 #include <unistd.h>
+#include <math.h>
 #include <confuse.h>
 
 #include "monitor.h"
@@ -38,12 +39,19 @@
 #include "canEventListener.h"
 #include "buscontrol.h"
 #include "soc.h"
+#include "packAggregates.h"
+#include "snapshot.h"
+#include "cellHistory.h"
+#include "cellSoc.h"
+#include "cellResistance.h"
 #include "monitor_can.h"
 #include "logger.h"
 #include "console.h"
 #include "serial.h"
 #include "util.h"
 #include "hiResLogger.h"
+#include "trace.h"
+#include "monitorStats.h"
 
 #define _POSIX_SOURCE 1 /* POSIX compliant source */
 #define FALSE 0
@@ -158,7 +166,10 @@ char _getCellSummary(struct status_t *status, int maxAttempts) {
 		} else if (status->version == 4) {
 			decodeSummary4(buf, status);
 		}
+		chargeAlgorithm_checkCellVoltage(status->battery->batteryIndex, status->cellIndex, status->vCell,
+				monitorStats_now());
 		status->latency = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+		status->received = end;
 		monitorCan_sendLatency(status->battery->batteryIndex, status->cellIndex, status->latency / 1000);
 		break;
 	}
@@ -172,7 +183,9 @@ char getCellSummary(struct status_t *cell) {
 			return FALSE;
 		}
 	}
+	long long start = monitorStats_now();
 	char success = _getCellSummary(cell, 2);
+	monitorStats_recordTransaction("summary", cell, start);
 	if (!success) {
 		cell->errorCount++;
 		monitorCan_sendError(cell->battery->batteryIndex, cell->cellIndex, cell->errorCount);
@@ -284,6 +297,69 @@ void testCellShunts() {
 	}
 }
 
+/** Tell everyone which phase of the loop we are in and start timing it */
+static void enterState(monitor_state_t state, __u16 delay, __u8 loopsUntilVoltage) {
+	monitorStats_enterPhase(state);
+	monitorCan_sendMonitorState(state, delay, loopsUntilVoltage);
+	snapshot_publishState(state);
+}
+
+static void publishResistances(struct battery_t *battery) {
+	for (unsigned short i = 0; i < battery->cellCount; i++) {
+		struct cellResistance_estimate_t estimate;
+		if (!cellResistance_get(battery->batteryIndex, i, &estimate)) {
+			long microOhms = lround(estimate.resistance * 1e6);
+			monitorCan_publishResistance(battery->batteryIndex, i, microOhms > 0xffff ? 0xffff : microOhms);
+		}
+	}
+}
+
+/** Step the SOC estimate of every cell by the charge that went through the pack since the last sweep */
+static void estimateSoc() {
+	static long long lastTime;
+	static double lastCharge;
+	struct soc_snapshot_t soc;
+	soc_getSnapshot(&soc);
+	long long now = monitorStats_now();
+	double seconds = lastTime ? (now - lastTime) / 1e6 : 0;
+	double charge = soc.charge - lastCharge;
+	lastTime = now;
+	lastCharge = soc.charge;
+	if (soc_getError()) {
+		// without the EVision we don't know what the cells did since the last sweep
+		return;
+	}
+	for (unsigned char i = 0; i < data.batteryCount; i++) {
+		struct battery_t *battery = data.batteries + i;
+		if (i == 0) {
+			// we don't monitor accessory battery current
+			cellSoc_update(i, &battery->store, 0, 0, seconds);
+		} else {
+			cellSoc_update(i, &battery->store, soc.current, charge, seconds);
+		}
+	}
+}
+
+static void publishSnapshot() {
+	struct soc_snapshot_t latest;
+	soc_getSnapshot(&latest);
+	struct snapshot_soc_t soc;
+	memset(&soc, 0, sizeof(soc));
+	soc.voltage = latest.voltage;
+	soc.current = latest.current;
+	soc.ah = latest.ah;
+	soc.wh = latest.wh;
+	soc.t1 = latest.t1;
+	soc.t2 = latest.t2;
+	soc.speed = latest.speed;
+	soc.error = soc_getError();
+	soc.integratedAh = latest.integratedAh;
+	soc.integratedWh = latest.integratedWh;
+	soc.ahCorrection = latest.ahCorrection;
+	soc.whCorrection = latest.whCorrection;
+	snapshot_publish(&data, &soc);
+}
+
 int main(int argc, char *argv[]) {
 	// TODO move tests somewhere better
 	testIsCellVoltageRelevant();
@@ -295,6 +371,27 @@ int main(int argc, char *argv[]) {
 	}
 	initData(config);
 
+	if (trace_init(config)) {
+		return 1;
+	}
+
+	monitorStats_init(config);
+
+	if (snapshot_init(config, &data)) {
+		// it only feeds dashboards, charge control mustn't depend on it
+		fprintf(stderr, "carrying on without the snapshot\n");
+	}
+
+	if (cellHistory_init(config)) {
+		return 1;
+	}
+	if (cellSoc_init(config)) {
+		return 1;
+	}
+	if (cellResistance_init(config)) {
+		return 1;
+	}
+
 	if (argc == 2) {
 		if (strcmp("-c", argv[1]) == 0) {
 			isCharging = TRUE;
@@ -305,15 +402,19 @@ int main(int argc, char *argv[]) {
 
 	canEventListener_init(config);
 
+	if (packAggregates_init(config)) {
+		return 1;
+	}
+
 	if (buscontrol_init()) {
 		return 1;
 	}
 
-	if (soc_init()) {
+	if (soc_init(config)) {
 		return 1;
 	}
 
-	if (monitorCan_init()) {
+	if (monitorCan_init(config)) {
 		return 1;
 	}
 
@@ -334,7 +435,7 @@ int main(int argc, char *argv[]) {
 		chargeAlgorithm_init(config);
 	}
 
-	hiResLogger_init();
+	hiResLogger_init(config);
 
 	buscontrol_setBus(TRUE);
 
@@ -365,11 +466,11 @@ int main(int argc, char *argv[]) {
 	time_t whenLastOver1A = 0;
 	time_t last = 0;
 	for (int count = 0; TRUE; count++) {
-		monitorCan_sendMonitorState(START, 0, count % 5);
+		enterState(START, 0, count % 5);
 		time_t t;
 		time(&t);
 		while (t < last + config->loopDelay) {
-			monitorCan_sendMonitorState(SLEEPING, (last + config->loopDelay) - t, count % 5);
+			enterState(SLEEPING, (last + config->loopDelay) - t, count % 5);
 			sleep(1);
 			if (!isCharging && soc_getCurrent() > 0.5) {
 				// more than 0.5A discharge, must be driving
@@ -392,7 +493,7 @@ int main(int argc, char *argv[]) {
 		}
 		last = t;
 		if (config->loopDelay > 30) {
-			monitorCan_sendMonitorState(WAKE_SLAVE, 0, count % 5);
+			enterState(WAKE_SLAVE, 0, count % 5);
 			// if the slaves have gone to sleep, send some characters to wake them up
 			writeWithEscape('a');
 			// wait for slaves to wake up and take a measurement
@@ -402,31 +503,31 @@ int main(int argc, char *argv[]) {
 		// if necessary, turn off shunts and read the voltage
 		shuntPause = turnOffNonKelvinResistorShunts();
 		if (count % 5 == 0) {
-			monitorCan_sendMonitorState(TURN_OFF_NON_KELVIN_TRANSISTOR, 0, count % 5);
+			enterState(TURN_OFF_NON_KELVIN_TRANSISTOR, 0, count % 5);
 			shuntPause = turnOffNonKelvinTransistorShunts() || shuntPause;
 		}
 		if (shuntPause) {
 			// give cells time to read their real voltage
-			monitorCan_sendMonitorState(WAIT_FOR_VOLTAGE_READING, 0, count % 5);
+			enterState(WAIT_FOR_VOLTAGE_READING, 0, count % 5);
 			sleep(2);
 		}
-		monitorCan_sendMonitorState(READ_VOLTAGE, 0, count % 5);
+		enterState(READ_VOLTAGE, 0, count % 5);
 		getCellStates();
 
 		// turn (back) on any shunts that are needed
 		shuntPause = FALSE;
 		unsigned char shuntValueChanged = FALSE;
 		for (unsigned char i = 0; i < data.batteryCount; i++) {
-			monitorCan_sendMonitorState(TURN_ON_SHUNTS, i, count % 5);
+			enterState(TURN_ON_SHUNTS, i, count % 5);
 			shuntValueChanged |= setShuntCurrent(config, &data.batteries[i]);
 		}
 		// if we turned on any shunts, read the shunt current
 		if (shuntValueChanged) {
 			// give cells a chance re-read
-			monitorCan_sendMonitorState(WAIT_FOR_SHUNT_CURRENT, 0, count % 5);
+			enterState(WAIT_FOR_SHUNT_CURRENT, 0, count % 5);
 			sleep(2);
 			// read the current
-			monitorCan_sendMonitorState(READ_CURRENT, 0, count % 5);
+			enterState(READ_CURRENT, 0, count % 5);
 			getCellStates();
 		}
 	}
@@ -435,25 +536,50 @@ int main(int argc, char *argv[]) {
 void getCellStates() {
 	// move to the top of the screen
 	write(1, "\E[H", 3);
+	uint32_t now = cellHistory_now();
 	for (unsigned char i = 0; i < data.batteryCount; i++) {
 		struct battery_t *battery = data.batteries + i;
+		unsigned short failedCount = 0;
+		cellStore_beginSweep(&battery->store);
 		for (unsigned short j = 0; j < battery->cellCount; j++) {
 			struct status_t *cell = battery->cells + j;
 			char success = getCellSummary(cell);
 			cell->isDataCurrent = success;
 			if (!success) {
+				// like the cell itself the store keeps the last reading we got
+				failedCount++;
 				continue;
 			}
-			montiorCan_sendCellVoltage(i, j, !isCellShunting(cell), cell->vCell);
+			cellStore_update(&battery->store, j, cell->vCell, cell->iShunt, cell->temperature,
+					cell->hasTemperatureSensor);
+			if (isCellShunting(cell)) {
+				// the voltage isn't read while shunting, it is the one from before and mustn't be measured again
+				cellStore_clearFlags(&battery->store, j, CELL_STORE_FRESH);
+			}
+			cellHistory_record(i, j, CELL_HISTORY_VOLTAGE, now, cell->vCell);
+			cellHistory_record(i, j, CELL_HISTORY_SHUNT_CURRENT, now, cell->iShunt);
+			if (cell->hasTemperatureSensor) {
+				cellHistory_record(i, j, CELL_HISTORY_TEMPERATURE, now, cell->temperature);
+			}
+			// the accessory battery doesn't carry the pack current and a shunting cell's voltage isn't read
+			if (i != 0 && !isCellShunting(cell)) {
+				cellResistance_record(i, j, cell->vCell, &cell->received);
+			}
+			monitorCan_publishCellVoltage(i, j, !isCellShunting(cell), cell->vCell);
 			if (!shuntPause) {
-				monitorCan_sendShuntCurrent(i, j, cell->iShunt);
-				monitorCan_sendMinCurrent(i, j, cell->minCurrent);
+				monitorCan_publishShuntCurrent(i, j, cell->iShunt);
+				monitorCan_publishMinCurrent(i, j, cell->minCurrent);
 			}
 			if (cell->hasTemperatureSensor) {
-				monitorCan_sendTemperature(i, j, cell->temperature);
+				monitorCan_publishTemperature(i, j, cell->temperature);
 			}
 		}
+		cellResistance_process();
+		publishResistances(battery);
+		monitorCan_publishSweepComplete(i, failedCount);
 	}
+	estimateSoc();
+	publishSnapshot();
 }
 
 char getCellState(struct status_t *cell) {
@@ -505,6 +631,8 @@ char _getCellState(struct status_t *status, int maxAttempts) {
 			continue;
 		}
 		decodeBinStatus(buf, status);
+		chargeAlgorithm_checkCellVoltage(status->battery->batteryIndex, status->cellIndex, status->vCell,
+				monitorStats_now());
 		status->latency = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
 		break;
 	}
@@ -580,20 +708,16 @@ unsigned char turnOffAllShunts() {
 }
 
 unsigned short getMaxTemperature(struct battery_t *battery) {
-	unsigned short result = 0;
-	for (unsigned short i = 0; i < battery->cellCount; i++) {
-		struct status_t *cell = battery->cells + i;
-		if (cell->hasTemperatureSensor) {
-			if (cell->temperature > result) {
-				result = cell->temperature;
-			}
-		}
-	}
-	return result;
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	return stats.maxTemperature;
 }
 
 unsigned char setShuntCurrent(struct config_t *config, struct battery_t *battery) {
-	unsigned short maxTemperature = getMaxTemperature(battery);
+	// one pass for everything we need from the pack
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	unsigned short maxTemperature = stats.maxTemperature;
 	unsigned short maxShuntCurrent;
 	if (maxTemperature < 3000) {
 		maxShuntCurrent = 450;
@@ -608,7 +732,7 @@ unsigned char setShuntCurrent(struct config_t *config, struct battery_t *battery
 	} else {
 		maxShuntCurrent = 0;
 	}
-	unsigned short min = minVoltage(battery);
+	unsigned short min = stats.minVoltage;
 	unsigned char changed = FALSE;
 	for (unsigned short i = 0; i < battery->cellCount; i++) {
 		struct status_t *cell = battery->cells + i;
@@ -648,8 +772,10 @@ unsigned char setMinCurrent(struct status_t *cell, unsigned short minCurrent) {
 		return FALSE;
 	}
 	cell->targetShuntCurrent = minCurrent;
+	long long start = monitorStats_now();
 	for (int i = 0; i < 20; i++) {
 		if (cell->minCurrent == minCurrent) {
+			monitorStats_recordTransaction("shunt", cell, start);
 			return TRUE;
 		}
 		if (minCurrent != 0 && (minCurrent < 150 || minCurrent > 450)) {
@@ -669,25 +795,15 @@ unsigned char setMinCurrent(struct status_t *cell, unsigned short minCurrent) {
 }
 
 unsigned short minVoltage(struct battery_t *battery) {
-	unsigned short result = 0xffff;
-	for (unsigned short i = 0; i < battery->cellCount; i++) {
-		if (battery->cells[i].vCell < result) {
-			result = battery->cells[i].vCell;
-		}
-	}
-	return result;
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	return stats.minVoltage;
 }
 
 unsigned short minVoltageCell(struct battery_t *battery) {
-	unsigned short min = 0xffff;
-	unsigned short result = 0;
-	for (unsigned short i = 0; i < battery->cellCount; i++) {
-		if (battery->cells[i].vCell < min) {
-			min = battery->cells[i].vCell;
-			result = i;
-		}
-	}
-	return result;
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	return stats.minVoltageCell;
 }
 
 unsigned short maxVoltageInAnyBattery() {
@@ -702,33 +818,21 @@ unsigned short maxVoltageInAnyBattery() {
 }
 
 unsigned short maxVoltage(struct battery_t *battery) {
-	unsigned short result = 0;
-	for (unsigned short i = 0; i < battery->cellCount; i++) {
-		if (battery->cells[i].vCell > result) {
-			result = battery->cells[i].vCell;
-		}
-	}
-	return result;
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	return stats.maxVoltage;
 }
 
 unsigned short maxVoltageCell(struct battery_t *battery) {
-	unsigned short max = 0;
-	unsigned short result = 0;
-	for (unsigned short i = 0; i < battery->cellCount; i++) {
-		if (battery->cells[i].vCell > max) {
-			max = battery->cells[i].vCell;
-			result = i;
-		}
-	}
-	return result;
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	return stats.maxVoltageCell;
 }
 
 unsigned int totalVoltage(struct battery_t *battery) {
-	int result = 0;
-	for (unsigned short i = 0; i < battery->cellCount; i++) {
-		result += battery->cells[i].vCell;
-	}
-	return result;
+	struct cellStore_stats_t stats;
+	cellStore_getStats(&battery->store, &stats);
+	return stats.totalVoltage;
 }
 
 unsigned short avgVoltage(struct battery_t *battery) {
@@ -858,8 +962,10 @@ unsigned char _getCellVersion(struct status_t *cell) {
  * @return true if version information was successfully obtained
  */
 unsigned char getCellVersion(struct status_t *cell) {
+	long long start = monitorStats_now();
 	for (int i = 0; i < 3; i++) {
 		if (_getCellVersion(cell)) {
+			monitorStats_recordTransaction("version", cell, start);
 			return TRUE;
 		}
 		cell->errorCount++;
@@ -907,6 +1013,10 @@ void initData(struct config_t *config) {
 		battery->name = config->batteries[j].name;
 		battery->cellCount = config->batteries[j].cellCount;
 		battery->cells = calloc(sizeof(struct status_t), battery->cellCount);
+		if (cellStore_init(&battery->store, battery->cellCount)) {
+			fprintf(stderr, "couldn't allocate the cell store for %s\n", battery->name);
+			exit(1);
+		}
 		for (unsigned short k = 0; k < battery->cellCount; k++) {
 			struct status_t *cell = battery->cells + k;
 			cell->cellIndex = k;
@@ -21,6 +21,10 @@
 #ifndef TUMANAKO_MONITOR_H_
 #define TUMANAKO_MONITOR_H_
 
+#include <sys/time.h>
+
+#include "cellStore.h"
+
 struct status_t {
 	struct battery_t *battery;
 	unsigned short cellIndex;
@@ -46,6 +50,8 @@ struct status_t {
 	unsigned short targetShuntCurrent;
 	// microseconds required to acquire last reading
 	unsigned long latency;
+	// when the last summary was received, from gettimeofday()
+	struct timeval received;
 	char version;
 	unsigned char isKelvinConnection;
 	unsigned char isResistorShunt;
@@ -64,6 +70,8 @@ struct battery_t {
 	const char *name;
 	unsigned short cellCount;
 	struct status_t *cells;
+	// the latest reading from each cell, for the pack statistics
+	struct cellStore_t store;
 };
 
 struct monitor_t {
@@ -83,6 +91,8 @@ typedef enum {
 	READ_CURRENT,
 } monitor_state_t;
 
+#define MONITOR_STATE_COUNT (READ_CURRENT + 1)
+
 typedef enum {
 	MONITOR_MODE_DRIVING,
 	MONITOR_MODE_CHARGING,
@@ -0,0 +1,224 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "util.h"
+#include "histogram.h"
+#include "monitorStats.h"
+
+// the Chrome trace threads phases and transactions are shown on
+#define PHASE_TID 1
+#define TRANSACTION_TID 2
+
+static struct histogram_t phases[MONITOR_STATE_COUNT];
+static struct histogram_t transactions[MONITOR_STATE_COUNT];
+static struct histogram_t sweeps;
+static struct histogram_t trips;
+
+static monitor_state_t currentPhase;
+static long long phaseStart = -1;
+static long long sweepStart = -1;
+static long long startedAt;
+
+static FILE *traceFile;
+static int listenFd = -1;
+static pthread_t statsThread;
+// the histograms are recorded on the monitor thread and reported on the stats thread
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+long long monitorStats_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void traceEvent(const char *name, const char *category, int tid, long long start, long long duration) {
+	if (!traceFile) {
+		return;
+	}
+	fprintf(traceFile, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld},\n",
+			name, category, tid, start - startedAt, duration);
+}
+
+void monitorStats_enterPhase(monitor_state_t state) {
+	long long now = monitorStats_now();
+	if (phaseStart != -1 && state == currentPhase) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	if (phaseStart != -1) {
+		histogram_record(phases + currentPhase, now - phaseStart);
+		traceEvent(monitor_getStateString(currentPhase), "phase", PHASE_TID, phaseStart, now - phaseStart);
+	}
+	if (state == START) {
+		if (sweepStart != -1) {
+			histogram_record(&sweeps, now - sweepStart);
+			traceEvent("Sweep", "sweep", PHASE_TID, sweepStart, now - sweepStart);
+		}
+		sweepStart = now;
+		if (traceFile) {
+			// a sweep is a few seconds so this is often enough to lose little if we are killed
+			fflush(traceFile);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	currentPhase = state;
+	phaseStart = now;
+}
+
+void monitorStats_recordTransaction(const char *name, const struct status_t *cell, long long start) {
+	long long now = monitorStats_now();
+	pthread_mutex_lock(&mutex);
+	histogram_record(transactions + currentPhase, now - start);
+	if (traceFile) {
+		char eventName[64];
+		snprintf(eventName, sizeof(eventName), "%s %s %d", name, cell->battery->name, cell->cellIndex);
+		traceEvent(eventName, "cell", TRANSACTION_TID, start, now - start);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void monitorStats_recordTrip(long long latency) {
+	pthread_mutex_lock(&mutex);
+	histogram_record(&trips, latency);
+	pthread_mutex_unlock(&mutex);
+}
+
+static void writeMilliseconds(FILE *out, unsigned long long microseconds) {
+	char buf[32];
+	formatFixed(buf, microseconds, 3, 3, 10);
+	fputs(buf, out);
+}
+
+static void writeHistogram(FILE *out, const char *name, const struct histogram_t *histogram) {
+	fprintf(out, "%-22s %8llu", name, histogram->count);
+	writeMilliseconds(out, histogram->count ? histogram->sum / histogram->count : 0);
+	writeMilliseconds(out, histogram->min);
+	writeMilliseconds(out, histogram_getPercentile(histogram, 0.5));
+	writeMilliseconds(out, histogram_getPercentile(histogram, 0.9));
+	writeMilliseconds(out, histogram_getPercentile(histogram, 0.99));
+	writeMilliseconds(out, histogram->max);
+	writeMilliseconds(out, histogram->sum);
+	fputc('\n', out);
+}
+
+void monitorStats_writeReport(FILE *out) {
+	pthread_mutex_lock(&mutex);
+	fprintf(out, "%-22s %8s %10s %10s %10s %10s %10s %10s %10s\n", "ms", "count", "mean", "min", "p50", "p90", "p99",
+			"max", "total");
+	writeHistogram(out, "Sweep", &sweeps);
+	for (int i = 0; i < MONITOR_STATE_COUNT; i++) {
+		writeHistogram(out, monitor_getStateString(i), phases + i);
+		if (transactions[i].count) {
+			writeHistogram(out, "  cell transactions", transactions + i);
+		}
+	}
+	// max is the worst case reaction to an over voltage cell
+	if (trips.count) {
+		writeHistogram(out, "Over voltage trip", &trips);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static void *statsThreadMain(void *ptr __attribute__ ((unused))) {
+	while (1) {
+		int fd = accept(listenFd, NULL, NULL);
+		if (fd == -1) {
+			continue;
+		}
+		char *report = NULL;
+		size_t length = 0;
+		FILE *out = open_memstream(&report, &length);
+		if (out) {
+			monitorStats_writeReport(out);
+			fclose(out);
+			// a client that goes away mustn't kill us with SIGPIPE
+			for (size_t sent = 0; sent < length;) {
+				ssize_t result = send(fd, report + sent, length - sent, MSG_NOSIGNAL);
+				if (result <= 0) {
+					break;
+				}
+				sent += result;
+			}
+			free(report);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int openSocket(const char *path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "stats socket path %s is too long\n", path);
+		return 1;
+	}
+	strcpy(address.sun_path, path);
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd == -1) {
+		perror("stats socket");
+		return 1;
+	}
+	// left over from the last run
+	unlink(path);
+	if (bind(listenFd, (struct sockaddr *) &address, sizeof(address)) || listen(listenFd, 4)) {
+		perror(path);
+		close(listenFd);
+		listenFd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+void monitorStats_init(struct config_t *config) {
+	startedAt = monitorStats_now();
+	if (config->timingTraceFile) {
+		traceFile = fopen(config->timingTraceFile, "w");
+		if (!traceFile) {
+			perror(config->timingTraceFile);
+			fprintf(stderr, "carrying on without a timing trace\n");
+		} else {
+			// the closing ] is optional so the file can be loaded however we stop
+			fprintf(traceFile, "[\n");
+		}
+	}
+	if (config->statsSocket) {
+		if (openSocket(config->statsSocket)) {
+			fprintf(stderr, "carrying on without the stats socket\n");
+		} else if (pthread_create(&statsThread, NULL, statsThreadMain, NULL)) {
+			fprintf(stderr, "couldn't start the stats thread, carrying on without the stats socket\n");
+			close(listenFd);
+			listenFd = -1;
+		}
+	}
+}
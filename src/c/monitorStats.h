@@ -0,0 +1,53 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_MONITOR_STATS_H_
+#define TUMANAKO_MONITOR_STATS_H_
+
+#include <stdio.h>
+
+#include "monitor.h"
+
+/*
+ * Times each phase of the monitor loop, each cell transaction within it and the whole sweep into histograms.
+ *
+ * The report is written to anyone who connects to the statsSocket unix socket, eg "socat - UNIX-CONNECT:stats.sock",
+ * and every phase and transaction is written to timingTraceFile in the Chrome trace format if it is set.
+ */
+
+struct config_t;
+
+/** Start timing, these are only diagnostics so if the socket or trace file can't be opened we carry on without them */
+void monitorStats_init(struct config_t *config);
+
+/** @return microseconds on the monotonic clock */
+long long monitorStats_now();
+
+/** End the current phase and start timing state, entering the phase we are already in does nothing */
+void monitorStats_enterPhase(monitor_state_t state);
+
+/** Record a transaction with the cell that started at start, in the current phase */
+void monitorStats_recordTransaction(const char *name, const struct status_t *cell, long long start);
+
+/** Record the microseconds from an over voltage reading being decoded to the charger relay opening */
+void monitorStats_recordTrip(long long latency);
+
+void monitorStats_writeReport(FILE *out);
+
+#endif /* TUMANAKO_MONITOR_STATS_H_ */
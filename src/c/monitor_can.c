@@ -17,6 +17,7 @@
  along with the Tumanako EVD5 BMS.  If not, see
  <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,40 +42,190 @@
 #include <pthread.h>
 
 #include "util.h"
+#include "slcan.h"
 #include "monitor_can.h"
 
+// frames we can hold on to while the CAN bus is being recovered
+#define PENDING_FRAME_COUNT 1024
+
 void monitorCan_sendChar2Shorts(const short frameId, const char c, const short s1, const short s2);
 void monitorCan_send2Shorts(const short frameId, const short s1, const short s2);
+void monitorCan_sendChar3Shorts(const short frameId, const char c, const short s1, const short s2, const short s3);
 char monitorCan_send(struct can_frame *frame);
 
 /* CAN BUS socket */
-int s;
+int s = -1;
 static unsigned char error = 1;
+static char ifName[IFNAMSIZ];
+// true if we attach the adapter ourselves, otherwise we just wait for the interface to come back
+static unsigned char isSlcan;
+
+static pthread_t recoveryThread;
+// guards s, error and the pending frames
+static pthread_mutex_t socketMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t errorCondition = PTHREAD_COND_INITIALIZER;
+struct pendingFrame_t {
+	struct can_frame frame;
+	// monotonic seconds
+	time_t queued;
+};
+
+// ring buffer of frames sent while the bus was down, oldest first
+static struct pendingFrame_t pendingFrames[PENDING_FRAME_COUNT];
+static unsigned short pendingStart;
+static unsigned short pendingCount;
+static unsigned long droppedCount;
+static unsigned long staleCount;
+
+typedef enum {
+	SIGNAL_VOLTAGE,
+	SIGNAL_SHUNT_CURRENT,
+	SIGNAL_MIN_CURRENT,
+	SIGNAL_TEMPERATURE,
+	SIGNAL_RESISTANCE,
+	SIGNAL_COUNT
+} signal_t;
+
+/** what we last sent for one signal of one cell */
+struct published_t {
+	time_t whenSent;
+	unsigned short value;
+	unsigned char isValid;
+	unsigned char hasBeenSent;
+};
+
+struct publishedBattery_t {
+	struct published_t *signals[SIGNAL_COUNT];
+	unsigned short sentCount;
+	unsigned short suppressedCount;
+};
+
+static struct config_t *config;
+static struct publishedBattery_t *publishedBatteries;
+static unsigned short deadbands[SIGNAL_COUNT];
+
+static monitor_state_t lastMonitorState;
+static __u8 lastLoopsBeforeVoltage;
+static time_t whenMonitorStateSent;
+
+static time_t monotonicNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
 
-static int getSocket() {
-	if (error) {
-		fprintf(stderr, "resetting can bus");
-		system("./slcan.py");
-		sleep(1);
-		s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-		if (s == -1) {
-			return -1;
-		}
+/** @return true for the frames carrying a value of one cell, which are republished every publishRefreshInterval */
+static unsigned char isCellValueFrame(const struct can_frame *frame) {
+	return (frame->can_id >= 0x3f0 && frame->can_id <= 0x3f3) || frame->can_id == 0x3fb;
+}
+
+/**
+ * Open a socket on ifName if the interface exists and is up, the caller sets s while holding socketMutex
+ *
+ * @return the socket, -1 if it couldn't be opened
+ */
+static int openSocket() {
+	int result = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (result == -1) {
+		return -1;
+	}
 
-		struct ifreq ifr;
-		strcpy(ifr.ifr_name, "slcan0");
-		ioctl(s, SIOCGIFINDEX, &ifr);
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, ifName, IFNAMSIZ - 1);
+	if (ioctl(result, SIOCGIFFLAGS, &ifr) || !(ifr.ifr_flags & IFF_UP) || ioctl(result, SIOCGIFINDEX, &ifr)) {
+		close(result);
+		return -1;
+	}
 
-		struct sockaddr_can addr;
-		addr.can_family = AF_CAN;
-		addr.can_ifindex = ifr.ifr_ifindex;
+	struct sockaddr_can addr;
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
 
-		error = bind(s, (struct sockaddr *) &addr, sizeof(addr));
-		if (error) {
-			return -1;
+	if (bind(result, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(result);
+		return -1;
+	}
+	return result;
+}
+
+/** must be called holding socketMutex */
+static void addPendingFrame(struct can_frame *frame) {
+	if (pendingCount == PENDING_FRAME_COUNT) {
+		// full, drop the oldest
+		pendingStart = (pendingStart + 1) % PENDING_FRAME_COUNT;
+		pendingCount--;
+		droppedCount++;
+	}
+	struct pendingFrame_t *pending = pendingFrames + (pendingStart + pendingCount) % PENDING_FRAME_COUNT;
+	pending->frame = *frame;
+	pending->queued = monotonicNow();
+	pendingCount++;
+}
+
+/**
+ * Send the frames buffered while the bus was down, must be called holding socketMutex. A cell value older than
+ * publishRefreshInterval has been republished since, so rather than replay a long outage into the listeners those
+ * are dropped.
+ *
+ * @return 0 if all of the pending frames were sent
+ */
+static int sendPendingFrames() {
+	time_t staleBefore = monotonicNow() - config->publishRefreshInterval;
+	while (pendingCount) {
+		struct pendingFrame_t *pending = pendingFrames + pendingStart;
+		if (isCellValueFrame(&pending->frame) && pending->queued < staleBefore) {
+			staleCount++;
+		} else if (write(s, &pending->frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
+			return 1;
 		}
+		pendingStart = (pendingStart + 1) % PENDING_FRAME_COUNT;
+		pendingCount--;
 	}
-	return s;
+	return 0;
+}
+
+/**
+ * Reattach the adapter whenever a write fails. This can take seconds so it is done here rather than in
+ * monitorCan_send(), frames sent in the meantime are buffered.
+ */
+static void *recoveryThreadMain(void *unused __attribute__ ((unused))) {
+	pthread_mutex_lock(&socketMutex);
+	while (1) {
+		while (!error) {
+			pthread_cond_wait(&errorCondition, &socketMutex);
+		}
+		if (s != -1) {
+			close(s);
+			s = -1;
+		}
+		pthread_mutex_unlock(&socketMutex);
+
+		fprintf(stderr, "resetting can bus\n");
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int attempts = 1;
+		int fd;
+		while ((isSlcan && slcan_attach(ifName)) || (fd = openSocket()) == -1) {
+			attempts++;
+			sleep(1);
+		}
+
+		pthread_mutex_lock(&socketMutex);
+		s = fd;
+		if (sendPendingFrames()) {
+			// try again
+			continue;
+		}
+		error = 0;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+		fprintf(stderr, "can bus recovered in %ldms after %d attempts, %lu frames dropped, %lu stale cell values\n",
+				elapsed, attempts, droppedCount, staleCount);
+		droppedCount = 0;
+		staleCount = 0;
+	}
+	return NULL;
 }
 
 void monitorCan_sendChar2ShortsChar(const short frameId, const char c, const short s1, const short s2, const char c2) {
@@ -136,9 +287,100 @@ void monitorCan_send3CharShort(const short frameId, const char c1, const char c2
 }
 
 /* Initialisation function, return 0 if successful */
-int monitorCan_init() {
-	getSocket();
-	return error;
+int monitorCan_init(struct config_t *_config) {
+	config = _config;
+	deadbands[SIGNAL_VOLTAGE] = config->publishVoltageDeadband;
+	deadbands[SIGNAL_SHUNT_CURRENT] = config->publishCurrentDeadband;
+	deadbands[SIGNAL_MIN_CURRENT] = config->publishCurrentDeadband;
+	deadbands[SIGNAL_TEMPERATURE] = config->publishTemperatureDeadband;
+	deadbands[SIGNAL_RESISTANCE] = config->publishResistanceDeadband;
+	publishedBatteries = calloc(config->batteryCount, sizeof(struct publishedBattery_t));
+	if (!publishedBatteries) {
+		return 1;
+	}
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		for (int j = 0; j < SIGNAL_COUNT; j++) {
+			publishedBatteries[i].signals[j] = calloc(config->batteries[i].cellCount, sizeof(struct published_t));
+			if (!publishedBatteries[i].signals[j]) {
+				return 1;
+			}
+		}
+	}
+	snprintf(ifName, sizeof(ifName), "%s", config->canInterface);
+	isSlcan = strncmp(ifName, "slcan", strlen("slcan")) == 0;
+	// use the interface if it is already up, otherwise attach the adapter ourselves
+	s = openSocket();
+	if (s == -1 && isSlcan && !slcan_attach(ifName)) {
+		s = openSocket();
+	}
+	if (s == -1) {
+		fprintf(stderr, "could not open CAN interface %s\n", ifName);
+		return 1;
+	}
+	error = 0;
+	pthread_create(&recoveryThread, NULL, recoveryThreadMain, NULL);
+	return 0;
+}
+
+/**
+ * @return true if the value should be sent, in which case it is recorded as sent
+ */
+static unsigned char shouldPublish(const unsigned char batteryIndex, const short cellIndex, const signal_t signal,
+		const unsigned char isValid, const unsigned short value) {
+	struct publishedBattery_t *battery = publishedBatteries + batteryIndex;
+	struct published_t *published = battery->signals[signal] + cellIndex;
+	time_t now;
+	time(&now);
+	unsigned short difference = value > published->value ? value - published->value : published->value - value;
+	if (published->hasBeenSent && published->isValid == isValid && difference <= deadbands[signal]
+			&& now - published->whenSent < config->publishRefreshInterval) {
+		battery->suppressedCount++;
+		return 0;
+	}
+	published->hasBeenSent = 1;
+	published->isValid = isValid;
+	published->value = value;
+	published->whenSent = now;
+	battery->sentCount++;
+	return 1;
+}
+
+void monitorCan_publishCellVoltage(const unsigned char batteryIndex, const short cellIndex, const unsigned char isValid,
+		const short vCell) {
+	if (shouldPublish(batteryIndex, cellIndex, SIGNAL_VOLTAGE, isValid, vCell)) {
+		montiorCan_sendCellVoltage(batteryIndex, cellIndex, isValid, vCell);
+	}
+}
+
+void monitorCan_publishShuntCurrent(const unsigned char batteryIndex, const short cellIndex, const short iShunt) {
+	if (shouldPublish(batteryIndex, cellIndex, SIGNAL_SHUNT_CURRENT, 1, iShunt)) {
+		monitorCan_sendShuntCurrent(batteryIndex, cellIndex, iShunt);
+	}
+}
+
+void monitorCan_publishMinCurrent(const unsigned char batteryIndex, const short cellIndex, const short minCurrent) {
+	if (shouldPublish(batteryIndex, cellIndex, SIGNAL_MIN_CURRENT, 1, minCurrent)) {
+		monitorCan_sendMinCurrent(batteryIndex, cellIndex, minCurrent);
+	}
+}
+
+void monitorCan_publishTemperature(const unsigned char batteryIndex, const short cellIndex, const short temperature) {
+	if (shouldPublish(batteryIndex, cellIndex, SIGNAL_TEMPERATURE, 1, temperature)) {
+		monitorCan_sendTemperature(batteryIndex, cellIndex, temperature);
+	}
+}
+
+void monitorCan_publishResistance(const unsigned char batteryIndex, const short cellIndex, const short resistance) {
+	if (shouldPublish(batteryIndex, cellIndex, SIGNAL_RESISTANCE, 1, resistance)) {
+		monitorCan_sendResistance(batteryIndex, cellIndex, resistance);
+	}
+}
+
+void monitorCan_publishSweepComplete(const unsigned char batteryIndex, const short failedCount) {
+	struct publishedBattery_t *battery = publishedBatteries + batteryIndex;
+	monitorCan_sendChar3Shorts(0x3fa, batteryIndex, failedCount, battery->sentCount, battery->suppressedCount);
+	battery->sentCount = 0;
+	battery->suppressedCount = 0;
 }
 
 void montiorCan_sendCellVoltage(const unsigned char batteryIndex, const short cellIndex, const unsigned char isValid, const short vCell) {
@@ -157,6 +399,10 @@ void monitorCan_sendTemperature(const unsigned char batteryIndex, const short ce
 	monitorCan_sendChar2Shorts(0x3f3, batteryIndex, cellIndex, temperature);
 }
 
+void monitorCan_sendResistance(const unsigned char batteryIndex, const short cellIndex, const short resistance) {
+	monitorCan_sendChar2Shorts(0x3fb, batteryIndex, cellIndex, resistance);
+}
+
 void monitorCan_sendHardware(const unsigned char batteryIndex, const short cellIndex,
 		const unsigned char hasKelvinConnection, const unsigned char hasResistorShunt,
 		const unsigned char hasTemperatureSensor, const unsigned short revision, const unsigned char isClean) {
@@ -190,6 +436,16 @@ void monitorCan_sendChargerState(const unsigned char shutdown, const unsigned ch
 }
 
 void monitorCan_sendMonitorState(const monitor_state_t state, __u16 delay, const __u8 loopsBeforeVoltage) {
+	time_t now;
+	time(&now);
+	// don't send every tick of the sleep countdown
+	if (state == SLEEPING && lastMonitorState == SLEEPING && loopsBeforeVoltage == lastLoopsBeforeVoltage
+			&& now - whenMonitorStateSent < config->publishRefreshInterval) {
+		return;
+	}
+	lastMonitorState = state;
+	lastLoopsBeforeVoltage = loopsBeforeVoltage;
+	whenMonitorStateSent = now;
 	monitorCan_sendCharShortChar(0x3f9, state, delay, loopsBeforeVoltage);
 }
 
@@ -204,6 +460,18 @@ void monitorCan_sendChar2Shorts(const short frameId, const char c, const short s
 	monitorCan_send(&frame);
 }
 
+void monitorCan_sendChar3Shorts(const short frameId, const char c, const short s1, const short s2, const short s3) {
+	struct can_frame frame;
+	memset(&frame, 0, sizeof(struct can_frame)); /* init CAN frame, e.g. DLC = 0 */
+	frame.can_id = frameId;
+	frame.can_dlc = 7;
+	charToBuf(c, frame.data);
+	shortToBuf(s1, frame.data + 1);
+	shortToBuf(s2, frame.data + 3);
+	shortToBuf(s3, frame.data + 5);
+	monitorCan_send(&frame);
+}
+
 void monitorCan_send2Shorts(const short frameId, const short s1, const short s2) {
 	struct can_frame frame;
 	memset(&frame, 0, sizeof(struct can_frame)); /* init CAN frame, e.g. DLC = 0 */
@@ -214,23 +482,26 @@ void monitorCan_send2Shorts(const short frameId, const short s1, const short s2)
 	monitorCan_send(&frame);
 }
 
-/* Returns true if there is an error */
+/* Returns true if there is an error, the frame is kept and sent once the bus has been recovered */
 char monitorCan_send(struct can_frame *frame) {
 //	fprintf(stderr, "\n");
 //	fprint_long_canframe(stderr, frame, "\n", 0);
-	int s = getSocket();
+	pthread_mutex_lock(&socketMutex);
 	if (error) {
-		fprintf(stdout, "error getting socket");
-		fprintf(stderr, "error getting socket");
-		return 1;
+		// the recovery thread will send it when the bus is back
+		addPendingFrame(frame);
+		pthread_mutex_unlock(&socketMutex);
+		return 0;
 	}
 	int nbytes = write(s, frame, sizeof(struct can_frame));
 	if (nbytes != sizeof(struct can_frame)) {
-		printf("error writing can frame %d", nbytes);
-		fprintf(stderr, "error writing can frame %d", nbytes);
+		fprintf(stderr, "error writing can frame %d\n", nbytes);
+		addPendingFrame(frame);
 		error = 1;
+		pthread_cond_signal(&errorCondition);
+		pthread_mutex_unlock(&socketMutex);
 		return 1;
 	}
+	pthread_mutex_unlock(&socketMutex);
 	return 0;
 }
-
@@ -23,13 +23,29 @@
 #include <net/if.h>
 #include <linux/can.h>
 #include "monitor.h"
+#include "config.h"
 
-int monitorCan_init();
+int monitorCan_init(struct config_t *config);
+
+/*
+ * The publish functions send a cell value only if it differs from the value last sent by more than the configured
+ * deadband, or if publishRefreshInterval seconds have passed since it was last sent. Listeners should treat a cell
+ * they have not heard from as unchanged, monitorCan_publishSweepComplete() marks the end of each pass over a battery.
+ */
+void monitorCan_publishCellVoltage(const unsigned char batteryIndex, const short cellIndex, const unsigned char isValid, const short vCell);
+void monitorCan_publishShuntCurrent(const unsigned char batteryIndex, const short cellIndex, const short iShunt);
+void monitorCan_publishMinCurrent(const unsigned char batteryIndex, const short cellIndex, const short minCurrent);
+void monitorCan_publishTemperature(const unsigned char batteryIndex, const short cellIndex, const short temperature);
+/** Internal resistance in micro ohms, see cellResistance.h */
+void monitorCan_publishResistance(const unsigned char batteryIndex, const short cellIndex, const short resistance);
+/** Send the number of cells we could not read and the number of cell frames sent and suppressed since the last sweep */
+void monitorCan_publishSweepComplete(const unsigned char batteryIndex, const short failedCount);
 
 void montiorCan_sendCellVoltage(const unsigned char batteryIndex, const short cellIndex, const unsigned char isValid, const short vCell);
 void monitorCan_sendShuntCurrent(const unsigned char batteryIndex, const short cellIndex, const short iShunt);
 void monitorCan_sendMinCurrent(const unsigned char batteryIndex, const short cellIndex, const short minCurrent);
 void monitorCan_sendTemperature(const unsigned char batteryIndex, const short cellIndex, const short temperature);
+void monitorCan_sendResistance(const unsigned char batteryIndex, const short cellIndex, const short resistance);
 void monitorCan_sendHardware(const unsigned char batteryIndex, const short cellIndex,
 		const unsigned char hasKelvinConnection, const unsigned char hasResistorShunt,
 		const unsigned char hasTemperatureSensor, const unsigned short revision, const unsigned char isClean);
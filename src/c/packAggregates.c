@@ -0,0 +1,335 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "canEventListener.h"
+#include "packAggregates.h"
+
+#define MAX_SWEEP_LISTENERS 4
+
+// a leaf past the last cell
+#define NO_CELL 0xffff
+
+#define HAS_VOLTAGE 0x01
+#define IS_VALID 0x02
+#define IS_INVALID 0x04
+#define HAS_TEMPERATURE 0x08
+
+typedef enum {
+	MIN_VOLTAGE, MAX_VOLTAGE, MAX_TEMPERATURE, TREE_COUNT
+} tree_t;
+
+struct batteryAggregates_t {
+	unsigned short cellCount;
+	// a power of 2, the leaves of the trees are at leafCount + cellIndex
+	unsigned short leafCount;
+	// the last valid voltage of each cell
+	unsigned short *voltages;
+	unsigned short *temperatures;
+	unsigned char *flags;
+	// the epoch and monotonic second each cell was last published in
+	unsigned long *heardEpochs;
+	time_t *whenHeard;
+	// monotonic second the last sweep completed
+	time_t whenCompleted;
+	// each node holds the cell winning its subtree, the root is node 1
+	unsigned short *trees[TREE_COUNT];
+	struct packAggregates_t current;
+	struct packAggregates_t completed;
+};
+
+static unsigned char batteryCount;
+static struct batteryAggregates_t *batteries;
+static unsigned short refreshInterval;
+
+static packAggregates_sweepListener_t sweepListeners[MAX_SWEEP_LISTENERS];
+static unsigned char sweepListenerCount;
+
+// updates come from the CAN thread but the aggregates may be read from anywhere
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @return the cell that wins between a and b, a is the lower cell so it wins ties */
+static unsigned short play(struct batteryAggregates_t *battery, tree_t tree, unsigned short a, unsigned short b) {
+	unsigned char flag = tree == MAX_TEMPERATURE ? HAS_TEMPERATURE : HAS_VOLTAGE;
+	unsigned char aPlays = a != NO_CELL && (battery->flags[a] & flag);
+	unsigned char bPlays = b != NO_CELL && (battery->flags[b] & flag);
+	if (!bPlays) {
+		return aPlays ? a : NO_CELL;
+	}
+	if (!aPlays) {
+		return b;
+	}
+	switch (tree) {
+	case MIN_VOLTAGE:
+		return battery->voltages[b] < battery->voltages[a] ? b : a;
+	case MAX_VOLTAGE:
+		return battery->voltages[b] > battery->voltages[a] ? b : a;
+	default:
+		return battery->temperatures[b] > battery->temperatures[a] ? b : a;
+	}
+}
+
+static void replay(struct batteryAggregates_t *battery, tree_t tree, unsigned short cellIndex) {
+	unsigned short *nodes = battery->trees[tree];
+	for (unsigned int node = (battery->leafCount + cellIndex) / 2; node > 0; node /= 2) {
+		nodes[node] = play(battery, tree, nodes[node * 2], nodes[node * 2 + 1]);
+	}
+}
+
+static unsigned short getWinner(struct batteryAggregates_t *battery, tree_t tree) {
+	// with a single cell the root is the leaf and nobody has played it
+	return play(battery, tree, battery->trees[tree][1], NO_CELL);
+}
+
+static void updateExtremes(struct batteryAggregates_t *battery) {
+	struct packAggregates_t *current = &battery->current;
+	unsigned short cell = getWinner(battery, MIN_VOLTAGE);
+	current->minVoltage = cell == NO_CELL ? 0xffff : battery->voltages[cell];
+	current->minVoltageCell = cell == NO_CELL ? 0 : cell;
+	cell = getWinner(battery, MAX_VOLTAGE);
+	current->maxVoltage = cell == NO_CELL ? 0 : battery->voltages[cell];
+	current->maxVoltageCell = cell == NO_CELL ? 0 : cell;
+	cell = getWinner(battery, MAX_TEMPERATURE);
+	current->maxTemperature = cell == NO_CELL ? 0 : battery->temperatures[cell];
+	current->maxTemperatureCell = cell == NO_CELL ? 0 : cell;
+}
+
+static time_t monotonicNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void markHeard(struct batteryAggregates_t *battery, unsigned short cellIndex) {
+	battery->whenHeard[cellIndex] = monotonicNow();
+	if (battery->heardEpochs[cellIndex] != battery->current.epoch + 1) {
+		battery->heardEpochs[cellIndex] = battery->current.epoch + 1;
+		battery->current.heardCount++;
+	}
+}
+
+static struct batteryAggregates_t *getBattery(unsigned char batteryIndex, unsigned short cellIndex) {
+	if (batteryIndex >= batteryCount || cellIndex >= batteries[batteryIndex].cellCount) {
+		return NULL;
+	}
+	return batteries + batteryIndex;
+}
+
+void packAggregates_updateVoltage(unsigned char batteryIndex, unsigned short cellIndex, unsigned char isValid,
+		unsigned short voltage) {
+	pthread_mutex_lock(&mutex);
+	struct batteryAggregates_t *battery = getBattery(batteryIndex, cellIndex);
+	if (!battery) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	struct packAggregates_t *current = &battery->current;
+	unsigned char flags = battery->flags[cellIndex];
+	current->validCount -= (flags & IS_VALID) ? 1 : 0;
+	current->invalidCount -= (flags & IS_INVALID) ? 1 : 0;
+	flags &= ~(IS_VALID | IS_INVALID);
+	if (isValid) {
+		if (flags & HAS_VOLTAGE) {
+			current->totalVoltage -= battery->voltages[cellIndex];
+		} else {
+			current->readingCount++;
+		}
+		current->totalVoltage += voltage;
+		battery->voltages[cellIndex] = voltage;
+		flags |= HAS_VOLTAGE | IS_VALID;
+		current->validCount++;
+	} else {
+		// a voltage taken while shunting isn't used, we keep the last valid one
+		flags |= IS_INVALID;
+		current->invalidCount++;
+	}
+	battery->flags[cellIndex] = flags;
+	markHeard(battery, cellIndex);
+	if (isValid) {
+		replay(battery, MIN_VOLTAGE, cellIndex);
+		replay(battery, MAX_VOLTAGE, cellIndex);
+		updateExtremes(battery);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void packAggregates_updateTemperature(unsigned char batteryIndex, unsigned short cellIndex, unsigned short temperature) {
+	pthread_mutex_lock(&mutex);
+	struct batteryAggregates_t *battery = getBattery(batteryIndex, cellIndex);
+	if (!battery) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	battery->temperatures[cellIndex] = temperature;
+	battery->flags[cellIndex] |= HAS_TEMPERATURE;
+	markHeard(battery, cellIndex);
+	replay(battery, MAX_TEMPERATURE, cellIndex);
+	updateExtremes(battery);
+	pthread_mutex_unlock(&mutex);
+}
+
+void packAggregates_completeSweep(unsigned char batteryIndex, unsigned short failedCount, unsigned short sentCount,
+		unsigned short suppressedCount) {
+	pthread_mutex_lock(&mutex);
+	if (batteryIndex >= batteryCount) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	struct batteryAggregates_t *battery = batteries + batteryIndex;
+	struct packAggregates_t *current = &battery->current;
+	/*
+	 * A cell that is still answering republishes at least every publishRefreshInterval seconds, so anything due a
+	 * refresh by the start of this sweep should have been heard during it. Allow a second for rounding.
+	 */
+	time_t now = monotonicNow();
+	time_t staleBefore = battery->whenCompleted ? battery->whenCompleted - refreshInterval - 1 : 0;
+	battery->whenCompleted = now;
+	current->answeringCount = 0;
+	current->answeringValidCount = 0;
+	for (unsigned short i = 0; i < battery->cellCount; i++) {
+		unsigned char isAnswering = battery->heardEpochs[i] && battery->whenHeard[i] >= staleBefore;
+		current->answeringCount += isAnswering;
+		current->answeringValidCount += isAnswering && (battery->flags[i] & IS_VALID);
+	}
+	current->epoch++;
+	current->failedCount = failedCount;
+	current->sentCount = sentCount;
+	current->suppressedCount = suppressedCount;
+	battery->completed = *current;
+	current->heardCount = 0;
+	struct packAggregates_t completed = battery->completed;
+	unsigned char listenerCount = sweepListenerCount;
+	pthread_mutex_unlock(&mutex);
+
+	// without the lock so listeners can read the aggregates of other batteries
+	for (unsigned char i = 0; i < listenerCount; i++) {
+		sweepListeners[i](batteryIndex, &completed);
+	}
+}
+
+void packAggregates_get(unsigned char batteryIndex, struct packAggregates_t *result) {
+	pthread_mutex_lock(&mutex);
+	if (batteryIndex < batteryCount) {
+		*result = batteries[batteryIndex].completed;
+	} else {
+		memset(result, 0, sizeof(struct packAggregates_t));
+		result->minVoltage = 0xffff;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void packAggregates_getCurrent(unsigned char batteryIndex, struct packAggregates_t *result) {
+	pthread_mutex_lock(&mutex);
+	if (batteryIndex < batteryCount) {
+		*result = batteries[batteryIndex].current;
+	} else {
+		memset(result, 0, sizeof(struct packAggregates_t));
+		result->minVoltage = 0xffff;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+int packAggregates_registerSweepListener(packAggregates_sweepListener_t listener) {
+	pthread_mutex_lock(&mutex);
+	if (sweepListenerCount == MAX_SWEEP_LISTENERS) {
+		pthread_mutex_unlock(&mutex);
+		fprintf(stderr, "too many sweep listeners\n");
+		return 1;
+	}
+	sweepListeners[sweepListenerCount++] = listener;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+static void voltageListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned char isValid,
+		unsigned short voltage) {
+	packAggregates_updateVoltage(batteryIndex, cellIndex, isValid, voltage);
+}
+
+static void temperatureListener(unsigned char batteryIndex, unsigned short cellIndex, unsigned short temperature) {
+	packAggregates_updateTemperature(batteryIndex, cellIndex, temperature);
+}
+
+static void sweepCompleteListener(unsigned char batteryIndex, unsigned short failedCount, unsigned short sentCount,
+		unsigned short suppressedCount) {
+	packAggregates_completeSweep(batteryIndex, failedCount, sentCount, suppressedCount);
+}
+
+static int initBattery(struct batteryAggregates_t *battery, unsigned short cellCount) {
+	battery->cellCount = cellCount;
+	battery->leafCount = 1;
+	while (battery->leafCount < cellCount) {
+		battery->leafCount *= 2;
+	}
+	battery->voltages = calloc(cellCount, sizeof(unsigned short));
+	battery->temperatures = calloc(cellCount, sizeof(unsigned short));
+	battery->flags = calloc(cellCount, sizeof(unsigned char));
+	battery->heardEpochs = calloc(cellCount, sizeof(unsigned long));
+	battery->whenHeard = calloc(cellCount, sizeof(time_t));
+	if (cellCount && (!battery->voltages || !battery->temperatures || !battery->flags || !battery->heardEpochs
+			|| !battery->whenHeard)) {
+		return 1;
+	}
+	for (int tree = 0; tree < TREE_COUNT; tree++) {
+		unsigned short *nodes = malloc(sizeof(unsigned short) * battery->leafCount * 2);
+		if (!nodes) {
+			return 1;
+		}
+		for (unsigned int i = 0; i < battery->leafCount; i++) {
+			nodes[battery->leafCount + i] = i < cellCount ? i : NO_CELL;
+		}
+		// nothing has a reading yet so nobody wins
+		for (unsigned int node = 0; node < battery->leafCount; node++) {
+			nodes[node] = NO_CELL;
+		}
+		battery->trees[tree] = nodes;
+	}
+	battery->current.cellCount = cellCount;
+	updateExtremes(battery);
+	battery->completed = battery->current;
+	return 0;
+}
+
+int packAggregates_init(struct config_t *config) {
+	batteries = calloc(config->batteryCount, sizeof(struct batteryAggregates_t));
+	if (!batteries) {
+		return 1;
+	}
+	for (unsigned char i = 0; i < config->batteryCount; i++) {
+		if (initBattery(batteries + i, config->batteries[i].cellCount)) {
+			fprintf(stderr, "error allocating aggregates for %s\n", config->batteries[i].name);
+			return 1;
+		}
+	}
+	batteryCount = config->batteryCount;
+	refreshInterval = config->publishRefreshInterval;
+	canEventListener_registerVoltageListener(voltageListener);
+	canEventListener_registerTemperatureListener(temperatureListener);
+	canEventListener_registerSweepCompleteListener(sweepCompleteListener);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_PACK_AGGREGATES_H_
+#define TUMANAKO_PACK_AGGREGATES_H_
+
+/*
+ * Min, max and total cell voltage and max temperature of each battery, kept up to date as cells are published
+ * rather than worked out again by everyone who needs them.
+ *
+ * Each battery has a tournament tree per extreme so a cell update costs O(log n) and the extremes are read from the
+ * roots. Counts and the total are updated in O(1).
+ *
+ * Updates arrive in any order. A sweep (epoch) ends when the monitor publishes that it has finished a pass over the
+ * battery, packAggregates_get() then returns the aggregates as they were at the end of the sweep until the next one
+ * completes and sweep listeners are told about them.
+ */
+
+struct config_t;
+
+struct packAggregates_t {
+	// sweeps completed
+	unsigned long epoch;
+	unsigned short cellCount;
+	// cells whose latest voltage was valid or invalid (taken while shunting) and cells we have a valid voltage for
+	unsigned short validCount;
+	unsigned short invalidCount;
+	unsigned short readingCount;
+	// cells published during the sweep, cells that haven't changed aren't published
+	unsigned short heardCount;
+	// cells heard recently enough to still be answering, see packAggregates_completeSweep(), and of those how many
+	// have a valid latest voltage
+	unsigned short answeringCount;
+	unsigned short answeringValidCount;
+	// as published at the end of the sweep
+	unsigned short failedCount;
+	unsigned short sentCount;
+	unsigned short suppressedCount;
+	// of the last valid voltage of each cell, min is 0xffff if we have none
+	unsigned short minVoltage;
+	unsigned short minVoltageCell;
+	unsigned short maxVoltage;
+	unsigned short maxVoltageCell;
+	unsigned long totalVoltage;
+	// of the cells with a temperature sensor
+	unsigned short maxTemperature;
+	unsigned short maxTemperatureCell;
+};
+
+typedef void (*packAggregates_sweepListener_t)(unsigned char batteryIndex, const struct packAggregates_t *aggregates);
+
+/** Allocate the aggregates and listen for cell updates, @return 0 on success */
+int packAggregates_init(struct config_t *config);
+
+/** Normally called by the CAN listeners, ties in the extremes go to the lowest cell */
+void packAggregates_updateVoltage(unsigned char batteryIndex, unsigned short cellIndex, unsigned char isValid,
+		unsigned short voltage);
+void packAggregates_updateTemperature(unsigned char batteryIndex, unsigned short cellIndex, unsigned short temperature);
+/** End the sweep, a cell not heard when it was due to be republished is counted as no longer answering */
+void packAggregates_completeSweep(unsigned char batteryIndex, unsigned short failedCount, unsigned short sentCount,
+		unsigned short suppressedCount);
+
+/** The aggregates at the end of the last completed sweep */
+void packAggregates_get(unsigned char batteryIndex, struct packAggregates_t *result);
+
+/** The aggregates including updates in the sweep so far */
+void packAggregates_getCurrent(unsigned char batteryIndex, struct packAggregates_t *result);
+
+/** Called on the CAN thread after each sweep completes, @return 0 on success */
+int packAggregates_registerSweepListener(packAggregates_sweepListener_t listener);
+
+#endif /* TUMANAKO_PACK_AGGREGATES_H_ */
@@ -0,0 +1,177 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+#include <linux/tty.h>
+#include <linux/sockios.h>
+
+#include "slcan.h"
+
+#define SYS_CLASS_TTY "/sys/class/tty/"
+#define DEVICE_UEVENT "/device/uevent"
+#define DEV "/dev/"
+#define DRIVER "DRIVER=ftdi_sio"
+
+// S6 is 500kbit/s
+#define BITRATE_COMMAND "S6\r"
+
+// the line discipline only exists while the tty is open, so we hold it for as long as the interface is needed
+static int ttyFd = -1;
+
+static unsigned char isSlcanTty(const char *deviceName) {
+	char ueventFileName[strlen(SYS_CLASS_TTY) + strlen(deviceName) + strlen(DEVICE_UEVENT) + 1];
+	strcpy(ueventFileName, SYS_CLASS_TTY);
+	strcat(ueventFileName, deviceName);
+	strcat(ueventFileName, DEVICE_UEVENT);
+	FILE *ueventFile = fopen(ueventFileName, "r");
+	if (!ueventFile) {
+		return 0;
+	}
+	char uevent[40];
+	unsigned char result = fgets(uevent, sizeof(uevent), ueventFile) && strncmp(uevent, DRIVER, strlen(DRIVER)) == 0;
+	fclose(ueventFile);
+	return result;
+}
+
+static void findSlcanTty(char *result, int length) {
+	*result = 0;
+	DIR *dirp = opendir(SYS_CLASS_TTY);
+	if (!dirp) {
+		return;
+	}
+	struct dirent *dp;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!strncmp(dp->d_name, "ttyUSB", strlen("ttyUSB")) && isSlcanTty(dp->d_name)) {
+			snprintf(result, length, "%s%s", DEV, dp->d_name);
+			break;
+		}
+	}
+	closedir(dirp);
+}
+
+static int writeCommand(const char *command) {
+	return write(ttyFd, command, strlen(command)) != (ssize_t) strlen(command);
+}
+
+static int setInterfaceUp(const char *ifName) {
+	int s = socket(PF_CAN, SOCK_RAW, 0);
+	if (s == -1) {
+		return 1;
+	}
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, ifName, IFNAMSIZ - 1);
+	int result = ioctl(s, SIOCGIFFLAGS, &ifr);
+	if (!result) {
+		ifr.ifr_flags |= IFF_UP;
+		result = ioctl(s, SIOCSIFFLAGS, &ifr);
+	}
+	close(s);
+	return result;
+}
+
+/** Interfaces can only be renamed while they are down */
+static int renameInterface(const char *from, const char *to) {
+	int s = socket(PF_CAN, SOCK_RAW, 0);
+	if (s == -1) {
+		return 1;
+	}
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, from, IFNAMSIZ - 1);
+	strncpy(ifr.ifr_newname, to, IFNAMSIZ - 1);
+	int result = ioctl(s, SIOCSIFNAME, &ifr);
+	close(s);
+	return result;
+}
+
+int slcan_attach(const char *ifName) {
+	slcan_detach();
+	char tty[40];
+	findSlcanTty(tty, sizeof(tty));
+	if (strlen(tty) == 0) {
+		fprintf(stderr, "could not find slcan serial port\n");
+		return 1;
+	}
+	ttyFd = open(tty, O_RDWR | O_NOCTTY);
+	if (ttyFd < 0) {
+		perror(tty);
+		return 1;
+	}
+	struct termios tio;
+	if (tcgetattr(ttyFd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(ttyFd, TCSANOW, &tio);
+	}
+	tcflush(ttyFd, TCIOFLUSH);
+	// close the channel in case it was left open, set the bitrate and open it again
+	if (writeCommand("C\r") || writeCommand(BITRATE_COMMAND) || writeCommand("O\r")) {
+		perror("writing slcan setup");
+		slcan_detach();
+		return 1;
+	}
+	int ldisc = N_SLCAN;
+	if (ioctl(ttyFd, TIOCSETD, &ldisc) < 0) {
+		perror("TIOCSETD N_SLCAN");
+		slcan_detach();
+		return 1;
+	}
+	char name[IFNAMSIZ];
+	if (ioctl(ttyFd, SIOCGIFNAME, name) < 0) {
+		perror("SIOCGIFNAME");
+		slcan_detach();
+		return 1;
+	}
+	// the kernel picks the next free slcanN, everyone else is looking for the configured name
+	if (strcmp(name, ifName) && renameInterface(name, ifName)) {
+		perror("SIOCSIFNAME");
+		slcan_detach();
+		return 1;
+	}
+	if (setInterfaceUp(ifName)) {
+		perror("SIOCSIFFLAGS");
+		slcan_detach();
+		return 1;
+	}
+	fprintf(stderr, "attached %s to %s\n", ifName, tty);
+	return 0;
+}
+
+void slcan_detach() {
+	if (ttyFd == -1) {
+		return;
+	}
+	int ldisc = N_TTY;
+	ioctl(ttyFd, TIOCSETD, &ldisc);
+	writeCommand("C\r");
+	close(ttyFd);
+	ttyFd = -1;
+}
@@ -0,0 +1,38 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLCAN_H
+#define SLCAN_H
+
+/** Bring up a serial line CAN adapter without needing slcan_attach and ifconfig, requires CAP_NET_ADMIN */
+
+/**
+ * Find the FTDI serial port the CAN adapter is attached to, attach the slcan line discipline at 500kbit/s and bring
+ * the resulting network interface up as ifName. The kernel names it after the next free slcanN, which needn't be
+ * the one we had before, so it is renamed to keep the sender and the receive thread on the same interface.
+ *
+ * @return 0 if successful
+ */
+int slcan_attach(const char *ifName);
+
+/** Take down the interface created by slcan_attach() */
+void slcan_detach();
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "monitor.h"
+#include "snapshot.h"
+
+typedef char batteriesFit[MAX_BATTERIES <= SNAPSHOT_MAX_BATTERIES ? 1 : -1];
+
+static struct snapshot_t *snapshot;
+
+/*
+ * The sequence is made odd before anything is written and even again after, the fences keep the writes to the
+ * snapshot between the two.
+ */
+static void beginWrite() {
+	uint32_t sequence = snapshot->sequence;
+	__atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void endWrite() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	snapshot->published = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+	__atomic_store_n(&snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void copyCell(struct snapshot_cell_t *to, const struct status_t *from) {
+	to->cellId = from->cellId;
+	to->voltage = from->vCell;
+	to->shuntVoltage = from->vShunt;
+	to->shuntCurrent = from->iShunt;
+	to->minCurrent = from->minCurrent;
+	to->targetShuntCurrent = from->targetShuntCurrent;
+	to->temperature = from->temperature;
+	to->errorCount = from->errorCount;
+	to->revision = from->revision;
+	to->flags = (from->isDataCurrent ? SNAPSHOT_CELL_DATA_CURRENT : 0)
+			| (from->hasTemperatureSensor ? SNAPSHOT_CELL_HAS_TEMPERATURE : 0)
+			| (from->isKelvinConnection ? SNAPSHOT_CELL_KELVIN : 0)
+			| (from->isResistorShunt ? SNAPSHOT_CELL_RESISTOR_SHUNT : 0)
+			| (from->isHardSwitchedShunt ? SNAPSHOT_CELL_HARD_SWITCHED : 0)
+			| (from->isClean ? SNAPSHOT_CELL_CLEAN : 0)
+			| (from->automatic ? SNAPSHOT_CELL_AUTOMATIC : 0);
+	to->gainPot = from->gainPot;
+	to->vShuntPot = from->vShuntPot;
+	to->version = from->version;
+	to->latency = from->latency;
+}
+
+void snapshot_publish(struct monitor_t *monitor, const struct snapshot_soc_t *soc) {
+	if (!snapshot) {
+		return;
+	}
+	beginWrite();
+	snapshot->soc = *soc;
+	for (unsigned char i = 0; i < monitor->batteryCount; i++) {
+		struct battery_t *battery = monitor->batteries + i;
+		struct snapshot_cell_t *cells = snapshot->cells + snapshot->batteries[i].firstCell;
+		for (unsigned short j = 0; j < battery->cellCount; j++) {
+			copyCell(cells + j, battery->cells + j);
+		}
+	}
+	endWrite();
+}
+
+void snapshot_publishState(unsigned char monitorState) {
+	if (!snapshot) {
+		return;
+	}
+	beginWrite();
+	snapshot->monitorState = monitorState;
+	if (monitorState == START) {
+		snapshot->sweepCount++;
+	}
+	endWrite();
+}
+
+int snapshot_init(struct config_t *config, struct monitor_t *monitor) {
+	if (!config->snapshotName) {
+		return 0;
+	}
+	unsigned int cellCount = 0;
+	for (unsigned char i = 0; i < monitor->batteryCount; i++) {
+		cellCount += monitor->batteries[i].cellCount;
+	}
+	size_t size = sizeof(struct snapshot_t) + cellCount * sizeof(struct snapshot_cell_t);
+	// readers still mapping the last run's segment keep it, resizing it under them would get them a SIGBUS
+	shm_unlink(config->snapshotName);
+	// readers only get to read
+	int fd = shm_open(config->snapshotName, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		perror(config->snapshotName);
+		return 1;
+	}
+	if (ftruncate(fd, size)) {
+		perror(config->snapshotName);
+		close(fd);
+		shm_unlink(config->snapshotName);
+		return 1;
+	}
+	void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		perror(config->snapshotName);
+		shm_unlink(config->snapshotName);
+		return 1;
+	}
+	snapshot = mapped;
+	snapshot->version = SNAPSHOT_VERSION;
+	snapshot->size = size;
+	snapshot->batteryCount = monitor->batteryCount;
+	snapshot->cellCount = cellCount;
+	unsigned short firstCell = 0;
+	for (unsigned char i = 0; i < monitor->batteryCount; i++) {
+		struct snapshot_battery_t *battery = snapshot->batteries + i;
+		strncpy(battery->name, monitor->batteries[i].name, SNAPSHOT_NAME_LENGTH - 1);
+		battery->cellCount = monitor->batteries[i].cellCount;
+		battery->firstCell = firstCell;
+		firstCell += battery->cellCount;
+	}
+	// the magic goes in last so a reader that finds it sees the rest
+	__atomic_store_n(&snapshot->magic, SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_SNAPSHOT_H_
+#define TUMANAKO_SNAPSHOT_H_
+
+#include <stdint.h>
+
+/*
+ * The state of the pack published by the monitor in the POSIX shared memory segment named by the snapshotName config
+ * option (default /tumanako-bms) for dashboards, displays and loggers on the same machine.
+ *
+ * The segment is a struct snapshot_t followed by the cells of every battery, battery i's cells start at
+ * cells[batteries[i].firstCell]. Only fixed size types are used so other programs can map it, anything added goes on
+ * the end of a struct with SNAPSHOT_VERSION incremented.
+ *
+ * The monitor is the only writer and never waits for readers. sequence is odd while it is writing, readers read it,
+ * read what they want and check it hasn't changed, see snapshotReader.h.
+ */
+
+#define SNAPSHOT_MAGIC 0x544d4b42
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_DEFAULT_NAME "/tumanako-bms"
+
+#define SNAPSHOT_NAME_LENGTH 32
+#define SNAPSHOT_MAX_BATTERIES 10
+
+// snapshot_cell_t flags
+#define SNAPSHOT_CELL_DATA_CURRENT 0x01
+#define SNAPSHOT_CELL_HAS_TEMPERATURE 0x02
+#define SNAPSHOT_CELL_KELVIN 0x04
+#define SNAPSHOT_CELL_RESISTOR_SHUNT 0x08
+#define SNAPSHOT_CELL_HARD_SWITCHED 0x10
+#define SNAPSHOT_CELL_CLEAN 0x20
+#define SNAPSHOT_CELL_AUTOMATIC 0x40
+
+struct snapshot_cell_t {
+	uint16_t cellId;
+	// mV, mA and hundredths of a degree
+	uint16_t voltage;
+	uint16_t shuntVoltage;
+	uint16_t shuntCurrent;
+	uint16_t minCurrent;
+	uint16_t targetShuntCurrent;
+	uint16_t temperature;
+	uint16_t errorCount;
+	uint16_t revision;
+	uint8_t flags;
+	int8_t gainPot;
+	int8_t vShuntPot;
+	int8_t version;
+	uint16_t reserved;
+	// microseconds taken by the last reading
+	uint32_t latency;
+};
+
+struct snapshot_battery_t {
+	char name[SNAPSHOT_NAME_LENGTH];
+	uint16_t cellCount;
+	uint16_t firstCell;
+	uint32_t reserved;
+};
+
+struct snapshot_soc_t {
+	// V, A, Ah, Wh, degrees and km/h as read from the SOC meter
+	double voltage;
+	double current;
+	double ah;
+	double wh;
+	double t1;
+	double t2;
+	double speed;
+	uint8_t error;
+	uint8_t reserved[7];
+	// Ah and Wh integrated from the instantaneous current and voltage, and how much they've been corrected to follow
+	// ah and wh, since version 2
+	double integratedAh;
+	double integratedWh;
+	double ahCorrection;
+	double whCorrection;
+};
+
+struct snapshot_t {
+	uint32_t magic;
+	uint32_t version;
+	// bytes in the segment
+	uint32_t size;
+	// odd while the monitor is writing
+	uint32_t sequence;
+	// microseconds since the epoch when last published
+	int64_t published;
+	// sweeps over the pack started
+	uint32_t sweepCount;
+	// monitor_state_t
+	uint8_t monitorState;
+	uint8_t batteryCount;
+	uint16_t cellCount;
+	struct snapshot_soc_t soc;
+	struct snapshot_battery_t batteries[SNAPSHOT_MAX_BATTERIES];
+	struct snapshot_cell_t cells[];
+};
+
+struct config_t;
+struct monitor_t;
+
+/** Create the shared memory segment named in the config, @return 0 on success, publishing does nothing if not */
+int snapshot_init(struct config_t *config, struct monitor_t *monitor);
+
+/** Copy the monitor's cells and the SOC values into the segment */
+void snapshot_publish(struct monitor_t *monitor, const struct snapshot_soc_t *soc);
+
+/** Publish a change of monitor state (monitor_state_t), cheaper than a full publish */
+void snapshot_publishState(unsigned char monitorState);
+
+#endif /* TUMANAKO_SNAPSHOT_H_ */
@@ -0,0 +1,100 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshotReader.h"
+
+int snapshotReader_open(struct snapshotReader_t *reader, const char *name) {
+	reader->snapshot = NULL;
+	reader->size = 0;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return 1;
+	}
+	struct stat status;
+	if (fstat(fd, &status) || (size_t) status.st_size < sizeof(struct snapshot_t)) {
+		close(fd);
+		return 1;
+	}
+	void *mapped = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return 1;
+	}
+	const struct snapshot_t *snapshot = mapped;
+	// newer monitors only add to the end so any version from ours on will do
+	if (__atomic_load_n(&snapshot->magic, __ATOMIC_ACQUIRE) != SNAPSHOT_MAGIC || snapshot->version < SNAPSHOT_VERSION
+			|| snapshot->size > (size_t) status.st_size) {
+		munmap(mapped, status.st_size);
+		return 1;
+	}
+	reader->snapshot = snapshot;
+	reader->size = snapshot->size;
+	return 0;
+}
+
+void snapshotReader_close(struct snapshotReader_t *reader) {
+	if (reader->snapshot) {
+		munmap((void *) reader->snapshot, reader->size);
+	}
+	reader->snapshot = NULL;
+	reader->size = 0;
+}
+
+uint32_t snapshotReader_begin(const struct snapshotReader_t *reader) {
+	while (1) {
+		uint32_t sequence = __atomic_load_n(&reader->snapshot->sequence, __ATOMIC_ACQUIRE);
+		if (!(sequence & 1)) {
+			return sequence;
+		}
+		// a publish takes microseconds, let the monitor finish if we are sharing its CPU
+		sched_yield();
+	}
+}
+
+int snapshotReader_retry(const struct snapshotReader_t *reader, uint32_t sequence) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&reader->snapshot->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+void snapshotReader_copy(const struct snapshotReader_t *reader, struct snapshot_t *result) {
+	uint32_t sequence;
+	do {
+		sequence = snapshotReader_begin(reader);
+		memcpy(result, reader->snapshot, reader->size);
+	} while (snapshotReader_retry(reader, sequence));
+}
+
+const struct snapshot_cell_t *snapshotReader_getCells(const struct snapshotReader_t *reader,
+		unsigned char batteryIndex) {
+	// the layout never changes once the segment is published
+	if (batteryIndex >= reader->snapshot->batteryCount) {
+		return NULL;
+	}
+	return reader->snapshot->cells + reader->snapshot->batteries[batteryIndex].firstCell;
+}
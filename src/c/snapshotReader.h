@@ -0,0 +1,62 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_SNAPSHOT_READER_H_
+#define TUMANAKO_SNAPSHOT_READER_H_
+
+#include <stddef.h>
+
+#include "snapshot.h"
+
+/*
+ * Read the monitor's snapshot in place, without system calls or locks:
+ *
+ *	uint32_t sequence;
+ *	do {
+ *		sequence = snapshotReader_begin(&reader);
+ *		voltage = reader.snapshot->cells[i].voltage;
+ *	} while (snapshotReader_retry(&reader, sequence));
+ *
+ * Values read between begin and retry may be torn so they must not be used to index or allocate until retry says
+ * they were consistent. The monitor replaces the segment when it restarts, reopen if published stops changing.
+ */
+
+struct snapshotReader_t {
+	const struct snapshot_t *snapshot;
+	size_t size;
+};
+
+/** Map the segment read only, @return 0 on success */
+int snapshotReader_open(struct snapshotReader_t *reader, const char *name);
+void snapshotReader_close(struct snapshotReader_t *reader);
+
+/** Wait until the monitor isn't writing, @return the sequence to pass to snapshotReader_retry() */
+uint32_t snapshotReader_begin(const struct snapshotReader_t *reader);
+
+/** @return non zero if the snapshot changed since begin and what was read must be read again */
+int snapshotReader_retry(const struct snapshotReader_t *reader, uint32_t sequence);
+
+/** Copy a consistent snapshot including the cells into result, which must have room for reader->size bytes */
+void snapshotReader_copy(const struct snapshotReader_t *reader, struct snapshot_t *result);
+
+/** @return the cells of a battery, NULL if there is no such battery */
+const struct snapshot_cell_t *snapshotReader_getCells(const struct snapshotReader_t *reader,
+		unsigned char batteryIndex);
+
+#endif /* TUMANAKO_SNAPSHOT_READER_H_ */
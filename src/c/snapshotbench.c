@@ -0,0 +1,170 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Publish snapshots of a made up pack as fast as we can while readers read every cell voltage and check each read was
+ * consistent, then report how many reads each reader got through and how often they had to retry.
+ *
+ * snapshotbench [readers [seconds [cells per battery]]]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "monitor.h"
+#include "snapshot.h"
+#include "snapshotReader.h"
+
+#define BATTERY_COUNT 3
+#define MAX_READERS 16
+
+struct readerStats_t {
+	pthread_t thread;
+	unsigned long reads;
+	unsigned long retries;
+	unsigned long torn;
+	unsigned long copies;
+};
+
+static struct monitor_t monitor;
+static struct battery_t batteries[BATTERY_COUNT];
+static char name[64];
+static volatile int running = 1;
+static unsigned long published;
+
+static void *writerMain(void *ptr __attribute__ ((unused))) {
+	struct snapshot_soc_t soc;
+	memset(&soc, 0, sizeof(soc));
+	unsigned short voltage = 0;
+	while (running) {
+		// every cell has the same voltage so a reader can tell a torn read
+		voltage++;
+		for (unsigned char i = 0; i < monitor.batteryCount; i++) {
+			for (unsigned short j = 0; j < monitor.batteries[i].cellCount; j++) {
+				monitor.batteries[i].cells[j].vCell = voltage;
+			}
+		}
+		soc.voltage = voltage;
+		snapshot_publish(&monitor, &soc);
+		published++;
+	}
+	return NULL;
+}
+
+/** @return non zero if the voltages weren't all the same, the read was torn */
+static int readVoltages(const struct snapshotReader_t *reader) {
+	const struct snapshot_t *snapshot = reader->snapshot;
+	unsigned short first = snapshot->cells[0].voltage;
+	unsigned short different = 0;
+	for (unsigned short i = 0; i < snapshot->cellCount; i++) {
+		different |= snapshot->cells[i].voltage ^ first;
+	}
+	different |= (unsigned short) snapshot->soc.voltage ^ first;
+	return different != 0;
+}
+
+static void *readerMain(void *ptr) {
+	struct readerStats_t *stats = ptr;
+	struct snapshotReader_t reader;
+	if (snapshotReader_open(&reader, name)) {
+		fprintf(stderr, "reader couldn't open %s\n", name);
+		return NULL;
+	}
+	struct snapshot_t *copy = malloc(reader.size);
+	unsigned long count = 0;
+	while (running) {
+		if (count++ % 8 == 7) {
+			// now and then take a copy to check that too
+			snapshotReader_copy(&reader, copy);
+			const struct snapshotReader_t copyReader = { copy, reader.size };
+			stats->torn += readVoltages(&copyReader);
+			stats->copies++;
+			continue;
+		}
+		uint32_t sequence = snapshotReader_begin(&reader);
+		int torn = readVoltages(&reader);
+		if (snapshotReader_retry(&reader, sequence)) {
+			stats->retries++;
+			continue;
+		}
+		stats->torn += torn;
+		stats->reads++;
+	}
+	free(copy);
+	snapshotReader_close(&reader);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int readerCount = argc > 1 ? atoi(argv[1]) : 2;
+	int seconds = argc > 2 ? atoi(argv[2]) : 5;
+	unsigned short cellCount = argc > 3 ? atoi(argv[3]) : 100;
+	if (readerCount < 1 || readerCount > MAX_READERS || cellCount < 1 || cellCount > MAX_CELLS) {
+		fprintf(stderr, "usage: snapshotbench [readers (1-%d) [seconds [cells per battery (1-%d)]]]\n", MAX_READERS,
+				MAX_CELLS);
+		return 1;
+	}
+	snprintf(name, sizeof(name), "/tumanako-snapshotbench-%d", getpid());
+	monitor.batteryCount = BATTERY_COUNT;
+	monitor.batteries = batteries;
+	for (int i = 0; i < BATTERY_COUNT; i++) {
+		batteries[i].batteryIndex = i;
+		batteries[i].name = "battery";
+		batteries[i].cellCount = cellCount;
+		batteries[i].cells = calloc(cellCount, sizeof(struct status_t));
+	}
+	struct config_t config;
+	memset(&config, 0, sizeof(config));
+	config.snapshotName = name;
+	if (snapshot_init(&config, &monitor)) {
+		return 1;
+	}
+
+	struct readerStats_t readers[MAX_READERS];
+	memset(readers, 0, sizeof(readers));
+	pthread_t writer;
+	pthread_create(&writer, NULL, writerMain, NULL);
+	for (int i = 0; i < readerCount; i++) {
+		pthread_create(&readers[i].thread, NULL, readerMain, readers + i);
+	}
+	sleep(seconds);
+	running = 0;
+	pthread_join(writer, NULL);
+	unsigned long torn = 0;
+	for (int i = 0; i < readerCount; i++) {
+		pthread_join(readers[i].thread, NULL);
+		printf("reader %d: %.0f reads/s, %.2f%% retried, %.0f copies/s\n", i, (double) readers[i].reads / seconds,
+				100.0 * readers[i].retries / (readers[i].reads + readers[i].retries + 1),
+				(double) readers[i].copies / seconds);
+		torn += readers[i].torn;
+	}
+	printf("%d cells, %.0f publishes/s, %lu torn reads\n", cellCount * BATTERY_COUNT, (double) published / seconds,
+			torn);
+	shm_unlink(name);
+	return torn != 0;
+}
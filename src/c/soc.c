@@ -0,0 +1,377 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/** State of Charge, the readings of whichever source is configured, see socSource.h */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "soc.h"
+#include "socSource.h"
+#include "coulombCounter.h"
+
+// instantaneous currents kept for soc_getInstCurrentAt(), a power of two
+#define CURRENT_HISTORY 1024
+// seconds between readings beyond which we won't interpolate
+#define MAX_CURRENT_GAP 1
+#define MAX_LISTENERS 8
+
+struct currentReading_t {
+	struct timeval received;
+	double current;
+};
+
+static const struct socSource_t *sources[] = { &socEvision_source, &socReplay_source, &socSynthetic_source };
+
+/*
+ * Written only by the source's thread. sequence is odd while a reading is being written into state, readers copy
+ * state and try again if sequence changed while they did.
+ */
+static struct soc_snapshot_t state;
+static unsigned long sequence;
+static struct coulombCounter_t counter;
+// in the order they were received, the latest is currents[(currentCount - 1) % CURRENT_HISTORY]
+static struct currentReading_t currents[CURRENT_HISTORY];
+static unsigned long currentCount;
+
+// soc_getError() gives the source this long to send its first readings
+static struct timeval started;
+
+// a listener is written before the count that includes it is published so the source thread can call them unlocked
+static void (*socEventListeners[MAX_LISTENERS])();
+static unsigned int socEventListenerCount;
+static void (*instVoltageListeners[MAX_LISTENERS])(const struct timeval *received);
+static unsigned int instVoltageListenerCount;
+
+void soc_getSnapshot(struct soc_snapshot_t *snapshot) {
+	while (1) {
+		unsigned long before = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			// let the source finish if we are sharing its CPU
+			sched_yield();
+			continue;
+		}
+		memcpy(snapshot, &state, sizeof(struct soc_snapshot_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&sequence, __ATOMIC_RELAXED) == before) {
+			return;
+		}
+	}
+}
+
+static double secondsBetween(const struct timeval *from, const struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+/** Only called between reading sequence, what it reads may be torn and must be checked against sequence after */
+static int findCurrent(const struct timeval *when, double *current) {
+	unsigned long count = currentCount;
+	if (count == 0) {
+		return 2;
+	}
+	unsigned long low = count > CURRENT_HISTORY ? count - CURRENT_HISTORY : 0;
+	unsigned long high = count - 1;
+	if (timercmp(when, &currents[high % CURRENT_HISTORY].received, >)) {
+		return SOC_NOT_YET;
+	}
+	if (timercmp(when, &currents[low % CURRENT_HISTORY].received, <)) {
+		return 2;
+	}
+	// the first reading at or after when
+	while (low < high) {
+		unsigned long middle = low + (high - low) / 2;
+		if (timercmp(&currents[middle % CURRENT_HISTORY].received, when, <)) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	const struct currentReading_t *after = currents + low % CURRENT_HISTORY;
+	if (!timercmp(&after->received, when, !=)) {
+		*current = after->current;
+		return 0;
+	}
+	const struct currentReading_t *before = currents + (low - 1) % CURRENT_HISTORY;
+	double gap = secondsBetween(&before->received, &after->received);
+	if (gap <= 0 || gap > MAX_CURRENT_GAP) {
+		return 2;
+	}
+	double fraction = secondsBetween(&before->received, when) / gap;
+	*current = before->current + (after->current - before->current) * fraction;
+	return 0;
+}
+
+int soc_getInstCurrentAt(const struct timeval *when, double *current) {
+	while (1) {
+		unsigned long before = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			sched_yield();
+			continue;
+		}
+		double result;
+		int error = findCurrent(when, &result);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&sequence, __ATOMIC_RELAXED) == before) {
+			if (!error) {
+				*current = result;
+			}
+			return error;
+		}
+	}
+}
+double soc_getCurrent() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.current;
+}
+
+double soc_getVoltage() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.voltage;
+}
+
+double soc_getAh() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.ah;
+}
+
+double soc_getHalfVoltage() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.halfVoltage;
+}
+
+double soc_getInstCurrent() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.instCurrent;
+}
+
+double soc_getInstVoltage() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.instVoltage;
+}
+
+double soc_getInstHalfVoltage() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.instHalfVoltage;
+}
+
+double soc_getWh() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.wh;
+}
+
+double soc_getIntegratedAh() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.integratedAh;
+}
+
+double soc_getIntegratedWh() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.integratedWh;
+}
+
+double soc_getT1() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.t1;
+}
+
+double soc_getT2() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.t2;
+}
+
+double soc_getSpeed() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	return snapshot.speed;
+}
+
+static char isStale(const struct timeval *received, const struct timeval *now) {
+	const struct timeval *since = received->tv_sec ? received : &started;
+	return now->tv_sec - since->tv_sec > 5;
+}
+
+char soc_getError() {
+	struct soc_snapshot_t snapshot;
+	soc_getSnapshot(&snapshot);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return isStale(snapshot.received + SOC_VOLTAGE, &now) || isStale(snapshot.received + SOC_CURRENT, &now);
+}
+
+
+static void beginUpdate() {
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void endUpdate() {
+	state.integratedAh = counter.ah;
+	state.integratedWh = counter.wh;
+	state.ahCorrection = counter.ahCorrection;
+	state.whCorrection = counter.whCorrection;
+	state.charge = counter.charge;
+	state.version++;
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+	unsigned int count = __atomic_load_n(&socEventListenerCount, __ATOMIC_ACQUIRE);
+	for (unsigned int i = 0; i < count; i++) {
+		socEventListeners[i]();
+	}
+}
+
+void socSource_updateCurrent(double current, const struct timeval *received) {
+	beginUpdate();
+	state.current = current;
+	state.received[SOC_CURRENT] = *received;
+	endUpdate();
+}
+
+void socSource_updateInstCurrent(double current, const struct timeval *received) {
+	beginUpdate();
+	state.instCurrent = current;
+	state.received[SOC_INST_CURRENT] = *received;
+	coulombCounter_addCurrent(&counter, current, received);
+	struct currentReading_t *reading = currents + currentCount % CURRENT_HISTORY;
+	reading->received = *received;
+	reading->current = current;
+	currentCount++;
+	state.received[SOC_INTEGRATED_AH] = *received;
+	state.received[SOC_INTEGRATED_WH] = *received;
+	endUpdate();
+}
+
+void socSource_updateVoltage(double voltage, double halfVoltage, const struct timeval *received) {
+	beginUpdate();
+	state.voltage = voltage;
+	state.halfVoltage = halfVoltage;
+	state.received[SOC_VOLTAGE] = *received;
+	state.received[SOC_HALF_VOLTAGE] = *received;
+	endUpdate();
+}
+
+void socSource_updateInstVoltage(double voltage, double halfVoltage, const struct timeval *received) {
+	beginUpdate();
+	state.instVoltage = voltage;
+	state.instHalfVoltage = halfVoltage;
+	state.received[SOC_INST_VOLTAGE] = *received;
+	state.received[SOC_INST_HALF_VOLTAGE] = *received;
+	coulombCounter_addVoltage(&counter, voltage);
+	endUpdate();
+	unsigned int count = __atomic_load_n(&instVoltageListenerCount, __ATOMIC_ACQUIRE);
+	for (unsigned int i = 0; i < count; i++) {
+		instVoltageListeners[i](received);
+	}
+}
+
+void socSource_updateAh(double ah, const struct timeval *received) {
+	beginUpdate();
+	state.ah = ah;
+	state.received[SOC_AH] = *received;
+	coulombCounter_correctAh(&counter, ah, received);
+	endUpdate();
+}
+
+void socSource_updateWh(double wh, const struct timeval *received) {
+	beginUpdate();
+	state.wh = wh;
+	state.received[SOC_WH] = *received;
+	coulombCounter_correctWh(&counter, wh, received);
+	endUpdate();
+}
+
+void socSource_updateTemperatures(double t1, double t2, const struct timeval *received) {
+	beginUpdate();
+	state.t1 = t1;
+	state.t2 = t2;
+	state.received[SOC_T1] = *received;
+	state.received[SOC_T2] = *received;
+	endUpdate();
+}
+
+void socSource_updateSpeed(double speed, const struct timeval *received) {
+	beginUpdate();
+	state.speed = speed;
+	state.received[SOC_SPEED] = *received;
+	endUpdate();
+}
+
+void socSource_sleepUntil(const struct timeval *start, double seconds, struct timeval *received) {
+	long long microseconds = start->tv_usec + (long long) (seconds * 1000000);
+	received->tv_sec = start->tv_sec + microseconds / 1000000;
+	received->tv_usec = microseconds % 1000000;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	double remaining = secondsBetween(&now, received);
+	if (remaining > 0) {
+		struct timespec delay = { (time_t) remaining, (long) ((remaining - (time_t) remaining) * 1e9) };
+		nanosleep(&delay, NULL);
+	}
+}
+
+int soc_init(struct config_t *config) {
+	gettimeofday(&started, NULL);
+	coulombCounter_init(&counter);
+	const char *name = config->socSource ? config->socSource : socEvision_source.name;
+	for (unsigned int i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+		if (!strcmp(name, sources[i]->name)) {
+			return sources[i]->start(config);
+		}
+	}
+	fprintf(stderr, "unknown SOC source '%s'\n", name);
+	return 1;
+}
+
+// registration isn't expected to race with itself, only with the source calling the listeners
+
+void soc_registerSocEventListener(void (*socEventListener)()) {
+	unsigned int i = __atomic_load_n(&socEventListenerCount, __ATOMIC_RELAXED);
+	if (i == MAX_LISTENERS) {
+		fprintf(stderr, "too many soc listeners\n");
+		return;
+	}
+	socEventListeners[i] = socEventListener;
+	__atomic_store_n(&socEventListenerCount, i + 1, __ATOMIC_RELEASE);
+}
+
+void soc_registerInstVoltageListener(void (*instVoltageListener)(const struct timeval *received)) {
+	unsigned int i = __atomic_load_n(&instVoltageListenerCount, __ATOMIC_RELAXED);
+	if (i == MAX_LISTENERS) {
+		fprintf(stderr, "too many instantaneous voltage listeners\n");
+		return;
+	}
+	instVoltageListeners[i] = instVoltageListener;
+	__atomic_store_n(&instVoltageListenerCount, i + 1, __ATOMIC_RELEASE);
+}
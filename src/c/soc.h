@@ -18,10 +18,67 @@
  <http://www.gnu.org/licenses/>.
  */
 
-/** State of Charge interface */
-
-/** Initialisation function, return 0 if successful */
-int soc_init();
+#ifndef TUMANAKO_SOC_H_
+#define TUMANAKO_SOC_H_
+
+/** State of Charge interface, the readings come from the source chosen in the configuration, see socSource.h */
+
+#include <sys/time.h>
+
+typedef enum {
+	SOC_CURRENT,
+	SOC_VOLTAGE,
+	SOC_HALF_VOLTAGE,
+	SOC_INST_CURRENT,
+	SOC_INST_VOLTAGE,
+	SOC_INST_HALF_VOLTAGE,
+	SOC_AH,
+	SOC_WH,
+	SOC_T1,
+	SOC_T2,
+	SOC_SPEED,
+	SOC_INTEGRATED_AH,
+	SOC_INTEGRATED_WH,
+	SOC_FIELD_COUNT
+} soc_field_t;
+
+/** Everything we know about the state of charge at one moment, values are as returned by the getters below */
+struct soc_snapshot_t {
+	// incremented each time a value changes
+	unsigned long version;
+	double current;
+	double voltage;
+	double halfVoltage;
+	double instCurrent;
+	double instVoltage;
+	double instHalfVoltage;
+	double ah;
+	double wh;
+	double t1;
+	double t2;
+	double speed;
+	// ah and wh integrated from the instantaneous current and voltage, updated with every instantaneous current
+	double integratedAh;
+	double integratedWh;
+	// how much integratedAh and integratedWh have been corrected to keep them with ah and wh
+	double ahCorrection;
+	double whCorrection;
+	// Ah integrated since we started without corrections, the difference between two is the charge in between
+	double charge;
+	// when the kernel received the frame each value came from, indexed by soc_field_t, zero if we haven't had one
+	struct timeval received[SOC_FIELD_COUNT];
+};
+
+struct config_t;
+
+/** Initialisation function, starts the configured source, return 0 if successful */
+int soc_init(struct config_t *config);
+
+/**
+ * Copy the latest values, all of them as they were at once. Never blocks, use this rather than several getters when
+ * the values are used together.
+ */
+void soc_getSnapshot(struct soc_snapshot_t *snapshot);
 
 /** Returns true if there is an error */
 char soc_getError();
@@ -44,12 +101,33 @@ double soc_getInstVoltage();
 /** Get the half-pack voltage */
 double soc_getInstHalfVoltage();
 
+// returned by soc_getInstCurrentAt() when we haven't had an instantaneous current after the time asked for yet
+#define SOC_NOT_YET 1
+
+/**
+ * Interpolate the instantaneous current at when, the time from gettimeofday(), between the readings either side. Only
+ * the last few seconds of readings are kept.
+ *
+ * @return 0 if successful, SOC_NOT_YET if there is no reading after when yet, anything else if when is before the
+ * readings we kept or the readings either side are too far apart to say
+ */
+int soc_getInstCurrentAt(const struct timeval *when, double *current);
+
 /** Get the state of charge. Positive is discharged, negative is over charged. */
 double soc_getAh();
 
 /** Get the Wh consumed. Positive is discharged, negative is over charged. */
 double soc_getWh();
 
+/**
+ * Get the state of charge integrated from the instantaneous current. Follows soc_getAh() but changes with every
+ * instantaneous current reading rather than in 0.01Ah steps.
+ */
+double soc_getIntegratedAh();
+
+/** Get the Wh consumed integrated from the instantaneous current and voltage, follows soc_getWh() */
+double soc_getIntegratedWh();
+
 /** Get EVision temperature 1 */
 double soc_getT1();
 
@@ -59,5 +137,9 @@ double soc_getT2();
 /** Get speed */
 double soc_getSpeed();
 
+/** Called on the source's thread after every reading */
 void soc_registerSocEventListener(void (*socEventListener)());
-void soc_registerInstVoltageListener(void (*instVoltageListner)());
+/** Called on the source's thread with the time each instantaneous voltage was received */
+void soc_registerInstVoltageListener(void (*instVoltageListner)(const struct timeval *received));
+
+#endif /* TUMANAKO_SOC_H_ */
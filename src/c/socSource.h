@@ -0,0 +1,74 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_SOC_SOURCE_H_
+#define TUMANAKO_SOC_SOURCE_H_
+
+#include <sys/time.h>
+#include <linux/can.h>
+
+/*
+ * Where the readings behind soc.h come from. soc_init() starts the source named by socSource in the configuration:
+ *
+ *	evision		the EVision on the CAN bus
+ *	replay		socReplayFile, a candump -l log of EVision traffic or a hiRes.txt, at socReplaySpeed times the
+ *			recorded rate
+ *	synthetic	a repeating socSyntheticProfile, "drive" or "charge", at socReplaySpeed times real time
+ *
+ * Replayed and synthetic readings are stamped as if they were received now so everything downstream works as it
+ * does with an EVision. A source delivers its readings from a single thread by calling the socSource_update
+ * functions, which also call the soc.h listeners.
+ */
+
+struct config_t;
+
+struct socSource_t {
+	const char *name;
+	/** Start delivering readings, @return 0 if successful */
+	int (*start)(struct config_t *config);
+};
+
+extern const struct socSource_t socEvision_source;
+extern const struct socSource_t socReplay_source;
+extern const struct socSource_t socSynthetic_source;
+
+// units and signs are those of the soc.h getters, received is as from gettimeofday()
+void socSource_updateCurrent(double current, const struct timeval *received);
+void socSource_updateInstCurrent(double current, const struct timeval *received);
+void socSource_updateVoltage(double voltage, double halfVoltage, const struct timeval *received);
+void socSource_updateInstVoltage(double voltage, double halfVoltage, const struct timeval *received);
+void socSource_updateAh(double ah, const struct timeval *received);
+void socSource_updateWh(double wh, const struct timeval *received);
+void socSource_updateTemperatures(double t1, double t2, const struct timeval *received);
+void socSource_updateSpeed(double speed, const struct timeval *received);
+
+/** Sleep until seconds after start, for sources making up their own timing, received is set to that time */
+void socSource_sleepUntil(const struct timeval *start, double seconds, struct timeval *received);
+
+/** Decode an EVision frame, @return 0 if it was one */
+int socEvision_decode(struct can_frame *frame, const struct timeval *received);
+
+/**
+ * Parse a line written by candump -l, e.g. "(1365000000.123456) slcan0 702#0011223344556677"
+ *
+ * @return 0 if successful
+ */
+int socReplay_parseCandumpLine(const char *line, double *when, struct can_frame *frame);
+
+#endif /* TUMANAKO_SOC_SOURCE_H_ */
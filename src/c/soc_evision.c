@@ -18,40 +18,21 @@
  <http://www.gnu.org/licenses/>.
  */
 
-/** State of Charge implementation using SocketCAN and an EVision */
+/** State of Charge source using SocketCAN and an EVision */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <signal.h>
-#include <ctype.h>
-#include <libgen.h>
-#include <time.h>
-
-#include "soc.h"
-#include "canEventListener.h"
-
-static void (*socEventListeners[10])();
-static void (*instVoltageListeners[10])();
+#include <sys/time.h>
 
-volatile unsigned short volts = 0;
-volatile long chargeCurrent = 0;
-volatile long dischargeCurrent = 0;
-volatile short aH = 0;
-volatile short halfVoltage = 0;
-volatile long wH = 0;
-volatile short t1 = 0;
-volatile short t2 = 0;
-volatile short speed = 0;
-
-volatile unsigned short instVolts = 0;
-volatile unsigned short instHalfVoltage = 0;
-volatile long instChargeCurrent = 0;
-volatile long instDischargeCurrent = 0;
+#include "config.h"
+#include "socSource.h"
+#include "canEventListener.h"
 
-time_t lastValidCurrent;
-time_t lastValidVoltage;
+struct decoder_t {
+	canid_t canId;
+	void (*decode)(struct can_frame *frame, const struct timeval *received);
+};
 
 /**
  * Make a short from the 16 bits starting at c
@@ -95,154 +76,85 @@ static long makeLong(__u8 *c) {
 	return result;
 }
 
-double soc_getCurrent() {
-	if (chargeCurrent != 0) {
-		return chargeCurrent / (double) -100;
-	}
-	if (dischargeCurrent != 0) {
-		return dischargeCurrent / (double) 100;
-	}
-	return 0;
-}
-
-double soc_getVoltage() {
-	return volts / (double) 100;
-}
-
-double soc_getAh() {
-	return aH / (double) 100;
-}
-
-double soc_getHalfVoltage() {
-	return halfVoltage / (double) 100;
-}
-
-double soc_getInstCurrent() {
-	if (instChargeCurrent != 0) {
-		return instChargeCurrent / (double) -100;
+/** The EVision sends charge and discharge current separately, @return the current, negative is charging */
+static double toCurrent(unsigned long charge, unsigned long discharge) {
+	if (charge != 0) {
+		return charge / (double) -100;
 	}
-	if (instDischargeCurrent != 0) {
-		return instDischargeCurrent / (double) 100;
+	if (discharge != 0) {
+		return discharge / (double) 100;
 	}
 	return 0;
 }
 
-double soc_getInstVoltage() {
-	return instVolts / (double) 100;
+static void decode700(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateInstCurrent(toCurrent(make24BitLong(frame->data), make24BitLong(frame->data + 4)), received);
 }
 
-double soc_getInstHalfVoltage() {
-	return instHalfVoltage / (double) 100;
+static void decode701(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateCurrent(toCurrent(make24BitLong(frame->data), make24BitLong(frame->data + 4)), received);
 }
 
-double soc_getWh() {
-	return wH / (double) 100;
+static void decode702(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateInstVoltage(makeShort(frame->data + 1) / (double) 100, makeShort(frame->data + 4) / (double) 100,
+			received);
 }
 
-double soc_getT1() {
-	return t1 / (double) 100;
+static void decode703(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateVoltage(makeShort(frame->data + 1) / (double) 100,
+			(short) makeShort(frame->data + 4) / (double) 100, received);
 }
 
-double soc_getT2() {
-	return t2 / (double) 100;
+static void decode704(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateTemperatures((short) makeShort(frame->data + 2) / (double) 100,
+			(short) makeShort(frame->data + 4) / (double) 100, received);
 }
 
-double soc_getSpeed() {
-	return speed / (double) 100;
+static void decode705(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateAh((short) makeShort(frame->data + 1) / (double) 100, received);
 }
 
-char soc_getError() {
-	time_t now;
-	time(&now);
-	return now - lastValidVoltage > 5 || now - lastValidCurrent > 5;
+static void decode706(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateWh(makeLong(frame->data) / (double) 100, received);
 }
 
-static void decode700(struct can_frame *frame) {
-	instDischargeCurrent = make24BitLong(frame->data + 4);
-	instChargeCurrent = make24BitLong(frame->data);
+static void decode708(struct can_frame *frame, const struct timeval *received) {
+	socSource_updateSpeed((short) makeShort(frame->data) / (double) 100, received);
 }
 
-static void decode701(struct can_frame *frame) {
-	dischargeCurrent = make24BitLong(frame->data + 4);
-	chargeCurrent = make24BitLong(frame->data);
-	time(&lastValidCurrent);
-}
+static struct decoder_t decoders[] = {
+		{ 0x700, decode700 },
+		{ 0x701, decode701 },
+		{ 0x702, decode702 },
+		{ 0x703, decode703 },
+		{ 0x704, decode704 },
+		{ 0x705, decode705 },
+		{ 0x706, decode706 },
+		{ 0x708, decode708 },
+};
 
-static void decode702(struct can_frame *frame) {
-	instVolts = makeShort(frame->data + 1);
-	instHalfVoltage = makeShort(frame->data + 4);
-	for (int i = 0; instVoltageListeners[i]; i++) {
-		instVoltageListeners[i]();
+int socEvision_decode(struct can_frame *frame, const struct timeval *received) {
+	for (unsigned int i = 0; i < sizeof(decoders) / sizeof(struct decoder_t); i++) {
+		if (decoders[i].canId == frame->can_id) {
+			decoders[i].decode(frame, received);
+			return 0;
+		}
 	}
+	return 1;
 }
 
-static void decode703(struct can_frame *frame) {
-	volts = makeShort(frame->data + 1);
-	halfVoltage = makeShort(frame->data + 4);
-	time(&lastValidVoltage);
+static void decoderFrameListener(struct can_frame *frame, const struct timeval *received, void *context) {
+	struct decoder_t *decoder = context;
+	decoder->decode(frame, received);
 }
 
-static void decode705(struct can_frame *frame) {
-	aH = makeShort(frame->data + 1);
-}
-
-static void decode706(struct can_frame *frame) {
-	wH = makeLong(frame->data);
-}
-
-static void decode704(struct can_frame *frame) {
-	t1 = makeShort(frame->data + 2);
-	t2 = makeShort(frame->data + 4);
-}
-
-static void decode708(struct can_frame *frame) {
-	speed = makeShort(frame->data);
-}
-
-void rawCanListener(struct can_frame *frame) {
-	if (frame->can_id == 0x703) {
-		decode703(frame);
-	} else if (frame->can_id == 0x705) {
-		decode705(frame);
-	} else if (frame->can_id == 0x706) {
-		decode706(frame);
-	} else if (frame->can_id == 0x701) {
-		decode701(frame);
-	} else if (frame->can_id == 0x704) {
-		decode704(frame);
-	} else if (frame->can_id == 0x708) {
-		decode708(frame);
-	} else if (frame->can_id == 0x700) {
-		decode700(frame);
-	} else if (frame->can_id == 0x702) {
-		decode702(frame);
-	} else {
-		return;
+static int start(struct config_t *config __attribute__ ((unused))) {
+	for (unsigned int i = 0; i < sizeof(decoders) / sizeof(struct decoder_t); i++) {
+		if (canEventListener_registerFrameListener(decoders[i].canId, CAN_SFF_MASK, decoderFrameListener, decoders + i)) {
+			return 1;
+		}
 	}
-	for (int i = 0; socEventListeners[i]; i++) {
-		socEventListeners[i]();
-	}
-}
-
-int soc_init() {
-	time(&lastValidCurrent);
-	time(&lastValidVoltage);
-	canEventListener_registerRawCanListener(rawCanListener);
 	return 0;
 }
 
-void soc_registerSocEventListener(void (*socEventListener)()) {
-	int i = 0;
-	while (socEventListeners[i] != NULL) {
-		i++;
-	}
-	socEventListeners[i] = socEventListener;
-}
-
-void soc_registerInstVoltageListener(void (*instVoltageListener)()) {
-	int i = 0;
-	while (instVoltageListeners[i] != NULL) {
-		i++;
-	}
-	instVoltageListeners[i] = instVoltageListener;
-}
+const struct socSource_t socEvision_source = { "evision", start };
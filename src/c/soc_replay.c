@@ -0,0 +1,120 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/** State of Charge source replaying a recorded log, see socSource.h */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "socSource.h"
+
+// seconds, longer gaps in the log, eg between hiRes captures, are cut to a second
+#define MAX_GAP 60
+
+static FILE *logFile;
+static const char *logFileName;
+static unsigned short speed;
+static pthread_t replayThread;
+
+int socReplay_parseCandumpLine(const char *line, double *when, struct can_frame *frame) {
+	char data[17];
+	unsigned int canId;
+	if (sscanf(line, "(%lf) %*s %x#%16[0-9A-Fa-f]", when, &canId, data) != 3) {
+		return 1;
+	}
+	memset(frame, 0, sizeof(struct can_frame));
+	frame->can_id = canId;
+	frame->can_dlc = strlen(data) / 2;
+	for (int i = 0; i < frame->can_dlc; i++) {
+		unsigned int byte;
+		sscanf(data + i * 2, "%2x", &byte);
+		frame->data[i] = byte;
+	}
+	return 0;
+}
+
+/** A line of hiRes.txt, "1370000000.123 330.12 -123.45 12.3", @return 0 if successful */
+static int parseHiResLine(const char *line, double *when, double *voltage, double *current, double *kmh) {
+	return sscanf(line, "%lf %lf %lf %lf", when, voltage, current, kmh) != 4;
+}
+
+static void *replayThreadMain(void *unused __attribute__ ((unused))) {
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	// seconds into the replay of the last reading and when it was recorded
+	double elapsed = 0;
+	double last = -1;
+	unsigned long count = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), logFile)) {
+		double when;
+		double voltage, current, kmh;
+		struct can_frame frame;
+		unsigned char isCan = !socReplay_parseCandumpLine(line, &when, &frame);
+		if (!isCan && parseHiResLine(line, &when, &voltage, &current, &kmh)) {
+			continue;
+		}
+		if (last >= 0) {
+			double gap = when - last;
+			elapsed += gap > MAX_GAP ? 1 : gap > 0 ? gap : 0;
+		}
+		last = when;
+		struct timeval received;
+		socSource_sleepUntil(&start, elapsed / speed, &received);
+		if (isCan) {
+			if (socEvision_decode(&frame, &received)) {
+				continue;
+			}
+		} else {
+			// hiRes.txt only has the instantaneous values, the averages follow them
+			socSource_updateInstCurrent(current, &received);
+			socSource_updateInstVoltage(voltage, 0, &received);
+			socSource_updateCurrent(current, &received);
+			socSource_updateVoltage(voltage, 0, &received);
+			socSource_updateSpeed(kmh, &received);
+		}
+		count++;
+	}
+	fprintf(stderr, "replayed %lu readings from %s\n", count, logFileName);
+	fclose(logFile);
+	return NULL;
+}
+
+static int start(struct config_t *config) {
+	if (!config->socReplayFile) {
+		fprintf(stderr, "socReplayFile is needed to replay\n");
+		return 1;
+	}
+	logFileName = config->socReplayFile;
+	logFile = fopen(logFileName, "r");
+	if (!logFile) {
+		perror(logFileName);
+		return 1;
+	}
+	speed = config->socReplaySpeed ? config->socReplaySpeed : 1;
+	return pthread_create(&replayThread, NULL, replayThreadMain, NULL);
+}
+
+const struct socSource_t socReplay_source = { "replay", start };
@@ -0,0 +1,140 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/** State of Charge source making up readings from a repeating profile, see socSource.h */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "socSource.h"
+
+// instantaneous readings per second, the rest are sent once a second
+#define RATE 10
+#define CELL_VOLTAGE 3.3
+// ohms
+#define CELL_RESISTANCE 0.001
+#define TEMPERATURE 25
+
+struct step_t {
+	double seconds;
+	// A, positive is discharging
+	double current;
+	// km/h
+	double speed;
+};
+
+struct profile_t {
+	const char *name;
+	const struct step_t *steps;
+	unsigned int stepCount;
+};
+
+static const struct step_t drive[] = {
+		{ 20, 2, 0 },
+		{ 10, 150, 40 },
+		{ 60, 60, 60 },
+		{ 10, -40, 30 },
+		{ 30, 80, 50 },
+		{ 10, 2, 0 },
+};
+
+static const struct step_t charge[] = {
+		{ 60 * 60, -20, 0 },
+};
+
+static const struct profile_t profiles[] = {
+		{ "drive", drive, sizeof(drive) / sizeof(struct step_t) },
+		{ "charge", charge, sizeof(charge) / sizeof(struct step_t) },
+};
+
+static const struct profile_t *profile;
+static unsigned short speed;
+static unsigned short cellCount;
+static pthread_t generatorThread;
+
+/** @return the step of the profile t seconds in, it repeats */
+static const struct step_t *getStep(double t) {
+	double length = 0;
+	for (unsigned int i = 0; i < profile->stepCount; i++) {
+		length += profile->steps[i].seconds;
+	}
+	t = fmod(t, length);
+	for (unsigned int i = 0; i < profile->stepCount; i++) {
+		if (t < profile->steps[i].seconds) {
+			return profile->steps + i;
+		}
+		t -= profile->steps[i].seconds;
+	}
+	return profile->steps + profile->stepCount - 1;
+}
+
+static void *generatorThreadMain(void *unused __attribute__ ((unused))) {
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	double ah = 0;
+	double wh = 0;
+	for (unsigned long tick = 0; 1; tick++) {
+		double t = (double) tick / RATE;
+		const struct step_t *step = getStep(t);
+		double voltage = cellCount * (CELL_VOLTAGE - step->current * CELL_RESISTANCE);
+		ah += step->current / RATE / (60 * 60);
+		wh += step->current * voltage / RATE / (60 * 60);
+		struct timeval received;
+		socSource_sleepUntil(&start, t / speed, &received);
+		socSource_updateInstCurrent(step->current, &received);
+		socSource_updateInstVoltage(voltage, voltage / 2, &received);
+		if (tick % RATE == 0) {
+			socSource_updateCurrent(step->current, &received);
+			socSource_updateVoltage(voltage, voltage / 2, &received);
+			socSource_updateTemperatures(TEMPERATURE, TEMPERATURE, &received);
+			socSource_updateAh(ah, &received);
+			socSource_updateWh(wh, &received);
+			socSource_updateSpeed(step->speed, &received);
+		}
+	}
+	return NULL;
+}
+
+static int start(struct config_t *config) {
+	const char *name = config->socSyntheticProfile ? config->socSyntheticProfile : profiles[0].name;
+	for (unsigned int i = 0; i < sizeof(profiles) / sizeof(struct profile_t); i++) {
+		if (!strcmp(name, profiles[i].name)) {
+			profile = profiles + i;
+		}
+	}
+	if (!profile) {
+		fprintf(stderr, "unknown synthetic SOC profile '%s'\n", name);
+		return 1;
+	}
+	speed = config->socReplaySpeed ? config->socReplaySpeed : 1;
+	// the first battery is the accessory battery if there is more than one
+	for (unsigned char i = config->batteryCount > 1 ? 1 : 0; i < config->batteryCount; i++) {
+		cellCount += config->batteries[i].cellCount;
+	}
+	return pthread_create(&generatorThread, NULL, generatorThreadMain, NULL);
+}
+
+const struct socSource_t socSynthetic_source = { "synthetic", start };
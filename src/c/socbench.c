@@ -0,0 +1,138 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Charge and discharge a made up battery whose cells start at different SOCs and hold different amounts, checking the
+ * SOC estimates follow them, then time a step of the filter.
+ *
+ * socbench [cells [iterations]]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "config.h"
+#include "cellStore.h"
+#include "cellSoc.h"
+
+#define RATED_CAPACITY 100
+#define RESISTANCE 0.001
+#define SWEEP_SECONDS 10
+
+static struct cellStore_t store;
+static struct cellSoc_filter_t filter;
+static double *socs;
+static double *capacities;
+
+static double randomBetween(double from, double to) {
+	return from + (to - from) * rand() / RAND_MAX;
+}
+
+/** Move every cell by charge Ah and read its voltage, with a few mV of noise and now and then a missed reading */
+static void sweep(unsigned short cellCount, double current, double charge) {
+	cellStore_beginSweep(&store);
+	for (unsigned short i = 0; i < cellCount; i++) {
+		socs[i] = fmin(fmax(socs[i] - charge / capacities[i], 0), 1);
+		if (rand() % 50 == 0) {
+			continue;
+		}
+		double voltage = cellSoc_getOpenCircuitVoltage(socs[i]) - current * RESISTANCE + randomBetween(-0.003, 0.003);
+		cellStore_update(&store, i, lround(voltage * 1000), 0, 0, 0);
+	}
+}
+
+/** Sweep at current until any cell reaches until, @return the worst SOC error at the end */
+static double run(unsigned short cellCount, double current, double until) {
+	double charge = current * SWEEP_SECONDS / (60 * 60);
+	for (int i = 0; i < 100000; i++) {
+		sweep(cellCount, current, charge);
+		cellSoc_step(&filter, &store, current, charge, SWEEP_SECONDS);
+		unsigned char done = 0;
+		for (unsigned short j = 0; j < cellCount; j++) {
+			done |= current < 0 ? socs[j] >= until : socs[j] <= until;
+		}
+		if (done) {
+			break;
+		}
+	}
+	double worst = 0;
+	for (unsigned short i = 0; i < cellCount; i++) {
+		struct cellSoc_estimate_t estimate;
+		if (cellSoc_getEstimate(&filter, i, &estimate)) {
+			return 1;
+		}
+		worst = fmax(worst, fabs(estimate.soc - socs[i]));
+	}
+	return worst;
+}
+
+/** @return the RMS capacity error (Ah) */
+static double capacityError(unsigned short cellCount) {
+	double total = 0;
+	for (unsigned short i = 0; i < cellCount; i++) {
+		struct cellSoc_estimate_t estimate;
+		double capacity = cellSoc_getEstimate(&filter, i, &estimate) ? RATED_CAPACITY : estimate.capacity;
+		total += (capacity - capacities[i]) * (capacity - capacities[i]);
+	}
+	return sqrt(total / cellCount);
+}
+
+static double nanosecondsSince(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned short cellCount = argc > 1 ? atoi(argv[1]) : MAX_CELLS;
+	long iterations = argc > 2 ? atol(argv[2]) : 10000;
+	socs = calloc(cellCount, sizeof(double));
+	capacities = calloc(cellCount, sizeof(double));
+	if (!socs || !capacities || cellStore_init(&store, cellCount)
+			|| cellSoc_initFilter(&filter, cellCount, RATED_CAPACITY, RESISTANCE)) {
+		return 1;
+	}
+	srand(1);
+	for (unsigned short i = 0; i < cellCount; i++) {
+		socs[i] = randomBetween(0.2, 0.4);
+		capacities[i] = RATED_CAPACITY * randomBetween(0.85, 1.05);
+	}
+	printf("rms capacity error %.1fAh at the start\n", capacityError(cellCount));
+	double worst = run(cellCount, -20, 0.99);
+	printf("worst SOC error %.3f at the end of a charge, rms capacity error %.1fAh\n", worst, capacityError(cellCount));
+	worst = run(cellCount, 50, 0.05);
+	printf("worst SOC error %.3f at the end of a discharge, rms capacity error %.1fAh\n", worst,
+			capacityError(cellCount));
+	worst = run(cellCount, -20, 0.99);
+	printf("worst SOC error %.3f at the end of another charge, rms capacity error %.1fAh\n", worst,
+			capacityError(cellCount));
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		cellSoc_step(&filter, &store, 10, 10.0 / (60 * 60), 1);
+	}
+	double stepTime = nanosecondsSince(&start) / iterations;
+	printf("%d cells: %.1fus a step, %.1fns a cell\n", cellCount, stepTime / 1000, stepTime / cellCount);
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drive made up phases and cell transactions through monitorStats, then check the report served on the stats socket,
+ * that a client going away before reading doesn't kill us, that the timing trace is one well formed event per line and
+ * that a stats socket we can't open doesn't stop us. Reports what recording a transaction costs.
+ *
+ * statsbench [sweeps [cells]]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "monitor.h"
+#include "monitorStats.h"
+
+static char socketName[64];
+static char traceName[64];
+
+const char *monitor_getStateString(monitor_state_t state) {
+	static const char *names[MONITOR_STATE_COUNT] = { "Start", "Sleeping", "Waking Slaves", "Turn off shunts",
+			"Wait for valid data", "Reading voltage", "Turn on shunts", "Wait for data", "Reading current" };
+	return state < MONITOR_STATE_COUNT ? names[state] : "unknown";
+}
+
+static int connectToStats() {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketName);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *) &address, sizeof(address))) {
+		perror(socketName);
+		exit(1);
+	}
+	return fd;
+}
+
+/** @return the report, the caller frees it */
+static char *readReport() {
+	int fd = connectToStats();
+	size_t capacity = 4096, length = 0;
+	char *report = malloc(capacity);
+	ssize_t result;
+	while ((result = read(fd, report + length, capacity - length - 1)) > 0) {
+		length += result;
+		if (length == capacity - 1) {
+			capacity *= 2;
+			report = realloc(report, capacity);
+		}
+	}
+	close(fd);
+	report[length] = '\0';
+	return report;
+}
+
+/** @return the number of events, -1 if a line isn't an event */
+static long checkTrace() {
+	FILE *in = fopen(traceName, "r");
+	if (!in) {
+		perror(traceName);
+		return -1;
+	}
+	char line[256];
+	long events = 0;
+	if (!fgets(line, sizeof(line), in) || strcmp(line, "[\n")) {
+		fclose(in);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), in)) {
+		if (line[0] != '{' || !strstr(line, "\"ph\":\"X\"") || strcmp(line + strlen(line) - 3, "},\n")) {
+			fprintf(stderr, "bad trace event: %s", line);
+			fclose(in);
+			return -1;
+		}
+		events++;
+	}
+	fclose(in);
+	return events;
+}
+
+int main(int argc, char *argv[]) {
+	int sweeps = argc > 1 ? atoi(argv[1]) : 1000;
+	unsigned short cellCount = argc > 2 ? atoi(argv[2]) : 100;
+	if (sweeps < 2 || cellCount < 1 || cellCount > MAX_CELLS) {
+		fprintf(stderr, "usage: statsbench [sweeps (2-) [cells (1-%d)]]\n", MAX_CELLS);
+		return 1;
+	}
+	snprintf(socketName, sizeof(socketName), "/tmp/statsbench-%d.sock", getpid());
+	snprintf(traceName, sizeof(traceName), "/tmp/statsbench-%d.json", getpid());
+	struct config_t config;
+	memset(&config, 0, sizeof(config));
+
+	// somewhere we can't create the socket, we should carry on regardless
+	config.statsSocket = "/nonexistent/stats.sock";
+	monitorStats_init(&config);
+
+	config.statsSocket = socketName;
+	config.timingTraceFile = traceName;
+	monitorStats_init(&config);
+
+	struct battery_t battery = { 0, "battery", cellCount, NULL, { 0, 0, NULL, NULL, NULL, NULL } };
+	struct status_t *cells = calloc(cellCount, sizeof(struct status_t));
+	for (unsigned short i = 0; i < cellCount; i++) {
+		cells[i].battery = &battery;
+		cells[i].cellIndex = i;
+	}
+	long long start = monitorStats_now();
+	for (int sweep = 0; sweep < sweeps; sweep++) {
+		monitorStats_enterPhase(START);
+		monitorStats_enterPhase(READ_VOLTAGE);
+		for (unsigned short i = 0; i < cellCount; i++) {
+			monitorStats_recordTransaction("summary", cells + i, monitorStats_now());
+		}
+		monitorStats_enterPhase(SLEEPING);
+		// staying in a phase keeps timing it
+		monitorStats_enterPhase(SLEEPING);
+	}
+	monitorStats_enterPhase(START);
+	long long elapsed = monitorStats_now() - start;
+	long long transactions = (long long) sweeps * cellCount;
+
+	// going away without reading mustn't take us down with SIGPIPE
+	close(connectToStats());
+	char *report = readReport();
+	fputs(report, stdout);
+	int failed = 0;
+	char expected[64];
+	// as writeHistogram() lays out the name and count
+	snprintf(expected, sizeof(expected), "%-22s %8lld", "  cell transactions", transactions);
+	if (!strstr(report, expected)) {
+		fprintf(stderr, "report doesn't have %lld transactions\n", transactions);
+		failed = 1;
+	}
+	snprintf(expected, sizeof(expected), "%-22s %8d", "Sweep", sweeps);
+	if (!strstr(report, expected)) {
+		fprintf(stderr, "report doesn't have %d sweeps\n", sweeps);
+		failed = 1;
+	}
+	free(report);
+
+	// every phase, sweep and transaction, the trace is flushed when a sweep starts
+	long events = checkTrace();
+	long expectedEvents = (long) sweeps * 4 + transactions;
+	if (events != expectedEvents) {
+		fprintf(stderr, "trace has %ld events, expected %ld\n", events, expectedEvents);
+		failed = 1;
+	}
+	printf("%lld transactions, %.0fns per transaction and its share of the phases, checks %s\n", transactions,
+			elapsed * 1000.0 / transactions, failed ? "FAILED" : "ok");
+	unlink(socketName);
+	unlink(traceName);
+	free(cells);
+	return failed;
+}
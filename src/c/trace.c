@@ -0,0 +1,241 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "util.h"
+#include "trace.h"
+
+// must be a power of 2
+#define RING_SIZE 1024
+#define TEXT_LENGTH 116
+#define DRAIN_MILLISECONDS 100
+
+/*
+ * A bounded multi producer queue, each slot's sequence says whose turn it is. A producer at position p may fill the
+ * slot when its sequence is p and publishes it by setting it to p + 1, the drain thread empties it and sets it to
+ * p + RING_SIZE for the producer one lap later. The sequence is stored less the slot index so the zeroed ring is
+ * ready to use before trace_init().
+ */
+struct record_t {
+	unsigned long storedSequence;
+	long long microseconds;
+	unsigned char subsystem;
+	unsigned char level;
+	char text[TEXT_LENGTH];
+};
+
+static const char *subsystemNames[TRACE_SUBSYSTEM_COUNT] = { "logger", "console", "charger", "monitor", "can", "soc" };
+static const char *levelNames[] = { "error", "warn", "info", "debug" };
+
+unsigned char trace_levels[TRACE_SUBSYSTEM_COUNT] = { TRACE_LEVEL_INFO, TRACE_LEVEL_INFO, TRACE_LEVEL_INFO,
+		TRACE_LEVEL_INFO, TRACE_LEVEL_INFO, TRACE_LEVEL_INFO };
+
+static struct record_t ring[RING_SIZE];
+static unsigned long head;
+static unsigned long tail;
+static unsigned long dropped;
+static unsigned long reportedDropped;
+
+static FILE *out;
+static pthread_t drainThread;
+// only one thread empties the ring at a time
+static pthread_mutex_t drainMutex = PTHREAD_MUTEX_INITIALIZER;
+// producers wake the drain thread each time they get half way round the ring
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+#define MAX_LINE_LENGTH (TEXT_LENGTH + 48)
+// producers keep filling the ring while it is emptied so this is written out whenever it is full
+static char output[RING_SIZE * MAX_LINE_LENGTH];
+
+static unsigned long getSequence(struct record_t *record) {
+	return __atomic_load_n(&record->storedSequence, __ATOMIC_ACQUIRE) + (record - ring);
+}
+
+static void setSequence(struct record_t *record, unsigned long sequence) {
+	__atomic_store_n(&record->storedSequence, sequence - (record - ring), __ATOMIC_RELEASE);
+}
+
+static int lookup(const char *name, const char **names, int count) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** Parse "level" or "subsystem=level" pairs separated by commas, @return 0 on success */
+static int parseLevels(const char *levels) {
+	char copy[strlen(levels) + 1];
+	strcpy(copy, levels);
+	char *saveptr;
+	for (char *token = strtok_r(copy, ", ", &saveptr); token; token = strtok_r(NULL, ", ", &saveptr)) {
+		char *equals = strchr(token, '=');
+		const char *levelName = equals ? equals + 1 : token;
+		int level = lookup(levelName, levelNames, sizeof(levelNames) / sizeof(levelNames[0]));
+		if (level == -1) {
+			fprintf(stderr, "unknown trace level '%s'\n", levelName);
+			return 1;
+		}
+		if (!equals) {
+			for (int i = 0; i < TRACE_SUBSYSTEM_COUNT; i++) {
+				trace_setLevel(i, level);
+			}
+			continue;
+		}
+		*equals = 0;
+		int subsystem = lookup(token, subsystemNames, TRACE_SUBSYSTEM_COUNT);
+		if (subsystem == -1) {
+			fprintf(stderr, "unknown trace subsystem '%s'\n", token);
+			return 1;
+		}
+		trace_setLevel(subsystem, level);
+	}
+	return 0;
+}
+
+void trace_setLevel(trace_subsystem_t subsystem, unsigned char level) {
+	__atomic_store_n(&trace_levels[subsystem], level, __ATOMIC_RELAXED);
+}
+
+void trace_write(trace_subsystem_t subsystem, unsigned char level, const char *format, ...) {
+	unsigned long position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	struct record_t *record;
+	while (1) {
+		record = ring + (position & (RING_SIZE - 1));
+		long difference = (long) (getSequence(record) - position);
+		if (difference == 0) {
+			if (__atomic_compare_exchange_n(&head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (difference < 0) {
+			// the drain thread hasn't emptied this slot since the last lap
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->microseconds = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+	record->subsystem = subsystem;
+	record->level = level;
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(record->text, TEXT_LENGTH, format, args);
+	va_end(args);
+	// messages may or may not end with a new line, the drain thread adds one
+	if (length > TEXT_LENGTH - 1) {
+		length = TEXT_LENGTH - 1;
+	}
+	if (length > 0 && record->text[length - 1] == '\n') {
+		record->text[length - 1] = 0;
+	}
+	setSequence(record, position + 1);
+	if ((position & (RING_SIZE / 2 - 1)) == RING_SIZE / 2 - 1) {
+		// without the mutex a wakeup can be missed but then we just wait for the timeout
+		pthread_cond_signal(&wake);
+	}
+}
+
+static void writeOutput(size_t length) {
+	if (length) {
+		fwrite(output, 1, length, out ? out : stderr);
+		fflush(out ? out : stderr);
+	}
+}
+
+void trace_flush() {
+	pthread_mutex_lock(&drainMutex);
+	size_t length = 0;
+	while (1) {
+		if (length > sizeof(output) - MAX_LINE_LENGTH) {
+			writeOutput(length);
+			length = 0;
+		}
+		struct record_t *record = ring + (tail & (RING_SIZE - 1));
+		if (getSequence(record) != tail + 1) {
+			break;
+		}
+		// "1370000000.123456 logger debug text\n"
+		char *p = output + length;
+		p += formatFixed(p, record->microseconds, 6, 6, 0);
+		p += sprintf(p, " %s %s ", subsystemNames[record->subsystem], levelNames[record->level]);
+		size_t textLength = strlen(record->text);
+		memcpy(p, record->text, textLength);
+		p += textLength;
+		*p++ = '\n';
+		length = p - output;
+		setSequence(record, tail + RING_SIZE);
+		tail++;
+	}
+	unsigned long droppedNow = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (droppedNow != reportedDropped) {
+		// there is always room for this after the last record
+		length += sprintf(output + length, "dropped %lu trace messages\n", droppedNow - reportedDropped);
+		reportedDropped = droppedNow;
+	}
+	writeOutput(length);
+	pthread_mutex_unlock(&drainMutex);
+}
+
+unsigned long trace_getDropped() {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+static void *drainThreadMain(void *ptr __attribute__ ((unused))) {
+	pthread_mutex_lock(&wakeMutex);
+	while (1) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		long long deadlineNanos = now.tv_sec * 1000000000LL + now.tv_nsec + DRAIN_MILLISECONDS * 1000000LL;
+		struct timespec until = { deadlineNanos / 1000000000, deadlineNanos % 1000000000 };
+		pthread_cond_timedwait(&wake, &wakeMutex, &until);
+		trace_flush();
+	}
+	return NULL;
+}
+
+int trace_init(struct config_t *config) {
+	if (config->trace && parseLevels(config->trace)) {
+		return 1;
+	}
+	if (config->traceFile) {
+		out = fopen(config->traceFile, "a");
+		if (!out) {
+			perror(config->traceFile);
+			return 1;
+		}
+	}
+	if (pthread_create(&drainThread, NULL, drainThreadMain, NULL)) {
+		return 1;
+	}
+	return 0;
+}
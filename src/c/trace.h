@@ -0,0 +1,104 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUMANAKO_TRACE_H_
+#define TUMANAKO_TRACE_H_
+
+/*
+ * Leveled diagnostics for the hot paths.
+ *
+ * TRACE_DEBUG(TRACE_LOGGER, "v %d %d", batteryIndex, cellIndex) formats the message into a lock free ring if the
+ * logger's level is debug or higher. A thread empties the ring to stderr or traceFile so tracing never waits on the
+ * terminal. If the ring is full the message is dropped and counted.
+ *
+ * Levels are set per subsystem at runtime with the trace config option, eg "logger=debug,charger=info", or
+ * trace_setLevel(). Calls above TRACE_MAX_LEVEL are removed by the preprocessor, build with -DTRACE_MAX_LEVEL=1 to
+ * keep only errors and warnings.
+ */
+
+#define TRACE_LEVEL_ERROR 0
+#define TRACE_LEVEL_WARN 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+typedef enum {
+	TRACE_LOGGER, TRACE_CONSOLE, TRACE_CHARGER, TRACE_MONITOR, TRACE_CAN, TRACE_SOC, TRACE_SUBSYSTEM_COUNT
+} trace_subsystem_t;
+
+struct config_t;
+
+extern unsigned char trace_levels[TRACE_SUBSYSTEM_COUNT];
+
+#define TRACE_IS_ENABLED(subsystem, level) ((level) <= trace_levels[subsystem])
+
+#define TRACE(subsystem, level, ...) \
+	do { \
+		if (TRACE_IS_ENABLED(subsystem, level)) { \
+			trace_write(subsystem, level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+// still type checks the arguments and uses the variables but is folded away, even without optimisation
+#define TRACE_REMOVED(subsystem, level, ...) \
+	do { \
+		if (0) { \
+			trace_write(subsystem, level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define TRACE_ERROR(subsystem, ...) TRACE(subsystem, TRACE_LEVEL_ERROR, __VA_ARGS__)
+
+#if TRACE_MAX_LEVEL >= TRACE_LEVEL_WARN
+#define TRACE_WARN(subsystem, ...) TRACE(subsystem, TRACE_LEVEL_WARN, __VA_ARGS__)
+#else
+#define TRACE_WARN(subsystem, ...) TRACE_REMOVED(subsystem, TRACE_LEVEL_WARN, __VA_ARGS__)
+#endif
+
+#if TRACE_MAX_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(subsystem, ...) TRACE(subsystem, TRACE_LEVEL_INFO, __VA_ARGS__)
+#else
+#define TRACE_INFO(subsystem, ...) TRACE_REMOVED(subsystem, TRACE_LEVEL_INFO, __VA_ARGS__)
+#endif
+
+#if TRACE_MAX_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(subsystem, ...) TRACE(subsystem, TRACE_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define TRACE_DEBUG(subsystem, ...) TRACE_REMOVED(subsystem, TRACE_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+
+/** Read the trace levels and file from the config and start writing, @return 0 on success */
+int trace_init(struct config_t *config);
+
+void trace_setLevel(trace_subsystem_t subsystem, unsigned char level);
+
+/** Use the TRACE macros rather than calling this directly so disabled levels cost nothing */
+void trace_write(trace_subsystem_t subsystem, unsigned char level, const char *format, ...)
+		__attribute__ ((format (printf, 3, 4)));
+
+/** Write out anything still in the ring */
+void trace_flush();
+
+/** @return the number of messages dropped because the ring was full */
+unsigned long trace_getDropped();
+
+#endif /* TUMANAKO_TRACE_H_ */
@@ -17,8 +17,17 @@
  along with the Tumanako EVD5 BMS.  If not, see
  <http://www.gnu.org/licenses/>.
  */
+#include <math.h>
+
 #include "util.h"
 
+#define MAX_SCALE 18
+
+static const unsigned long long powersOfTen[MAX_SCALE + 1] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+		1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+		10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+		1000000000000000000ULL };
+
 /* return a double representation of the passed value divided by 1000. */
 double milliToDouble(unsigned short s) {
 	return ((double) s) / 1000;
@@ -87,3 +96,70 @@ unsigned long bufToLongLE(__u8 *c) {
 	result = result | *c;
 	return result;
 }
+
+/**
+ * printf rounds the double it is passed rather than the decimal we started with so a value exactly halfway between
+ * two outputs goes whichever way the nearest double to magnitude / 10^scale lies, or to even if that is exact.
+ */
+static unsigned char isHalfRoundedUp(unsigned long long magnitude, unsigned char scale, unsigned long long rounded) {
+	double divisor = (double) powersOfTen[scale];
+	double quotient = (double) magnitude / divisor;
+	// the product is exact inside fma so only the sign of the error survives the rounding
+	double error = fma(quotient, divisor, -(double) magnitude);
+	if (error != 0) {
+		return error > 0;
+	}
+	return rounded & 1;
+}
+
+int formatFixed(char *buf, long long value, unsigned char scale, unsigned char decimals, unsigned char width) {
+	unsigned char negative = value < 0;
+	unsigned long long magnitude = negative ? -(unsigned long long) value : (unsigned long long) value;
+	unsigned long long rounded = magnitude;
+	unsigned char zeros = 0;
+	if (scale > MAX_SCALE) {
+		scale = MAX_SCALE;
+	}
+	if (decimals < scale) {
+		unsigned long long divisor = powersOfTen[scale - decimals];
+		unsigned long long dropped = magnitude % divisor;
+		rounded = magnitude / divisor;
+		if (dropped > divisor / 2 || (dropped == divisor / 2 && isHalfRoundedUp(magnitude, scale, rounded))) {
+			rounded++;
+		}
+	} else {
+		zeros = decimals - scale;
+	}
+
+	// digits are generated backwards, 20 for the integer part, a point and the decimals
+	char digits[20 + 1 + 255];
+	char *p = digits + sizeof(digits);
+	for (unsigned char i = 0; i < zeros; i++) {
+		*--p = '0';
+	}
+	for (unsigned char i = zeros; i < decimals; i++) {
+		*--p = (char) ('0' + rounded % 10);
+		rounded /= 10;
+	}
+	if (decimals) {
+		*--p = '.';
+	}
+	do {
+		*--p = (char) ('0' + rounded % 10);
+		rounded /= 10;
+	} while (rounded);
+
+	int length = digits + sizeof(digits) - p + negative;
+	char *out = buf;
+	for (int i = length; i < width; i++) {
+		*out++ = ' ';
+	}
+	if (negative) {
+		*out++ = '-';
+	}
+	while (p < digits + sizeof(digits)) {
+		*out++ = *p++;
+	}
+	*out = 0;
+	return out - buf;
+}
@@ -32,4 +32,13 @@ unsigned short bufToShortLE(__u8 *c);
 unsigned long bufToLong(__u8 *c);
 unsigned long bufToLongLE(__u8 *c);
 
+/*
+ * Write value / 10^scale with the given number of decimals, right aligned to width, followed by a NUL. The characters
+ * are the same as printf("%*.*f", width, decimals, value / 1e<scale>) for |value| < 2^53, including how halfway
+ * cases are rounded, but no double conversion, locale or varargs is involved.
+ *
+ * @return the number of characters written, not including the NUL
+ */
+int formatFixed(char *buf, long long value, unsigned char scale, unsigned char decimals, unsigned char width);
+
 #endif /* TUMANAKO_UTIL_H_ */
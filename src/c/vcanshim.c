@@ -0,0 +1,164 @@
+/*
+ Copyright 2013 Tom Parker
+
+ This file is part of the Tumanako EVD5 BMS.
+
+ The Tumanako EVD5 BMS is free software: you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, either version 3 of the License,
+ or (at your option) any later version.
+
+ The Tumanako EVD5 BMS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with the Tumanako EVD5 BMS.  If not, see
+ <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A stand in for a vcan interface where the kernel has no CAN support, preloaded into canbench:
+ *
+ *   make libvcanshim.so canbench && LD_PRELOAD=./libvcanshim.so ./canbench -i vcan0
+ *
+ * CAN_RAW sockets become UDP sockets on the loopback interface. A frame written to one is sent to every other socket
+ * bound to the interface, as vcan does, and SO_TIMESTAMP and recvmsg() are handled by the kernel as usual. Frames are
+ * dropped when a receiver's socket buffer is full rather than when a CAN queue is, so rates and latencies are
+ * indicative of a real vcan rather than the same.
+ */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <linux/can.h>
+
+#define SHIM_INTERFACE "vcan0"
+#define SHIM_IFINDEX 1
+#define MAX_SOCKETS 1024
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// 0 if the descriptor isn't one of ours, -1 if it is but isn't bound yet, otherwise the port it is bound to
+static int ports[MAX_SOCKETS];
+
+static int (*realSocket)(int, int, int);
+static int (*realIoctl)(int, unsigned long, void *);
+static int (*realBind)(int, const struct sockaddr *, socklen_t);
+static ssize_t (*realWrite)(int, const void *, size_t);
+static int (*realClose)(int);
+
+static void __attribute__ ((constructor)) init() {
+	realSocket = dlsym(RTLD_NEXT, "socket");
+	realIoctl = dlsym(RTLD_NEXT, "ioctl");
+	realBind = dlsym(RTLD_NEXT, "bind");
+	realWrite = dlsym(RTLD_NEXT, "write");
+	realClose = dlsym(RTLD_NEXT, "close");
+}
+
+static int isShimSocket(int fd) {
+	return fd >= 0 && fd < MAX_SOCKETS && __atomic_load_n(ports + fd, __ATOMIC_ACQUIRE) != 0;
+}
+
+int socket(int domain, int type, int protocol) {
+	if (domain != PF_CAN) {
+		return realSocket(domain, type, protocol);
+	}
+	int fd = realSocket(AF_INET, SOCK_DGRAM, 0);
+	if (fd >= MAX_SOCKETS) {
+		realClose(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	if (fd >= 0) {
+		__atomic_store_n(ports + fd, -1, __ATOMIC_RELEASE);
+	}
+	return fd;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+	va_list args;
+	va_start(args, request);
+	void *arg = va_arg(args, void *);
+	va_end(args);
+	if (!isShimSocket(fd) || (request != SIOCGIFINDEX && request != SIOCGIFFLAGS)) {
+		return realIoctl(fd, request, arg);
+	}
+	struct ifreq *ifr = arg;
+	if (strcmp(ifr->ifr_name, SHIM_INTERFACE)) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (request == SIOCGIFINDEX) {
+		ifr->ifr_ifindex = SHIM_IFINDEX;
+	} else {
+		ifr->ifr_flags = IFF_UP | IFF_RUNNING | IFF_NOARP;
+	}
+	return 0;
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t length) {
+	if (!isShimSocket(fd)) {
+		return realBind(fd, addr, length);
+	}
+	const struct sockaddr_can *canAddr = (const struct sockaddr_can *) addr;
+	if (canAddr->can_family != AF_CAN || canAddr->can_ifindex != SHIM_IFINDEX) {
+		errno = ENODEV;
+		return -1;
+	}
+	struct sockaddr_in in;
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t inLength = sizeof(in);
+	if (realBind(fd, (struct sockaddr *) &in, sizeof(in)) || getsockname(fd, (struct sockaddr *) &in, &inLength)) {
+		return -1;
+	}
+	__atomic_store_n(ports + fd, ntohs(in.sin_port), __ATOMIC_RELEASE);
+	return 0;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+	if (!isShimSocket(fd)) {
+		return realWrite(fd, buf, count);
+	}
+	if (count != sizeof(struct can_frame)) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	pthread_mutex_lock(&mutex);
+	for (int i = 0; i < MAX_SOCKETS; i++) {
+		int port = __atomic_load_n(ports + i, __ATOMIC_ACQUIRE);
+		if (i != fd && port > 0) {
+			to.sin_port = htons(port);
+			// like vcan a receiver with a full queue just misses the frame
+			sendto(fd, buf, count, MSG_DONTWAIT, (struct sockaddr *) &to, sizeof(to));
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return count;
+}
+
+int close(int fd) {
+	if (isShimSocket(fd)) {
+		pthread_mutex_lock(&mutex);
+		__atomic_store_n(ports + fd, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&mutex);
+	}
+	return realClose(fd);
+}